@@ -0,0 +1,258 @@
+#!/bin/sh
+#
+# Copyright (c) 2012-2022, John Mehr <jmehr@umn.edu>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+# $FreeBSD$
+#
+# Replays recorded pack files through gitup without touching the network and
+# reports the time spent in each phase of the run.
+#
+# Usage: bench.sh [path to gitup]
+#
+# The first run records a clone, a small pull and a large pull of a generated
+# sample repository (this step needs devel/git, but no network access) in
+# BENCH_DIR.  Later runs reuse the recorded packs, so the numbers from
+# different builds of gitup can be compared directly.  Each of the BENCH_RUNS
+# rounds clones the sample tree, applies both pulls and then repairs a
+# damaged tree from the object store.  The per-phase statistics of every run
+# are saved in BENCH_DIR/results.jsonl and the best wall time of each phase is
+# summarized at the end.
+#
+# Environment:
+#   BENCH_DIR    Where the packs, trees and results live (/tmp/gitup-bench).
+#   BENCH_FILES  Number of files in the sample repository (20000).
+#   BENCH_RUNS   Number of rounds to run (3).
+
+set -e
+
+GITUP=${1:-gitup}
+BENCH_DIR=${BENCH_DIR:-/tmp/gitup-bench}
+BENCH_FILES=${BENCH_FILES:-20000}
+BENCH_RUNS=${BENCH_RUNS:-3}
+
+PACKS=${BENCH_DIR}/packs
+CONFIG=${BENCH_DIR}/gitup.conf
+RESULTS=${BENCH_DIR}/results.jsonl
+
+# Write the contents of the sample files, seeded so every run is identical.
+
+generate_files()
+{
+	awk -v first="$1" -v last="$2" -v step="$3" -v seed="$4" 'BEGIN {
+		split("alpha beta gamma delta port make sys conf kernel lib", word, " ");
+
+		for (f = first; f <= last; f += step) {
+			path = sprintf("dir%03d/file%05d.c", f % 200, f);
+			lines = (f * 7 + seed) % 80 + 1;
+
+			for (l = 0; l < lines; l++) {
+				text = sprintf("%d:", l);
+
+				for (w = 0; w < 10; w++)
+					text = text " " word[(f * 31 + l * 17 + w * 13 + seed) % 10 + 1];
+
+				print text > path;
+			}
+
+			close(path);
+		}
+	}'
+}
+
+# Build the sample repository and record one pack file for each update.
+
+record_packs()
+{
+	echo "# Recording packs in ${PACKS}"
+
+	rm -rf "${BENCH_DIR}/repo" "${PACKS}"
+	mkdir -p "${BENCH_DIR}/repo" "${PACKS}"
+	cd "${BENCH_DIR}/repo"
+
+	export GIT_AUTHOR_NAME=bench GIT_AUTHOR_EMAIL=bench@localhost
+	export GIT_COMMITTER_NAME=bench GIT_COMMITTER_EMAIL=bench@localhost
+	export GIT_AUTHOR_DATE="2022-01-01T00:00:00Z" GIT_COMMITTER_DATE="2022-01-01T00:00:00Z"
+
+	git init -q
+
+	x=0
+	while [ ${x} -lt 200 ]; do
+		mkdir -p "$(printf 'dir%03d' ${x})"
+		x=$((x + 1))
+	done
+
+	generate_files 0 $((BENCH_FILES - 1)) 1 0
+	git add -A
+	git commit -q -m clone
+	clone=$(git rev-parse HEAD)
+
+	generate_files 0 $((BENCH_FILES - 1)) $((BENCH_FILES / 10 + 1)) 1
+	git add -A
+	git commit -q -m "small pull"
+	small=$(git rev-parse HEAD)
+
+	generate_files 0 $((BENCH_FILES - 1)) 4 2
+	generate_files ${BENCH_FILES} $((BENCH_FILES + BENCH_FILES / 40)) 1 2
+	git ls-files | awk 'NR % 50 == 3' | xargs rm -f
+	git add -A
+	git commit -q -m "large pull"
+	large=$(git rev-parse HEAD)
+
+	echo ${clone} | git pack-objects -q --revs --delta-base-offset --stdout > "${PACKS}/bench-${clone}.pack"
+	printf '%s\n^%s\n' ${small} ${clone} | git pack-objects -q --revs --thin --delta-base-offset --stdout > "${PACKS}/bench-${small}.pack"
+	printf '%s\n^%s\n' ${large} ${small} | git pack-objects -q --revs --thin --delta-base-offset --stdout > "${PACKS}/bench-${large}.pack"
+
+	printf 'clone %s\nsmall_pull %s\nlarge_pull %s\n' ${clone} ${small} ${large} > "${PACKS}/manifest"
+
+	cd - > /dev/null
+}
+
+# Run gitup for one scenario and tag its statistics with the scenario name.
+
+run_scenario()
+{
+	scenario=$1
+	shift
+
+	status=0
+	"${GITUP}" bench -C "${CONFIG}" -T "$@" 2> "${BENCH_DIR}/stderr" || status=$?
+
+	if [ ${status} -ne 0 ] && [ ${status} -ne 2 ]; then
+		cat "${BENCH_DIR}/stderr" >&2
+		echo "! ${scenario} failed with exit status ${status}" >&2
+		exit 1
+	fi
+
+	sed -n -e "s/^{/{\"scenario\":\"${scenario}\",\"run\":${run},/p" \
+		"${BENCH_DIR}/stderr" >> "${RESULTS}"
+}
+
+mkdir -p "${BENCH_DIR}"
+
+if [ ! -f "${PACKS}/manifest" ]; then
+	record_packs
+fi
+
+clone=$(awk '$1 == "clone" { print $2 }' "${PACKS}/manifest")
+small=$(awk '$1 == "small_pull" { print $2 }' "${PACKS}/manifest")
+large=$(awk '$1 == "large_pull" { print $2 }' "${PACKS}/manifest")
+
+cat > "${CONFIG}" << EOF
+{
+	"bench" : {
+		"host"             : "localhost",
+		"port"             : 443,
+		"repository_path"  : "/bench.git",
+		"branch"           : "main",
+		"target_directory" : "${BENCH_DIR}/tree",
+		"work_directory"   : "${BENCH_DIR}/work",
+		"object_store"     : true,
+		"verbosity"        : 0,
+	}
+}
+EOF
+
+: > "${RESULTS}"
+
+run=1
+while [ ${run} -le ${BENCH_RUNS} ]; do
+	echo "# Run ${run} of ${BENCH_RUNS}"
+
+	rm -rf "${BENCH_DIR}/tree" "${BENCH_DIR}/work"
+	mkdir -p "${BENCH_DIR}/work"
+
+	run_scenario clone -u "${PACKS}/bench-${clone}.pack"
+	run_scenario small_pull -u "${PACKS}/bench-${small}.pack"
+	run_scenario large_pull -u "${PACKS}/bench-${large}.pack"
+
+	# Damage the tree and restore it from the object store.
+
+	find "${BENCH_DIR}/tree" -name 'file*1.c' | awk 'NR % 20 == 1' | xargs rm -f
+	find "${BENCH_DIR}/tree" -name 'file*2.c' | awk 'NR % 20 == 1' | \
+		while read -r file; do echo damaged >> "${file}"; done
+
+	run_scenario repair -r -u "${PACKS}/bench-${large}.pack"
+
+	run=$((run + 1))
+done
+
+# Make sure the replayed tree matches the sample repository when it is around.
+
+if [ -d "${BENCH_DIR}/repo/.git" ]; then
+	rm -rf "${BENCH_DIR}/check"
+	mkdir -p "${BENCH_DIR}/check"
+	git -C "${BENCH_DIR}/repo" archive ${large} | tar -xf - -C "${BENCH_DIR}/check"
+
+	if ! diff -r -x .gituprevision "${BENCH_DIR}/check" "${BENCH_DIR}/tree" > /dev/null; then
+		echo "! The replayed tree does not match commit ${large}" >&2
+		exit 1
+	fi
+fi
+
+# Display the best wall time of each phase across the runs.
+
+awk '
+	function field(name,    start) {
+		if (!match($0, "\"" name "\":(\"[^\"]*\"|[0-9.]+)"))
+			return "";
+
+		start = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3);
+		gsub(/"/, "", start);
+		return start;
+	}
+
+	{
+		key = field("scenario") SUBSEP field("phase");
+		wall = field("wall") + 0;
+
+		if (!(key in best)) {
+			order[++keys] = key;
+			best[key] = wall;
+		} else if (wall < best[key]) {
+			best[key] = wall;
+		}
+
+		rss[field("scenario")] = field("max_rss_kb");
+	}
+
+	END {
+		printf "%-12s %-24s %10s\n", "scenario", "phase", "wall (s)";
+
+		for (k = 1; k <= keys; k++) {
+			split(order[k], part, SUBSEP);
+
+			if ((k > 1) && (part[1] != last))
+				printf "%-12s %-24s %10s KB\n", last, "peak rss", rss[last];
+
+			printf "%-12s %-24s %10.3f\n", part[1], part[2], best[order[k]];
+			last = part[1];
+		}
+
+		if (keys > 0)
+			printf "%-12s %-24s %10s KB\n", last, "peak rss", rss[last];
+	}
+' "${RESULTS}"
+
+echo "# Results saved in ${RESULTS}"
@@ -26,9 +26,15 @@
  * $FreeBSD$
  */
 
+#include <sys/param.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/tree.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <openssl/evp.h>
@@ -46,6 +52,8 @@
 #include <fcntl.h>
 #include <libutil.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -57,16 +65,28 @@
 #define GITUP_VERSION     "0.98"
 #define BUFFER_UNIT_SMALL  4096
 #define BUFFER_UNIT_LARGE  1048576
+#define CACHE_SEGMENT_SIZE (64 * BUFFER_UNIT_LARGE)
+#define ARENA_BLOCK_SIZE   BUFFER_UNIT_LARGE
 #define IGNORE_FORCE_READ  1
 #define IGNORE_SKIP_DELETE 2
+#define IGNORE_DIRECTORY   1
+#define IGNORE_CONTENTS    2
+#define PACK_HEADER        0
+#define PACK_OBJECT_HEADER 1
+#define PACK_OBJECT_DATA   2
+#define PACK_TRAILER       3
+#define PACK_DONE          4
+#define STORE_HEADER_SIZE  16
+#define STORE_FANOUT_SIZE  1024
+#define REMOTE_HEADER_SIZE 32
+#define REMOTE_ENTRY_SIZE  32
 
 #ifndef CONFIG_FILE_PATH
 #define CONFIG_FILE_PATH "./gitup.conf"
 #endif
 
 struct object_node {
-	RB_ENTRY(object_node) link;
-	char      *hash;
+	char       hash[20];
 	uint8_t    type;
 	uint32_t   index;
 	uint32_t   index_delta;
@@ -75,28 +95,154 @@ struct object_node {
 	off_t      offset_cache;
 	char      *buffer;
 	uint32_t   buffer_size;
-	char     **parent;
+	char      *parent;
 	uint8_t    parents;
+	bool       lazy;
+	uint32_t   packed_size;
 };
 
 struct file_node {
-	RB_ENTRY(file_node) link_hash;
 	RB_ENTRY(file_node) link_path;
 	mode_t  mode;
-	char   *hash;
+	char    hash[20];
 	char   *path;
 	bool    keep;
 	bool    save;
 };
 
+struct index_node {
+	RB_ENTRY(index_node) link;
+	char            *path;
+	char             hash[20];
+	mode_t           mode;
+	off_t            size;
+	struct timespec  mtime;
+	struct timespec  ctime;
+	ino_t            inode;
+};
+
+struct cache_node {
+	RB_ENTRY(cache_node)   link;
+	TAILQ_ENTRY(cache_node) lru;
+	uint32_t               index;
+	uint8_t                type;
+	char                  *buffer;
+	uint32_t               buffer_size;
+};
+
+typedef struct {
+	struct object_node *delta;
+	char               *buffer;
+	char                hash[20];
+	uint32_t            buffer_size;
+	uint8_t             type;
+} delta_job;
+
 typedef struct {
 	regex_t *pattern;
+	char    *literal;
 	bool     negate;
+	uint8_t  subtree;
 } ignore_node;
 
+typedef struct {
+	char *path;
+	int   match;
+} ignore_verdict;
+
+typedef struct {
+	char   *path;
+	size_t  length;
+	int     fd;
+	bool    atomic;
+	bool    deferred;
+} directory_handle;
+
+typedef struct {
+	char     hash[20];
+	uint64_t offset;
+} store_entry;
+
+typedef struct {
+	uint32_t   code;
+	void      *item;
+} hash_slot;
+
+typedef struct {
+	hash_slot *slot;
+	uint32_t   slots;
+	uint32_t   items;
+} hash_table;
+
+typedef struct {
+	pthread_mutex_t   lock;
+	char            **block;
+	uint32_t          blocks;
+	size_t            used;
+	size_t            size;
+} arena;
+
+typedef struct {
+	pthread_mutex_t   lock;
+	pthread_cond_t    ready;
+	pthread_cond_t    idle;
+	void            **item;
+	uint32_t          items;
+	uint32_t          next;
+	uint32_t          completed;
+	bool              done;
+} work_queue;
+
+typedef struct {
+	EVP_MD_CTX *context;
+	z_stream   stream;
+	bool       stream_ready;
+	bool       lazy;
+	EVP_MD_CTX *object_context;
+	uint32_t   packed_size;
+	uint32_t   packed_capacity;
+	uint8_t    state;
+	char       header[64];
+	uint32_t   header_size;
+	uint32_t   position;
+	uint32_t   total_objects;
+	uint32_t   objects;
+	uint8_t    object_type;
+	uint32_t   object_size;
+	uint32_t   offset_pack;
+	uint32_t   index_delta;
+	char      *ref_delta_hash;
+	char      *buffer;
+	uint32_t   buffer_size;
+	uint32_t  *offset;
+	uint32_t  *offset_index;
+	char       trailer[20];
+	uint32_t   trailer_size;
+	char      *save_file;
+	int        save_descriptor;
+	bool       chunked;
+	long       http_remaining;
+	char       http_line[32];
+	uint32_t   http_line_size;
+	bool       http_trailer;
+	bool       http_done;
+	char       pkt_length[5];
+	uint32_t   pkt_length_size;
+	uint32_t   pkt_remaining;
+	bool       pkt_band;
+	uint8_t    band;
+	bool       packfile;
+	char       text[BUFFER_UNIT_SMALL];
+	uint32_t   text_size;
+	uint32_t   text_line;
+} pack_stream;
+
 typedef struct {
 	SSL                 *ssl;
 	SSL_CTX             *ctx;
+	SSL_SESSION         *tls_session;
+	char                *tls_session_file;
+	bool                 reconnect;
 	int                  socket_descriptor;
 	char                *source_address;
 	char                *host;
@@ -116,6 +262,7 @@ typedef struct {
 	char                *response;
 	unsigned long        response_blocks;
 	uint32_t             response_size;
+	pack_stream         *pack;
 	bool                 clone;
 	bool                 repair;
 	struct object_node **object;
@@ -126,8 +273,16 @@ typedef struct {
 	char                *path_work;
 	char                *remote_data_file;
 	char                *remote_history_file;
+	char                *history_tip;
+	struct file_node   **remote_tree;
+	uint32_t             remote_trees;
+	char                *index_file;
+	time_t               index_time;
 	ignore_node        **ignore;
 	uint16_t             ignores;
+	char               **sparse_path;
+	uint16_t             sparse_paths;
+	bool                 filter_blobs;
 	bool                 keep_pack_file;
 	bool                 use_pack_file;
 	bool                 commit_history;
@@ -135,63 +290,180 @@ typedef struct {
 	uint8_t              display_depth;
 	char                *updating;
 	bool                 low_memory;
+	bool                 lazy_blobs;
+	bool                 atomic_writes;
+	bool                 diff_update;
 	int                  cache;
 	off_t                cache_length;
+	char               **cache_segment;
+	size_t              *cache_segment_size;
+	uint32_t             cache_segments;
+	size_t               cache_segment_used;
+	uint16_t             jobs;
+	work_queue          *scan_queue;
+	work_queue          *delta_queue;
+	work_queue          *save_queue;
+	uint32_t             delta_cache_size;
+	uint64_t             delta_cache_limit;
+	uint64_t             delta_cache_used;
+	struct timespec      phase_start;
+	struct rusage        phase_usage;
+	bool                 stats;
+	uint64_t             bytes_received;
+	uint64_t             bytes_sent;
+	uint64_t             phase_received;
+	uint64_t             phase_sent;
+	bool                 object_store;
+	char                *store_path;
+	int                  store_lock;
+	char                *store_data;
+	size_t               store_data_size;
+	char                *store_index;
+	size_t               store_index_size;
+	uint32_t             store_objects;
+	struct file_node   **store_file;
+	uint32_t             store_files;
 } connector;
 
 static void     add_ignore(connector *, const char *);
+static void     add_sparse_path(connector *, const char *);
 static void     append(char **, uint32_t *, const char *, size_t);
 static void     apply_deltas(connector *);
+static void *   arena_alloc(size_t);
+static void     arena_free(void);
+static char *   arena_strdup(const char *);
 static char *   build_clone_command(connector *);
 static char *   build_commit_command(connector *);
+static char *   build_fetch_command(char *, uint32_t);
 static char *   build_pull_command(connector *);
-static char *   build_repair_command(connector *);
-static char *   calculate_file_hash(char *, mode_t);
-static char *   calculate_object_hash(char *, uint32_t, int);
+static char *   build_repair_command(connector *, uint32_t *);
+static char *   calculate_file_hash(char *, mode_t, char *);
+static char *   cache_object(connector *, struct object_node *, char *, uint32_t);
+static int      cache_node_compare(const struct cache_node *, const struct cache_node *);
+static char *   calculate_object_hash(char *, uint32_t, int, char *);
+static void     close_directory_handle(directory_handle *);
+static void     close_pack_stream(connector *);
+static void     close_connection(connector *);
 static void     connect_server(connector *);
 static void     create_tunnel(connector *);
+static void     delta_cache_add(connector *, uint32_t, uint8_t, char *, uint32_t);
+static bool     delta_cache_copy(uint32_t, uint8_t *, char **, uint32_t *);
+static void     delta_cache_free(connector *);
+static void *   delta_worker(void *);
+static void     demux_pack_data(connector *, char *, size_t);
+static void     expand_response(connector *, size_t);
 static void     extend_updating_list(connector *, char *);
 static void     extract_command_line_want(connector *, char *);
+static char *   extract_ignore_literal(const char *);
 static void     extract_proxy_data(connector *, const char *);
 static void     extract_tree_item(struct file_node *, char **);
-static void     fetch_pack(connector *, char *);
-static int      file_node_compare_hash(const struct file_node *, const struct file_node *);
+static void     fetch_pack(connector *, char *, char *);
+static void     fetch_sparse_objects(connector *);
 static int      file_node_compare_path(const struct file_node *, const struct file_node *);
-static void     file_node_free(struct file_node *);
+static bool     file_node_match_hash(const void *, const void *);
+static bool     file_node_match_path(const void *, const void *);
+static struct file_node * find_file_hash(const char *);
+static struct file_node * find_file_path(hash_table *, const char *);
+static struct object_node * find_object(const char *);
+static void     find_sparse_objects(connector *, char *, char *, char **, uint32_t *);
+static const char * find_stored_object(connector *, const char *);
+static void     free_object_store(connector *);
 static void     get_commit_details(connector *);
+static uint32_t hash_code_digest(const char *);
+static uint32_t hash_code_path(const char *);
+static void *   hash_table_find(hash_table *, uint32_t, const void *, bool (*)(const void *, const void *));
+static void     hash_table_free(hash_table *);
+static void *   hash_table_insert(hash_table *, uint32_t, void *, const void *, bool (*)(const void *, const void *));
+static int      ignore_directory(connector *, const char *);
 static bool     ignore_file(connector *, char *, uint8_t);
-static char *   illegible_hash(char *);
-static char *   legible_hash(char *);
-static void     load_buffer(connector *, struct object_node *);
+static bool     ignore_subtree(connector *, const char *);
+static bool     ignore_verdict_match(const void *, const void *);
+static char *   illegible_hash(const char *, char *);
+static int      inflate_lazy_blob(pack_stream *);
+static void     insert_file_hash(struct file_node *);
+static void     insert_file_path(hash_table *, struct file_node *);
+static void     join_workers(connector *, pthread_t *);
+static int      index_node_compare(const struct index_node *, const struct index_node *);
+static char *   legible_hash(const char *, char *);
 static int      load_config(connector *, const char *, char **, int);
 static void     load_config_section(connector *, const ucl_object_t *);
 static void     load_file(const char *, char **, uint32_t *);
 static void     load_gitignore(connector *);
+static void     load_history_tip(connector *);
+static void     load_index(connector *);
+static void     load_local_tree(connector *);
 static void     load_object(connector *, char *, char *);
+static void     load_object_store(connector *);
+static bool     load_stored_object(connector *, char *);
 static void     load_pack(connector *, char *, bool);
+static bool     load_remote_binary(connector *, const char *, size_t);
 static void     load_remote_data(connector *);
+static void     load_remote_text(connector *);
+static void     load_tls_session(connector *);
+static bool     lookup_index(connector *, char *, struct stat *, char *);
+static void     lock_object_store(connector *, int);
 static void     make_path(char *, mode_t);
+static int      merge_section_status(int, int);
 static struct file_node * new_file_node(char *, mode_t, char *, bool, bool);
-static int      object_node_compare(const struct object_node *, const struct object_node *);
-static void     object_node_free(struct object_node *);
+static char *   object_buffer(connector *, struct object_node *);
+static bool     object_node_match(const void *, const void *);
+static void     open_connection(connector *);
+static char *   open_directory_handle(directory_handle *, char *);
+static void     open_pack_stream(connector *, char *);
+static bool     parse_object_header(pack_stream *);
 static bool     path_exists(const char *);
 static void     process_command(connector *, char *);
-static void     process_tree(connector *, int, char *, char *);
+static void     process_tree(connector *, char *, char *);
+static void     release_object_buffer(struct object_node *, char *);
 static bool     prune_tree(connector *, char *);
-static void     release_buffer(connector *, struct object_node *);
+static int      remote_tree_compare(const void *, const void *);
+static void     rename_saved_files(void);
+static void     report_phase(connector *, const char *);
+static void     resolve_delta(connector *, delta_job *);
+static int      run_sections(const char *, int *, char ***, int);
 static void     save_commit_history(connector *);
-static void     save_file(char *, mode_t, char *, uint64_t, int, int);
+static void     save_file(char *, mode_t, char *, uint64_t, int, int, bool);
+static void     save_file_data(directory_handle *, char *, mode_t, char *, uint64_t);
+static void     save_file_directory(char *);
+static void     save_file_display(char *, int, int);
+static void     save_index(connector *);
+static void     retain_remote_tree(connector *, char *, char *);
+static void     retain_stored_file(connector *, struct file_node *);
+static void     save_object_store(connector *);
 static void     save_objects(connector *);
+static void     save_remote_data(connector *);
 static void     save_repairs(connector *);
+static void     save_tls_session(connector *);
+static void *   save_worker(void *);
 static void     scan_local_repository(connector *, char *);
+static void     scan_local_tree(connector *);
+static void *   scan_worker(void *);
 static void     send_command(connector *, char *);
 static void     setup_ssl(connector *);
-static void     store_object(connector *, uint8_t, char *, uint32_t, uint32_t, uint32_t, char *);
+static bool     sparse_excluded(connector *, const char *);
+static pthread_t * start_workers(connector *, void *(*)(void *), void *);
+static void     start_object_hash(EVP_MD_CTX *, int, uint32_t);
+static void     stream_response(connector *, char *, size_t);
+static int      store_entry_compare(const void *, const void *);
+static int      store_file_compare(const void *, const void *);
+static struct object_node * store_lazy_blob(connector *, pack_stream *);
+static struct object_node * store_object(connector *, uint8_t, char *, uint32_t, uint32_t, uint32_t, char *, char *);
+static void     temporary_file_name(const char *, char *, size_t);
 static char *   trim_path(char *, int, bool *);
 static uint32_t unpack_delta_integer(char *, uint32_t *, uint8_t);
 static uint32_t unpack_integer(char *, uint32_t *);
-static void     unpack_objects(connector *);
+static void     unpack_objects(connector *, char *, size_t);
 static void     usage(const char *);
+static void     work_queue_add(work_queue *, void *);
+static void     work_queue_complete(work_queue *);
+static void     write_stored_object(int, const char *, uint32_t, uint64_t *);
+static void     work_queue_finish(work_queue *);
+static void     work_queue_free(work_queue *);
+static work_queue * work_queue_new(void);
+static void *   work_queue_next(work_queue *);
+static void     work_queue_wait(work_queue *);
+
+static arena Arena = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
 
 
 /*
@@ -208,45 +480,104 @@ file_node_compare_path(const struct file_node *a, const struct file_node *b)
 
 
 static int
-file_node_compare_hash(const struct file_node *a, const struct file_node *b)
+index_node_compare(const struct index_node *a, const struct index_node *b)
 {
-	return (strcmp((a && a->hash ? a->hash : ""), (b && b->hash ? b->hash : "")));
+	return (strcmp((a ? a->path : ""), (b ? b->path : "")));
 }
 
 
 static int
-object_node_compare(const struct object_node *a, const struct object_node *b)
+cache_node_compare(const struct cache_node *a, const struct cache_node *b)
 {
-	return (strcmp((a && a->hash ? a->hash : ""), (b && b->hash ? b->hash : "")));
+	return ((a->index > b->index) - (a->index < b->index));
 }
 
 
 /*
- * node_free
+ * arena_alloc
  *
- * Functions that free the memory used by tree nodes.
+ * Function that hands out memory for tree nodes, paths and checksums from
+ * large blocks that are only released, all at once, by arena_free.
  */
 
-static void
-file_node_free(struct file_node *node)
+static void *
+arena_alloc(size_t size)
+{
+	char   *memory = NULL;
+	size_t  block_size = ARENA_BLOCK_SIZE;
+
+	size = (size + 15) & ~(size_t)15;
+
+	pthread_mutex_lock(&Arena.lock);
+
+	if ((Arena.blocks == 0) || (Arena.used + size > Arena.size)) {
+		if (Arena.blocks % BUFFER_UNIT_SMALL == 0)
+			if ((Arena.block = (char **)realloc(Arena.block, (Arena.blocks + BUFFER_UNIT_SMALL) * sizeof(char *))) == NULL)
+				err(EXIT_FAILURE, "arena_alloc: realloc");
+
+		if (size > block_size)
+			block_size = size;
+
+		if ((Arena.block[Arena.blocks++] = (char *)malloc(block_size)) == NULL)
+			err(EXIT_FAILURE, "arena_alloc: malloc");
+
+		Arena.used = 0;
+		Arena.size = block_size;
+	}
+
+	memory      = Arena.block[Arena.blocks - 1] + Arena.used;
+	Arena.used += size;
+
+	pthread_mutex_unlock(&Arena.lock);
+
+	return (memory);
+}
+
+
+/*
+ * arena_strdup
+ *
+ * Function that copies a string into the arena.
+ */
+
+static char *
+arena_strdup(const char *string)
 {
-	free(node->hash);
-	free(node->path);
-	free(node);
+	char   *copy = NULL;
+	size_t  length = 0;
+
+	if (string == NULL)
+		return (NULL);
+
+	length = strlen(string) + 1;
+	copy   = (char *)arena_alloc(length);
+
+	memcpy(copy, string, length);
+
+	return (copy);
 }
 
 
+/*
+ * arena_free
+ *
+ * Procedure that releases everything allocated from the arena.
+ */
+
 static void
-object_node_free(struct object_node *node)
+arena_free(void)
 {
-	for (int x = 0; x < node->parents; x++)
-		free(node->parent[x]);
+	uint32_t x = 0;
 
-	free(node->parent);
-	free(node->hash);
-	free(node->ref_delta_hash);
-	free(node->buffer);
-	free(node);
+	for (x = 0; x < Arena.blocks; x++)
+		free(Arena.block[x]);
+
+	free(Arena.block);
+
+	Arena.block  = NULL;
+	Arena.blocks = 0;
+	Arena.used   = 0;
+	Arena.size   = 0;
 }
 
 
@@ -258,2384 +589,5660 @@ static RB_HEAD(Tree_Local_Path, file_node) Local_Path = RB_INITIALIZER(&Local_Pa
 RB_PROTOTYPE(Tree_Local_Path, file_node, link_path, file_node_compare_path)
 RB_GENERATE(Tree_Local_Path,  file_node, link_path, file_node_compare_path)
 
-static RB_HEAD(Tree_Local_Hash, file_node) Local_Hash = RB_INITIALIZER(&Local_Hash);
-RB_PROTOTYPE(Tree_Local_Hash, file_node, link_hash, file_node_compare_hash)
-RB_GENERATE(Tree_Local_Hash,  file_node, link_hash, file_node_compare_hash)
-
-static RB_HEAD(Tree_Objects, object_node) Objects = RB_INITIALIZER(&Objects);
-RB_PROTOTYPE(Tree_Objects, object_node, link, object_node_compare)
-RB_GENERATE(Tree_Objects,  object_node, link, object_node_compare)
-
 static RB_HEAD(Tree_Trim_Path, file_node) Trim_Path = RB_INITIALIZER(&Trim_Path);
 RB_PROTOTYPE(Tree_Trim_Path, file_node, link_path, file_node_compare_path)
 RB_GENERATE(Tree_Trim_Path,  file_node, link_path, file_node_compare_path)
 
+static RB_HEAD(Tree_Index, index_node) Index = RB_INITIALIZER(&Index);
+RB_PROTOTYPE(Tree_Index, index_node, link, index_node_compare)
+RB_GENERATE(Tree_Index,  index_node, link, index_node_compare)
+
+static RB_HEAD(Tree_Delta_Cache, cache_node) Delta_Cache = RB_INITIALIZER(&Delta_Cache);
+RB_PROTOTYPE(Tree_Delta_Cache, cache_node, link, cache_node_compare)
+RB_GENERATE(Tree_Delta_Cache,  cache_node, link, cache_node_compare)
+
+static TAILQ_HEAD(Delta_Cache_LRU, cache_node) Delta_Cache_LRU = TAILQ_HEAD_INITIALIZER(Delta_Cache_LRU);
+static pthread_mutex_t Delta_Cache_Lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
- * release_buffer
- *
- * Function that frees an object buffer.
+ * The path trees are only walked when sorted output is needed, while every
+ * point lookup goes through the (unordered) hash tables.
  */
 
-static void release_buffer(connector *session, struct object_node *obj)
-{
-	if (session->low_memory) {
-		free(obj->buffer);
-		obj->buffer = NULL;
-	}
-}
+static hash_table Objects           = { NULL, 0, 0 };
+static hash_table Local_Hash        = { NULL, 0, 0 };
+static hash_table Local_Path_Table  = { NULL, 0, 0 };
+static hash_table Remote_Path_Table = { NULL, 0, 0 };
+static hash_table Ignore_Directory  = { NULL, 0, 0 };
 
 
 /*
- * load_buffer
+ * hash_code
  *
- * Function that loads an object buffer from disk.
+ * Functions that reduce a key to the 32 bit code that places it in a hash
+ * table.  SHA checksums are already evenly distributed, so their first four
+ * bytes are used as is, while paths are run through FNV-1a.
  */
 
-static void load_buffer(connector *session, struct object_node *object)
+static uint32_t
+hash_code_digest(const char *hash)
 {
-	ssize_t bytes_read = 0;
+	uint32_t code = 0;
+
+	memcpy(&code, hash, sizeof(code));
 
-	if ((session->low_memory) && (!object->buffer)) {
-		object->buffer = (char *)malloc(object->buffer_size);
+	return (code);
+}
 
-		if (object->buffer == NULL)
-			err(EXIT_FAILURE, "load_buffer: malloc");
 
-		lseek(session->cache, object->offset_cache, SEEK_SET);
+static uint32_t
+hash_code_path(const char *path)
+{
+	uint32_t code = 2166136261U;
 
-		bytes_read = read(session->cache,
-			object->buffer,
-			(size_t)object->buffer_size);
+	while (*path)
+		code = (code ^ (uint8_t)*path++) * 16777619U;
 
-		if (bytes_read != (ssize_t)object->buffer_size)
-			err(EXIT_FAILURE,
-				"load_buffer: read %ld != %d",
-				(long)bytes_read,
-				object->buffer_size);
-	}
+	return (code);
 }
 
 
 /*
- * legible_hash
+ * node_match
  *
- * Function that converts a 20 byte binary SHA checksum into a 40 byte
- * human-readable SHA checksum.
+ * Functions that tell the hash tables whether an item has the key being
+ * looked up.
  */
 
-static char *
-legible_hash(char *hash_buffer)
+static bool
+object_node_match(const void *item, const void *key)
 {
-	char *hash = NULL;
-	int   x = 0;
+	return (memcmp(((const struct object_node *)item)->hash, key, 20) == 0);
+}
 
-	if ((hash = (char *)malloc(41)) == NULL)
-		err(EXIT_FAILURE, "legible_hash: malloc");
 
-	for (x = 0; x < 20; x++)
-		snprintf(&hash[x * 2], 3, "%02x", (uint8_t)hash_buffer[x]);
+static bool
+file_node_match_hash(const void *item, const void *key)
+{
+	return (memcmp(((const struct file_node *)item)->hash, key, 20) == 0);
+}
 
-	hash[40] = '\0';
 
-	return (hash);
+static bool
+file_node_match_path(const void *item, const void *key)
+{
+	return (strcmp(((const struct file_node *)item)->path, (const char *)key) == 0);
+}
+
+
+static bool
+ignore_verdict_match(const void *item, const void *key)
+{
+	return (strcmp(((const ignore_verdict *)item)->path, (const char *)key) == 0);
 }
 
 
 /*
- * illegible_hash
+ * hash_table_find
  *
- * Function that converts a 40 byte human-readable SHA checksum into a 20 byte
- * binary SHA checksum.
+ * Function that returns the item in an open addressing hash table with a
+ * matching key, or NULL if there isn't one.  Collisions are resolved by
+ * linear probing, so the search ends at the first empty slot.
  */
 
-static char *
-illegible_hash(char *hash_buffer)
+static void *
+hash_table_find(hash_table *table, uint32_t code, const void *key, bool (*match)(const void *, const void *))
 {
-	char *hash = NULL;
-	int   x = 0;
+	uint32_t x = 0, mask = table->slots - 1;
 
-	if ((hash = (char *)malloc(20)) == NULL)
-		err(EXIT_FAILURE, "illegible_hash: malloc");
+	if (table->slots == 0)
+		return (NULL);
 
-	for (x = 0; x < 20; x++)
-		hash[x] = (char)(16 * (hash_buffer[x * 2] -
-			(hash_buffer[x * 2] > 58 ? 87 : 48)) +
-			hash_buffer[x * 2 + 1] -
-			(hash_buffer[x * 2 + 1] > 58 ? 87 : 48));
+	for (x = code & mask; table->slot[x].item != NULL; x = (x + 1) & mask)
+		if ((table->slot[x].code == code) && (match(table->slot[x].item, key)))
+			return (table->slot[x].item);
 
-	return (hash);
+	return (NULL);
 }
 
 
 /*
- * ignore_file
+ * hash_table_insert
  *
- * Function that returns true if the path is in the set of "ignores".
+ * Function that adds an item to a hash table, doubling the table whenever it
+ * becomes three quarters full.  Like RB_INSERT, it leaves the table alone and
+ * returns the existing item if one with the same key is already present.
  */
 
-static bool
-ignore_file(connector *session, char *path, uint8_t flag)
+static void *
+hash_table_insert(hash_table *table, uint32_t code, void *item, const void *key, bool (*match)(const void *, const void *))
 {
-	int              x, code;
-	bool             ignore = false;
-	struct file_node find;
-
-	if (flag == IGNORE_FORCE_READ) {
-		/* Files currently in the repository cannot be ignored. */
+	hash_slot *old_slot = table->slot;
+	uint32_t   old_slots = table->slots, x = 0, y = 0, mask = 0;
 
-		find.path = path;
+	if ((uint64_t)(table->items + 1) * 4 > (uint64_t)table->slots * 3) {
+		table->slots = (old_slots ? old_slots * 2 : BUFFER_UNIT_SMALL);
 
-		if (RB_FIND(Tree_Remote_Path, &Remote_Path, &find))
-			return (false);
+		if ((table->slot = (hash_slot *)calloc(table->slots, sizeof(hash_slot))) == NULL)
+			err(EXIT_FAILURE, "hash_table_insert: calloc");
 
-		/* Files in the sys/arch/conf directories must be read. */
+		mask = table->slots - 1;
 
-		if ((strstr(path, "/sys/")) && (strstr(path, "/conf/")))
-			return (false);
-	}
+		for (x = 0; x < old_slots; x++) {
+			if (old_slot[x].item == NULL)
+				continue;
 
-	/* Check the list of ignores. */
+			for (y = old_slot[x].code & mask; table->slot[y].item != NULL; y = (y + 1) & mask)
+				;
 
-	for (x = 0; x < session->ignores; x++) {
-		code = regexec(session->ignore[x]->pattern, path, 0, NULL, 0);
+			table->slot[y] = old_slot[x];
+		}
 
-		if (code == 0) {
-			ignore = (session->ignore[x]->negate ? false : true);
-		} else if (code != REG_NOMATCH)
-			warnx("! ignore_file error: %s (error code %d)\n",
-			path,
-			code);
+		free(old_slot);
 	}
 
-	if ((ignore) && (session->verbosity > 1))
-		fprintf(stderr, " | Ignoring %s\n", path);
+	mask = table->slots - 1;
 
-	return (ignore);
+	for (x = code & mask; table->slot[x].item != NULL; x = (x + 1) & mask)
+		if ((table->slot[x].code == code) && (match(table->slot[x].item, key)))
+			return (table->slot[x].item);
+
+	table->slot[x].code = code;
+	table->slot[x].item = item;
+	table->items++;
+
+	return (NULL);
 }
 
 
 /*
- * new_file_node
+ * hash_table_free
  *
- * Function that creates a new file node.
+ * Procedure that releases a hash table's slots.  The items themselves live in
+ * the arena.
  */
 
-static struct file_node *
-new_file_node(char *path, mode_t mode, char *hash, bool keep, bool save)
+static void
+hash_table_free(hash_table *table)
 {
-	struct file_node *new_node = NULL;
-
-	new_node = (struct file_node *)malloc(sizeof(struct file_node));
-
-	if (new_node == NULL)
-		err(EXIT_FAILURE, "new_file_node: malloc");
+	free(table->slot);
 
-	new_node->mode = mode;
-	new_node->hash = hash;
-	new_node->path = path;
-	new_node->keep = keep;
-	new_node->save = save;
-
-	return (new_node);
+	table->slot  = NULL;
+	table->slots = 0;
+	table->items = 0;
 }
 
 
 /*
- * make_path
+ * find_object/find_file_hash/find_file_path
  *
- * Procedure that creates a directory and all intermediate directories if they
- * do not exist.
+ * Functions that look up objects by SHA checksum, local files by SHA checksum
+ * and local or remote files by path.
  */
 
-static void
-make_path(char *path, mode_t mode)
+static struct object_node *
+find_object(const char *hash)
 {
-	char *temp = path;
+	return ((struct object_node *)hash_table_find(&Objects,
+		hash_code_digest(hash),
+		hash,
+		object_node_match));
+}
 
-	if (mkdir(path, mode) == -1) {
-		if ((errno != ENOENT) && (errno != EEXIST))
-			err(EXIT_FAILURE, "make_path: cannot create %s", path);
 
-		/* Create any missing intermediate directories. */
+static struct file_node *
+find_file_hash(const char *hash)
+{
+	return ((struct file_node *)hash_table_find(&Local_Hash,
+		hash_code_digest(hash),
+		hash,
+		file_node_match_hash));
+}
 
-		while ((temp = strchr(temp, '/')) != NULL) {
-			if (temp != path) {
-				*temp = '\0';
 
-				if ((!path_exists(path))
-					&& (mkdir(path, mode) == -1)
-					&& (errno != EEXIST))
-						err(EXIT_FAILURE,
-							"make_path: "
-							"cannot create %s",
-							path);
+static struct file_node *
+find_file_path(hash_table *table, const char *path)
+{
+	return ((struct file_node *)hash_table_find(table,
+		hash_code_path(path),
+		path,
+		file_node_match_path));
+}
 
-				*temp = '/';
-			}
 
-			temp++;
-		}
+/*
+ * insert_file_hash/insert_file_path
+ *
+ * Procedures that add a file node to the local checksum table or to one of
+ * the path tables.
+ */
 
-	/* Create the target directory. */
+static void
+insert_file_hash(struct file_node *node)
+{
+	hash_table_insert(&Local_Hash,
+		hash_code_digest(node->hash),
+		node,
+		node->hash,
+		file_node_match_hash);
+}
 
-	if ((mkdir(path, mode) == -1) && (errno != EEXIST))
-		err(EXIT_FAILURE, "make_path: cannot create %s", path);
-	}
+
+static void
+insert_file_path(hash_table *table, struct file_node *node)
+{
+	hash_table_insert(table,
+		hash_code_path(node->path),
+		node,
+		node->path,
+		file_node_match_path);
 }
 
 
 /*
- * prune_tree
+ * work_queue
  *
- * Procedure that recursively removes a directory.
+ * Functions that manage a list of items shared between worker threads.  Items
+ * may still be added while the workers are draining the queue.  Workers that
+ * report each item they complete let work_queue_wait hand the queue over in
+ * batches, without restarting the threads for every batch.
  */
 
-static bool
-prune_tree(connector *session, char *base_path)
+static work_queue *
+work_queue_new(void)
 {
-	DIR           *directory = NULL;
-	struct dirent *entry = NULL;
-	struct stat    sb;
-	char           full_path[strlen(base_path) + 1 + MAXNAMLEN + 1];
-	size_t         length;
-	bool           pruned = true;
+	work_queue *queue = NULL;
 
-	/* Sanity check the directory to prune. */
+	if ((queue = (work_queue *)malloc(sizeof(work_queue))) == NULL)
+		err(EXIT_FAILURE, "work_queue_new: malloc");
 
-	length = strlen(session->path_target);
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->ready, NULL);
+	pthread_cond_init(&queue->idle, NULL);
 
-	if (strnstr(base_path, session->path_target, length) != base_path)
-		errc(EXIT_FAILURE, EACCES,
-			"prune_tree: %s is not located in the %s tree",
-			base_path,
-			session->path_target);
+	queue->item      = NULL;
+	queue->items     = 0;
+	queue->next      = 0;
+	queue->completed = 0;
+	queue->done      = false;
 
-	if (strnstr(base_path, "../", strlen(base_path)) != NULL)
-		errc(EXIT_FAILURE, EACCES,
-			"prune_tree: illegal path traverse in %s",
-			base_path);
+	return (queue);
+}
 
-	/* Remove the directory contents. */
 
-	if ((directory = opendir(base_path)) == NULL)
-		return pruned;
+static void
+work_queue_add(work_queue *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
 
-	while ((entry = readdir(directory)) != NULL) {
-		snprintf(full_path, sizeof(full_path),
-			"%s/%s",
-			base_path,
-			entry->d_name);
+	if (queue->items % BUFFER_UNIT_SMALL == 0)
+		if ((queue->item = (void **)realloc(queue->item, (queue->items + BUFFER_UNIT_SMALL) * sizeof(void *))) == NULL)
+			err(EXIT_FAILURE, "work_queue_add: realloc");
 
-		if (lstat(full_path, &sb) != 0)
-			err(EXIT_FAILURE,
-				"prune_tree: cannot stat() %s",
-				full_path);
+	queue->item[queue->items++] = item;
 
-		if (ignore_file(session, full_path, IGNORE_SKIP_DELETE)) {
-			pruned = false;
-			continue;
-		}
+	pthread_cond_signal(&queue->ready);
+	pthread_mutex_unlock(&queue->lock);
+}
 
-		if (S_ISDIR(sb.st_mode) != 0) {
-			if ((entry->d_namlen == 1) && (strcmp(entry->d_name, "." ) == 0))
-				continue;
 
-			if ((entry->d_namlen == 2) && (strcmp(entry->d_name, "..") == 0))
-				continue;
+static void *
+work_queue_next(work_queue *queue)
+{
+	void *item = NULL;
 
-			if (!prune_tree(session, full_path))
-				pruned = false;
-		} else {
-			if (remove(full_path) == -1)
-				err(EXIT_FAILURE,
-					"prune_tree: cannot remove %s",
-					full_path);
-		}
-	}
+	pthread_mutex_lock(&queue->lock);
 
-	closedir(directory);
+	while ((queue->next == queue->items) && (!queue->done))
+		pthread_cond_wait(&queue->ready, &queue->lock);
 
-	if (pruned && rmdir(base_path) != 0)
-		fprintf(stderr, " ! cannot remove %s\n", base_path);
+	if (queue->next < queue->items)
+		item = queue->item[queue->next++];
 
-	return pruned;
-}
+	pthread_mutex_unlock(&queue->lock);
 
+	return (item);
+}
 
-/*
- * path_exists
- *
- * Function wrapper for stat that checks to see if a path exists.
- */
 
-static bool
-path_exists(const char *path)
+static void
+work_queue_complete(work_queue *queue)
 {
-	struct stat check;
+	pthread_mutex_lock(&queue->lock);
 
-	return (stat(path, &check) == 0 ? true : false);
+	if (++queue->completed == queue->items)
+		pthread_cond_signal(&queue->idle);
 
+	pthread_mutex_unlock(&queue->lock);
 }
 
 
-/*
- * load_file
- *
- * Procedure that loads a local file into the specified buffer.
- */
-
 static void
-load_file(const char *path, char **buffer, uint32_t *buffer_size)
+work_queue_wait(work_queue *queue)
 {
-	struct stat file;
-	int         fd;
+	pthread_mutex_lock(&queue->lock);
 
-	if (stat(path, &file) == -1)
-		err(EXIT_FAILURE, "load_file: cannot find %s", path);
+	while (queue->completed < queue->items)
+		pthread_cond_wait(&queue->idle, &queue->lock);
 
-	if (file.st_size > 0) {
-		if (file.st_size > (off_t)*buffer_size) {
-			*buffer_size = (uint32_t)file.st_size;
-			*buffer = (char *)realloc(*buffer, *buffer_size + 1);
+	queue->items     = 0;
+	queue->next      = 0;
+	queue->completed = 0;
 
-			if (buffer == NULL)
-				err(EXIT_FAILURE, "load_file: malloc");
-		}
+	pthread_mutex_unlock(&queue->lock);
+}
 
-		if ((fd = open(path, O_RDONLY)) == -1)
-			err(EXIT_FAILURE, "load_file: cannot read %s", path);
 
-		if ((off_t)read(fd, *buffer, *buffer_size) != file.st_size)
-			errc(EXIT_FAILURE, EIO,
-				"load_file: problem reading %s",
-				path);
+static void
+work_queue_finish(work_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->done = true;
+	pthread_cond_broadcast(&queue->ready);
+	pthread_mutex_unlock(&queue->lock);
+}
 
-		close(fd);
 
-		*(*buffer + *buffer_size) = '\0';
-	}
+static void
+work_queue_free(work_queue *queue)
+{
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->ready);
+	pthread_cond_destroy(&queue->idle);
+	free(queue->item);
+	free(queue);
 }
 
 
 /*
- * trim_path
+ * start_workers
  *
- * Procedure that trims a path to the specified display depth.
+ * Function that starts session->jobs threads running the worker function.
  */
 
-static char *
-trim_path(char *path, int display_depth, bool *just_added)
+static pthread_t *
+start_workers(connector *session, void *(*worker)(void *), void *argument)
 {
-	struct file_node *new_node = NULL, find;
-	int               x = -1;
-	char             *trim = NULL, *trimmed_path = NULL;
+	pthread_t *thread = NULL;
+	int        x = 0, error = 0;
 
-	trimmed_path = strdup(path);
-
-	if (display_depth == 0)
-		return (trimmed_path);
+	if ((thread = (pthread_t *)malloc(session->jobs * sizeof(pthread_t))) == NULL)
+		err(EXIT_FAILURE, "start_workers: malloc");
 
-	trim = trimmed_path;
+	for (x = 0; x < session->jobs; x++)
+		if ((error = pthread_create(&thread[x], NULL, worker, argument)) != 0)
+			errc(EXIT_FAILURE, error, "start_workers: pthread_create");
 
-	while ((x++ < display_depth) && (trim != NULL))
-		trim = strchr(trim + 1, '/');
+	return (thread);
+}
 
-	if (trim)
-		*trim = '\0';
 
-	find.path = trimmed_path;
+/*
+ * join_workers
+ *
+ * Procedure that waits for all of the worker threads to finish.
+ */
 
-	if (!RB_FIND(Tree_Trim_Path, &Trim_Path, &find)) {
-		new_node = new_file_node(
-			strdup(trimmed_path),
-			0,
-			NULL,
-			false,
-			false);
+static void
+join_workers(connector *session, pthread_t *thread)
+{
+	int x = 0;
 
-		RB_INSERT(Tree_Trim_Path, &Trim_Path, new_node);
-		*just_added = true;
-	} else {
-		*just_added = false;
-	}
+	for (x = 0; x < session->jobs; x++)
+		pthread_join(thread[x], NULL);
 
-	return (trimmed_path);
+	free(thread);
 }
 
 
 /*
- * save_file
+ * cache_object
  *
- * Procedure that saves a blob/file.
+ * Function that copies an object's data into the memory mapped object cache
+ * file and returns its new location.  The file grows one segment at a time
+ * and segments are never moved, so the pointers stay valid until exit.
  */
 
-static void
-save_file(char *path, mode_t mode, char *buffer, uint64_t buffer_size, int verbosity, int display_depth)
+static char *
+cache_object(connector *session, struct object_node *object, char *buffer, uint32_t buffer_size)
 {
-	struct stat check;
+	size_t  segment_size = CACHE_SEGMENT_SIZE;
+	long    page_size = 0;
+	char   *segment = NULL;
 
-	char temp_buffer[buffer_size + 1], *trim = NULL, *display_path = NULL;
-	int  fd;
-	bool exists = false, just_added = false;
-
-	display_path = trim_path(path, display_depth, &just_added);
+	/* Map a new segment if the object doesn't fit in the current one. */
 
-	/* Create the directory, if needed. */
+	if ((session->cache_segments == 0) || (session->cache_segment_used + buffer_size > session->cache_segment_size[session->cache_segments - 1])) {
+		page_size = sysconf(_SC_PAGESIZE);
 
-	if ((trim = strrchr(path, '/')) != NULL) {
-		*trim = '\0';
+		if (buffer_size > segment_size)
+			segment_size = ((size_t)buffer_size + (size_t)page_size - 1) / (size_t)page_size * (size_t)page_size;
 
-		exists = (stat(path, &check) == 0 ? true : false);
+		if (ftruncate(session->cache, session->cache_length + (off_t)segment_size) == -1)
+			err(EXIT_FAILURE, "cache_object: ftruncate");
 
-		if (exists && !S_ISDIR(check.st_mode))
-			if (unlink(path) == 0)
-				exists = false;
+		segment = (char *)mmap(NULL,
+			segment_size,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NOSYNC,
+			session->cache,
+			session->cache_length);
 
-		if (!exists)
-			make_path(path, 0755);
+		if (segment == MAP_FAILED)
+			err(EXIT_FAILURE, "cache_object: mmap");
 
-		*trim = '/';
-	}
+		if (session->cache_segments % BUFFER_UNIT_SMALL == 0) {
+			session->cache_segment = (char **)realloc(session->cache_segment,
+				(session->cache_segments + BUFFER_UNIT_SMALL) * sizeof(char *));
 
-	/* Print the file or trimmed path. */
+			session->cache_segment_size = (size_t *)realloc(session->cache_segment_size,
+				(session->cache_segments + BUFFER_UNIT_SMALL) * sizeof(size_t));
 
-	if (verbosity > 0) {
-		exists = path_exists(path);
+			if ((session->cache_segment == NULL) || (session->cache_segment_size == NULL))
+				err(EXIT_FAILURE, "cache_object: realloc");
+		}
 
-		if ((display_depth == 0) || (just_added))
-			printf(" %c %s\n", (exists ? '*' : '+'), display_path);
+		session->cache_segment[session->cache_segments]        = segment;
+		session->cache_segment_size[session->cache_segments++] = segment_size;
+		session->cache_segment_used                            = 0;
+		session->cache_length                                 += (off_t)segment_size;
 	}
 
-	free(display_path);
+	segment = session->cache_segment[session->cache_segments - 1] + session->cache_segment_used;
 
-	if (S_ISLNK(mode)) {
-		/*
-		 * Make sure the buffer is null terminated, then save it as the
-		 * file to link to.
-		 */
+	memcpy(segment, buffer, buffer_size);
 
-		memcpy(temp_buffer, buffer, buffer_size);
-		temp_buffer[buffer_size] = '\0';
+	object->offset_cache = session->cache_length
+		- (off_t)session->cache_segment_size[session->cache_segments - 1]
+		+ (off_t)session->cache_segment_used;
 
-		if (symlink(temp_buffer, path) == -1 &&
-		    (unlink(path), symlink(temp_buffer, path) == -1))
-			err(EXIT_FAILURE,
-				"save_file: symlink failure %s -> %s",
-				path,
-				temp_buffer);
-	} else {
-		exists = (stat(path, &check) == 0 ? true : false);
+	session->cache_segment_used += buffer_size;
 
-		/* If the path exists, make sure the permissions are intact. */
+	return (segment);
+}
 
-		if (exists)
-			chmod(path, mode);
 
-		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
+/*
+ * legible_hash
+ *
+ * Function that converts a 20 byte binary SHA checksum into a 40 byte
+ * human-readable SHA checksum, stored in the 41 byte buffer passed in.
+ */
 
-		if ((fd == -1) && (errno != EEXIST))
-			err(EXIT_FAILURE,
-				"save_file: write file failure %s",
-				path);
+static char *
+legible_hash(const char *hash_buffer, char *hash)
+{
+	static const char digit[] = "0123456789abcdef";
+	int               x = 0;
 
-		chmod(path, mode);
-		write(fd, buffer, buffer_size);
-		close(fd);
+	for (x = 0; x < 20; x++) {
+		hash[x * 2]     = digit[(uint8_t)hash_buffer[x] >> 4];
+		hash[x * 2 + 1] = digit[(uint8_t)hash_buffer[x] & 0x0F];
 	}
+
+	hash[40] = '\0';
+
+	return (hash);
 }
 
 
 /*
- * calculate_object_hash
+ * illegible_hash
  *
- * Function that adds Git's "type file-size\0" header to a buffer and returns
- * the SHA checksum.
+ * Function that converts a 40 byte human-readable SHA checksum into a 20 byte
+ * binary SHA checksum, stored in the buffer passed in.  The low four bits of
+ * each digit hold its value, plus nine for the letters, which sit above 0x40,
+ * so the conversion needs no branches.
  */
 
 static char *
-calculate_object_hash(char *buffer, uint32_t buffer_size, int type)
+illegible_hash(const char *hash_buffer, char *hash)
 {
-	uint64_t    digits = buffer_size;
-	size_t      header_width = 0;
-	char       *hash = NULL, *hash_buffer = NULL, *temp_buffer = NULL;
-	const char *types[8] = {
-		"", "commit", "tree", "blob", "tag",
-		"", "ofs-delta", "ref-delta"
-		};
+	uint8_t high = 0, low = 0;
+	int     x = 0;
+
+	for (x = 0; x < 20; x++) {
+		high = (uint8_t)hash_buffer[x * 2];
+		low  = (uint8_t)hash_buffer[x * 2 + 1];
 
-	if ((hash_buffer = (char *)malloc(20)) == NULL)
-		err(EXIT_FAILURE, "calculate_object_hash: malloc");
+		hash[x] = (char)((((high & 0x0F) + 9 * (high >> 6)) << 4) |
+			((low & 0x0F) + 9 * (low >> 6)));
+	}
 
-	if ((temp_buffer = (char *)malloc(buffer_size + 24)) == NULL)
-		err(EXIT_FAILURE, "calculate_object_hash: malloc");
+	return (hash);
+}
 
-	/* Start with the git "type file-size\0" header. */
 
-	header_width = strlen(types[type]) + 3;
+/*
+ * ignore_directory
+ *
+ * Function that returns the index of the last ignore pattern that matches
+ * everything below the directory holding a path, or -1 if there isn't one.
+ * Patterns ending in "(/.*)?$" or "/.*$" that match a directory also match
+ * all of its descendants, so each directory's verdict is cached and files in
+ * ignored subtrees are settled without running these patterns again.
+ */
 
-	while ((digits /= 10) > 0)
-		header_width++;
+static int
+ignore_directory(connector *session, const char *path)
+{
+	ignore_verdict *verdict = NULL;
+	ignore_node    *node = NULL;
+	const char     *slash = strrchr(path, '/');
+	char            directory[BUFFER_UNIT_SMALL];
+	size_t          length = 0;
+	uint32_t        code = 0;
+	int             x = 0, match = -1;
 
-	snprintf(temp_buffer, header_width, "%s %u", types[type], buffer_size);
+	if ((slash == NULL) || (session->ignores == 0))
+		return (-1);
 
-	/* Then add the buffer. */
+	if ((length = (size_t)(slash - path)) + 2 > BUFFER_UNIT_SMALL)
+		return (-1);
 
-	memcpy(temp_buffer + header_width, buffer, buffer_size);
+	memcpy(directory, path, length);
+	directory[length] = '\0';
+	code = hash_code_path(directory);
 
-	/* Calculate the SHA checksum. */
+	verdict = (ignore_verdict *)hash_table_find(&Ignore_Directory,
+		code,
+		directory,
+		ignore_verdict_match);
 
-	SHA1((uint8_t *)temp_buffer,
-		buffer_size + header_width,
-		(uint8_t *)hash_buffer);
+	if (verdict != NULL)
+		return (verdict->match);
 
-	hash = legible_hash(hash_buffer);
+	/* Check the subtree patterns, starting with the one checked last. */
 
-	free(hash_buffer);
-	free(temp_buffer);
+	for (x = session->ignores - 1; (x >= 0) && (match == -1); x--) {
+		node = session->ignore[x];
 
-	return (hash);
+		if (node->subtree == 0)
+			continue;
+
+		/* "/.*$" patterns need the trailing slash of the directory. */
+
+		directory[length]     = (node->subtree == IGNORE_CONTENTS ? '/' : '\0');
+		directory[length + 1] = '\0';
+
+		if ((node->literal) && (strstr(directory, node->literal) == NULL))
+			continue;
+
+		if (regexec(node->pattern, directory, 0, NULL, 0) == 0)
+			match = x;
+	}
+
+	directory[length] = '\0';
+
+	verdict = (ignore_verdict *)arena_alloc(sizeof(ignore_verdict));
+	verdict->path  = arena_strdup(directory);
+	verdict->match = match;
+
+	hash_table_insert(&Ignore_Directory,
+		code,
+		verdict,
+		verdict->path,
+		ignore_verdict_match);
+
+	return (match);
 }
 
 
 /*
- * calculate_file_hash
+ * ignore_file
  *
- * Function that loads a local file and returns the SHA checksum.
+ * Function that returns true if the path is in the set of "ignores".  The last
+ * matching pattern decides, so only patterns that come after the directory's
+ * cached verdict and could change the current verdict are run, and only when
+ * the path contains their required literal text.
  */
 
-static char *
-calculate_file_hash(char *path, mode_t file_mode)
+static bool
+ignore_file(connector *session, char *path, uint8_t flag)
 {
-	char     *buffer = NULL, *hash = NULL, temp_path[BUFFER_UNIT_SMALL];
-	uint32_t  buffer_size = 0;
-	ssize_t   bytes_read = 0;
+	ignore_node *node = NULL;
+	int          x = 0, code = 0;
+	bool         ignore = false;
 
-	if (S_ISLNK(file_mode)) {
-		bytes_read = readlink(path, temp_path, BUFFER_UNIT_SMALL);
-		temp_path[bytes_read] = '\0';
+	if (flag == IGNORE_FORCE_READ) {
+		/* Files currently in the repository cannot be ignored. */
 
-		hash = calculate_object_hash(
-			temp_path,
-			(uint32_t)strlen(temp_path),
-			3);
-	} else {
-		load_file(path, &buffer, &buffer_size);
-		hash = calculate_object_hash(buffer, buffer_size, 3);
-		free(buffer);
+		if (find_file_path(&Remote_Path_Table, path))
+			return (false);
+
+		/* Files in the sys/arch/conf directories must be read. */
+
+		if ((strstr(path, "/conf/")) && (strstr(path, "/sys/")))
+			return (false);
 	}
 
-	return (hash);
+	/* Start with the patterns that cover the whole directory. */
+
+	if ((x = ignore_directory(session, path)) >= 0)
+		ignore = !session->ignore[x]->negate;
+
+	/* Check the rest of the list of ignores. */
+
+	for (x++; x < session->ignores; x++) {
+		node = session->ignore[x];
+
+		/* A match only matters if it would flip the verdict. */
+
+		if (node->negate != ignore)
+			continue;
+
+		if ((node->literal) && (strstr(path, node->literal) == NULL))
+			continue;
+
+		code = regexec(node->pattern, path, 0, NULL, 0);
+
+		if (code == 0) {
+			ignore = !node->negate;
+		} else if (code != REG_NOMATCH)
+			warnx("! ignore_file error: %s (error code %d)\n",
+			path,
+			code);
+	}
+
+	if ((ignore) && (session->verbosity > 1))
+		fprintf(stderr, " | Ignoring %s\n", path);
+
+	return (ignore);
 }
 
 
 /*
- * append
+ * ignore_subtree
  *
- * Procedure that appends one string to another.
+ * Function that returns true if every path below a directory is ignored and
+ * none of them are in the repository, in which case the directory's contents
+ * don't need to be scanned.
  */
 
-static void
-append(char **buffer, uint32_t *buffer_size, const char *addendum, size_t addendum_size)
+static bool
+ignore_subtree(connector *session, const char *path)
 {
-	*buffer = (char *)realloc(*buffer, *buffer_size + addendum_size + 1);
+	struct file_node find, *found = NULL;
+	char             directory[BUFFER_UNIT_SMALL];
+	size_t           length = strlen(path);
+	int              x = 0;
 
-	if (*buffer == NULL)
-		err(EXIT_FAILURE, "append: realloc");
+	if ((session->ignores == 0) || (length + 2 > BUFFER_UNIT_SMALL))
+		return (false);
 
-	memcpy(*buffer + *buffer_size, addendum, addendum_size);
-	*buffer_size += addendum_size;
-	*(*buffer + *buffer_size) = '\0';
+	snprintf(directory, sizeof(directory), "%s/", path);
+
+	/* Files in the sys/arch/conf directories must be read. */
+
+	if ((strstr(directory, "/conf/")) || (strstr(directory, "/sys/")))
+		return (false);
+
+	/*
+	 * The last pattern covering the whole directory has to ignore it and
+	 * no negated pattern after it can be allowed to bring anything back.
+	 */
+
+	if ((x = ignore_directory(session, directory)) < 0)
+		return (false);
+
+	while (x < session->ignores)
+		if (session->ignore[x++]->negate)
+			return (false);
+
+	/* Files currently in the repository cannot be ignored. */
+
+	find.path = directory;
+	found     = RB_NFIND(Tree_Remote_Path, &Remote_Path, &find);
+
+	if ((found) && (strncmp(found->path, directory, length + 1) == 0))
+		return (false);
+
+	if (session->verbosity > 1)
+		fprintf(stderr, " | Ignoring %s\n", directory);
+
+	return (true);
 }
 
 
 /*
- * extend_updating_list
+ * sparse_excluded
  *
- * Procedure that adds the path of an UPDATING file to a string.
+ * Function that returns true if a path in the local tree lies outside of the
+ * configured sparse paths and isn't a directory leading to one of them.
  */
 
-static void
-extend_updating_list(connector *session, char *path)
+static bool
+sparse_excluded(connector *session, const char *path)
 {
-	uint32_t size;
-	char     temp[BUFFER_UNIT_SMALL];
+	const char *relative = path + strlen(session->path_target);
+	const char *sparse = NULL;
+	size_t      length = 0, sparse_length = 0;
+	uint16_t    x = 0;
 
-	size = (session->updating ? (uint32_t)strlen(session->updating) : 0);
+	if (session->sparse_paths == 0)
+		return (false);
 
-	snprintf(temp, sizeof(temp), "#\t%s\n", path);
-	append(&session->updating, &size, temp, strlen(temp));
+	if (*relative == '/')
+		relative++;
+
+	if ((length = strlen(relative)) == 0)
+		return (false);
+
+	for (x = 0; x < session->sparse_paths; x++) {
+		sparse        = session->sparse_path[x];
+		sparse_length = strlen(sparse);
+
+		/* The path is inside the sparse path. */
+
+		if ((length >= sparse_length)
+			&& (strncmp(relative, sparse, sparse_length) == 0)
+			&& ((relative[sparse_length] == '\0') || (relative[sparse_length] == '/')))
+			return (false);
+
+		/* The path is a directory above the sparse path. */
+
+		if ((length < sparse_length)
+			&& (strncmp(relative, sparse, length) == 0)
+			&& (sparse[length] == '/'))
+			return (false);
+	}
+
+	return (true);
 }
 
 
 /*
- * load_remote_data
+ * new_file_node
  *
- * Procedure that loads the list of remote data and checksums, if it exists.
+ * Function that creates a new file node in the arena.  The path passed in
+ * must also be arena allocated and a missing hash is stored as all zeros.
  */
 
-static void
-load_remote_data(connector *session)
+static struct file_node *
+new_file_node(char *path, mode_t mode, char *hash, bool keep, bool save)
 {
-	struct file_node *file = NULL;
-	char     *buffer = NULL, *hash = NULL, *temp_hash = NULL;
-	char     *line = NULL, *raw = NULL, *path = NULL, *data = NULL;
-	char      temp[BUFFER_UNIT_SMALL], base_path[BUFFER_UNIT_SMALL];
-	char      item[BUFFER_UNIT_SMALL];
-	uint32_t  count = 0, buffer_size = 0, data_size = 0;
-	size_t    item_length = 0;
+	struct file_node *new_node = NULL;
 
-	load_file(session->remote_data_file, &data, &data_size);
-	raw = data;
+	new_node = (struct file_node *)arena_alloc(sizeof(struct file_node));
 
-	while ((line = strsep(&raw, "\n"))) {
-		/* The first line stores the "have". */
+	new_node->mode = mode;
+	new_node->path = path;
+	new_node->keep = keep;
+	new_node->save = save;
 
-		if (count++ == 0) {
-			session->have = strdup(line);
-			continue;
-		}
+	if (hash)
+		memcpy(new_node->hash, hash, 20);
+	else
+		memset(new_node->hash, 0, 20);
 
-		/*
-		 * Empty lines signify the end of a directory entry, so create
-		 * an obj_tree for what has been read.
-		 */
+	return (new_node);
+}
 
-		if (strlen(line) == 0) {
-			if (buffer != NULL) {
-				if (session->clone == false)
-					store_object(session,
-						2,
-						buffer,
-						buffer_size,
-						0,
-						0,
-						NULL);
 
-				buffer = NULL;
-				buffer_size = 0;
+/*
+ * make_path
+ *
+ * Procedure that creates a directory and all intermediate directories if they
+ * do not exist.
+ */
+
+static void
+make_path(char *path, mode_t mode)
+{
+	char *temp = path;
+
+	if (mkdir(path, mode) == -1) {
+		if ((errno != ENOENT) && (errno != EEXIST))
+			err(EXIT_FAILURE, "make_path: cannot create %s", path);
+
+		/* Create any missing intermediate directories. */
+
+		while ((temp = strchr(temp, '/')) != NULL) {
+			if (temp != path) {
+				*temp = '\0';
+
+				if ((!path_exists(path))
+					&& (mkdir(path, mode) == -1)
+					&& (errno != EEXIST))
+						err(EXIT_FAILURE,
+							"make_path: "
+							"cannot create %s",
+							path);
+
+				*temp = '/';
 			}
 
-			continue;
+			temp++;
 		}
 
-		/* Split the line. */
+	/* Create the target directory. */
 
-		hash = strchr(line,     '\t');
-		path = strchr(hash + 1, '\t');
+	if ((mkdir(path, mode) == -1) && (errno != EEXIST))
+		err(EXIT_FAILURE, "make_path: cannot create %s", path);
+	}
+}
 
-		if ((hash == NULL) || (path == NULL)) {
-			fprintf(stderr,
-				" ! Malformed line '%s' in %s.  Skipping...\n",
-				line,
-				session->remote_data_file);
 
-			continue;
-		} else {
-			hash++;
-			path++;
-		}
+/*
+ * prune_tree
+ *
+ * Procedure that recursively removes a directory.
+ */
 
-		*(hash -  1) = '\0';
-		*(hash + 40) = '\0';
+static bool
+prune_tree(connector *session, char *base_path)
+{
+	DIR           *directory = NULL;
+	struct dirent *entry = NULL;
+	struct stat    sb;
+	char           full_path[strlen(base_path) + 1 + MAXNAMLEN + 1];
+	size_t         length;
+	bool           pruned = true;
 
-		/* Store the file data. */
+	/* Sanity check the directory to prune. */
 
-		file = new_file_node(
-			NULL,
-			(mode_t)strtol(line, (char **)NULL, 8),
-			strdup(hash),
-			false,
-			false);
+	length = strlen(session->path_target);
 
-		if (path[strlen(path) - 1] == '/') {
-			snprintf(base_path, sizeof(base_path), "%s", path);
-			snprintf(temp, sizeof(temp), "%s", path);
-			temp[strlen(path) - 1] = '\0';
-		} else {
-			snprintf(temp, sizeof(temp), "%s%s", base_path, path);
+	if (strnstr(base_path, session->path_target, length) != base_path)
+		errc(EXIT_FAILURE, EACCES,
+			"prune_tree: %s is not located in the %s tree",
+			base_path,
+			session->path_target);
 
-			temp_hash = illegible_hash(hash);
+	if (strnstr(base_path, "../", strlen(base_path)) != NULL)
+		errc(EXIT_FAILURE, EACCES,
+			"prune_tree: illegal path traverse in %s",
+			base_path);
 
-			/*
-			 * Build the item and add it to the buffer that will
-			 * become the obj_tree for this directory.
-			 */
+	/* Remove the directory contents. */
 
-			snprintf(item, sizeof(item) - 22, "%s %s", line, path);
-			item_length = strlen(item);
-			memcpy(item + item_length + 1, temp_hash, 20);
-			item_length += 21;
-			item[item_length] = '\0';
+	if ((directory = opendir(base_path)) == NULL)
+		return pruned;
 
-			append(&buffer, &buffer_size, item, item_length);
+	while ((entry = readdir(directory)) != NULL) {
+		snprintf(full_path, sizeof(full_path),
+			"%s/%s",
+			base_path,
+			entry->d_name);
+
+		if (lstat(full_path, &sb) != 0)
+			err(EXIT_FAILURE,
+				"prune_tree: cannot stat() %s",
+				full_path);
 
-			free(temp_hash);
+		if (ignore_file(session, full_path, IGNORE_SKIP_DELETE)) {
+			pruned = false;
+			continue;
 		}
 
-		file->path = strdup(temp);
+		if (S_ISDIR(sb.st_mode) != 0) {
+			if ((entry->d_namlen == 1) && (strcmp(entry->d_name, "." ) == 0))
+				continue;
 
-		RB_INSERT(Tree_Remote_Path, &Remote_Path, file);
+			if ((entry->d_namlen == 2) && (strcmp(entry->d_name, "..") == 0))
+				continue;
+
+			if (!prune_tree(session, full_path))
+				pruned = false;
+		} else {
+			if (remove(full_path) == -1)
+				err(EXIT_FAILURE,
+					"prune_tree: cannot remove %s",
+					full_path);
+		}
 	}
 
-	/* Load the commit history. */
+	closedir(directory);
 
-	if (!path_exists(session->remote_history_file))
-		return;
+	if (pruned && rmdir(base_path) != 0)
+		fprintf(stderr, " ! cannot remove %s\n", base_path);
 
-	load_file(session->remote_history_file, &data, &data_size);
-	raw = data;
+	return pruned;
+}
 
-	while ((line = strsep(&raw, "\n"))) {
-		if (strlen(line) == 0)
-			continue;
 
-		hash = strchr(line, ' ');
+/*
+ * path_exists
+ *
+ * Function wrapper for stat that checks to see if a path exists.
+ */
 
-		if (hash) {
-			*hash = '\0';
-			*(hash + 41) = '\0';
+static bool
+path_exists(const char *path)
+{
+	struct stat check;
 
-//			insert_commit_node(strdup(hash), line);
-		}
-	}
+	return (stat(path, &check) == 0 ? true : false);
 
-	free(data);
 }
 
 
 /*
- * scan_local_repository
+ * load_file
  *
- * Procedure that recursively finds and adds local files and directories to
- * separate red-black trees.
+ * Procedure that loads a local file into the specified buffer.
  */
 
 static void
-scan_local_repository(connector *session, char *base_path)
+load_file(const char *path, char **buffer, uint32_t *buffer_size)
 {
-	DIR              *directory = NULL;
-	struct stat       file;
-	struct dirent    *entry = NULL;
-	struct file_node *new_node = NULL, find, *found = NULL;
-	char             *path = NULL, file_hash[20], *keep = NULL;
-	unsigned long     path_length = 0;
+	struct stat file;
+	int         fd;
 
-	/* Make sure the base path exists in the remote data list. */
+	if (stat(path, &file) == -1)
+		err(EXIT_FAILURE, "load_file: cannot find %s", path);
 
-	find.path = base_path;
-	found     = RB_FIND(Tree_Remote_Path, &Remote_Path, &find);
+	if (file.st_size > 0) {
+		if (file.st_size > (off_t)*buffer_size) {
+			*buffer_size = (uint32_t)file.st_size;
+			*buffer = (char *)realloc(*buffer, *buffer_size + 1);
 
-	/* Add the base path to the local trees. */
+			if (buffer == NULL)
+				err(EXIT_FAILURE, "load_file: malloc");
+		}
 
-	new_node = new_file_node(
-		strdup(base_path),
-		(found ? found->mode : 040000),
-		(found ? strdup(found->hash) : NULL),
-		(strlen(base_path) == strlen(session->path_target)),
-		false);
+		if ((fd = open(path, O_RDONLY)) == -1)
+			err(EXIT_FAILURE, "load_file: cannot read %s", path);
 
-	RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
+		if ((off_t)read(fd, *buffer, *buffer_size) != file.st_size)
+			errc(EXIT_FAILURE, EIO,
+				"load_file: problem reading %s",
+				path);
 
-	if (found)
-		RB_INSERT(Tree_Local_Hash, &Local_Hash, new_node);
+		close(fd);
 
-	/* Process the directory's contents. */
+		*(*buffer + *buffer_size) = '\0';
+	}
+}
 
-	if (stat(base_path, &file) == -1)
-		return;
 
-	if ((directory = opendir(base_path)) == NULL)
-		return;
+/*
+ * report_phase
+ *
+ * Procedure that displays the time spent in the phase that just finished
+ * and starts timing the next one.  In stats mode, the wall time, CPU time,
+ * network traffic and peak memory use of the phase are also written to
+ * stderr as a single line of JSON.
+ */
 
-	while ((entry = readdir(directory)) != NULL) {
-		if ((entry->d_namlen == 1) && (!strcmp(entry->d_name, "." )))
-			continue;
+static void
+report_phase(connector *session, const char *phase)
+{
+	struct timespec now;
+	struct rusage   usage;
+	double          secs, user, system;
+	const char     *c = NULL;
 
-		if ((entry->d_namlen == 2) && (!strcmp(entry->d_name, "..")))
-			continue;
+	if (clock_gettime(CLOCK_MONOTONIC_FAST, &now) == -1)
+		err(EXIT_FAILURE, "report_phase: clock_gettime");
 
-		path_length = strlen(base_path) + entry->d_namlen + 2;
-		path        = (char *)malloc(path_length + 1);
+	secs = (double)(now.tv_sec - session->phase_start.tv_sec) +
+		(double)(now.tv_nsec - session->phase_start.tv_nsec) * 1e-9;
 
-		if (path == NULL)
-			err(EXIT_FAILURE,
-				"scan_local_repository: malloc");
+	if (session->verbosity > 2)
+		fprintf(stderr, "# Time: %s: %.3f seconds\n", phase, secs);
 
-		snprintf(path, path_length, "%s/%s", base_path, entry->d_name);
+	if (session->stats) {
+		if (getrusage(RUSAGE_SELF, &usage) == -1)
+			err(EXIT_FAILURE, "report_phase: getrusage");
 
-		if (lstat(path, &file) == -1)
-			err(EXIT_FAILURE,
-				"scan_local_repository: cannot read %s",
-				path);
+		user = (double)(usage.ru_utime.tv_sec - session->phase_usage.ru_utime.tv_sec) +
+			(double)(usage.ru_utime.tv_usec - session->phase_usage.ru_utime.tv_usec) * 1e-6;
 
-		if (S_ISDIR(file.st_mode)) {
-			scan_local_repository(session, path);
-			free(path);
-		} else {
-			keep = strnstr(path, ".gituprevision", path_length);
+		system = (double)(usage.ru_stime.tv_sec - session->phase_usage.ru_stime.tv_sec) +
+			(double)(usage.ru_stime.tv_usec - session->phase_usage.ru_stime.tv_usec) * 1e-6;
+
+		/* Escape the section name, which comes from the configuration file. */
+
+		fprintf(stderr, "{\"section\":\"");
+
+		for (c = session->section; (c) && (*c); c++)
+			if ((*c == '"') || (*c == '\\') || ((uint8_t)*c < 0x20))
+				fprintf(stderr, "\\u%04x", (uint8_t)*c);
+			else
+				fputc(*c, stderr);
+
+		fprintf(stderr,
+			"\",\"phase\":\"%s\","
+			"\"wall\":%.6f,"
+			"\"user\":%.6f,"
+			"\"system\":%.6f,"
+			"\"bytes_received\":%ju,"
+			"\"bytes_sent\":%ju,"
+			"\"max_rss_kb\":%ld}\n",
+			phase,
+			secs,
+			user,
+			system,
+			(uintmax_t)(session->bytes_received - session->phase_received),
+			(uintmax_t)(session->bytes_sent - session->phase_sent),
+			usage.ru_maxrss);
+
+		session->phase_usage    = usage;
+		session->phase_received = session->bytes_received;
+		session->phase_sent     = session->bytes_sent;
+	}
+
+	session->phase_start = now;
+}
+
+
+/*
+ * trim_path
+ *
+ * Procedure that trims a path to the specified display depth.
+ */
+
+static char *
+trim_path(char *path, int display_depth, bool *just_added)
+{
+	struct file_node *new_node = NULL, find;
+	int               x = -1;
+	char             *trim = NULL, *trimmed_path = NULL;
+
+	trimmed_path = strdup(path);
+
+	if (display_depth == 0)
+		return (trimmed_path);
+
+	trim = trimmed_path;
+
+	while ((x++ < display_depth) && (trim != NULL))
+		trim = strchr(trim + 1, '/');
+
+	if (trim)
+		*trim = '\0';
+
+	find.path = trimmed_path;
+
+	if (!RB_FIND(Tree_Trim_Path, &Trim_Path, &find)) {
+		new_node = new_file_node(
+			arena_strdup(trimmed_path),
+			0,
+			NULL,
+			false,
+			false);
+
+		RB_INSERT(Tree_Trim_Path, &Trim_Path, new_node);
+		*just_added = true;
+	} else {
+		*just_added = false;
+	}
+
+	return (trimmed_path);
+}
+
+
+/*
+ * save_file_directory
+ *
+ * Procedure that creates the directory holding a file, if needed.  Directories
+ * found by the local scan are known to exist already.
+ */
+
+static void
+save_file_directory(char *path)
+{
+	struct file_node *local = NULL;
+	struct stat       check;
+	char             *trim = NULL;
+	bool              exists = false;
+
+	if ((trim = strrchr(path, '/')) != NULL) {
+		*trim = '\0';
+
+		if ((local = find_file_path(&Local_Path_Table, path)) != NULL) {
+			exists        = true;
+			check.st_mode = local->mode;
+		} else {
+			exists = (stat(path, &check) == 0 ? true : false);
+		}
+
+		if (exists && !S_ISDIR(check.st_mode))
+			if (unlink(path) == 0)
+				exists = false;
+
+		if (!exists)
+			make_path(path, 0755);
+
+		*trim = '/';
+	}
+}
+
+
+/*
+ * save_file_display
+ *
+ * Procedure that prints the file or trimmed path about to be saved.
+ */
+
+static void
+save_file_display(char *path, int verbosity, int display_depth)
+{
+	char *display_path = NULL;
+	bool  exists = false, just_added = false;
+
+	display_path = trim_path(path, display_depth, &just_added);
+
+	if (verbosity > 0) {
+		exists = (find_file_path(&Local_Path_Table, path) != NULL);
+
+		if ((display_depth == 0) || (just_added))
+			printf(" %c %s\n", (exists ? '*' : '+'), display_path);
+	}
+
+	free(display_path);
+}
+
+
+/*
+ * close_directory_handle
+ *
+ * Procedure that closes the directory kept open by save_file_data.
+ */
+
+static void
+close_directory_handle(directory_handle *directory)
+{
+	if (directory->fd == -1)
+		return;
+
+	close(directory->fd);
+	directory->fd = -1;
+}
+
+
+/*
+ * open_directory_handle
+ *
+ * Function that makes sure the handle has a file's parent directory open,
+ * reusing it when consecutive files share a directory, and returns the file's
+ * name within the directory.
+ */
+
+static char *
+open_directory_handle(directory_handle *directory, char *path)
+{
+	char    parent[MAXPATHLEN];
+	char   *name = NULL;
+	size_t  length = 0;
+
+	if ((name = strrchr(path, '/')) == NULL)
+		return (path);
+
+	length = (size_t)(name - path);
+
+	if ((directory->fd == -1) || (length != directory->length) || (strncmp(path, directory->path, length) != 0)) {
+		close_directory_handle(directory);
+
+		if (length >= sizeof(parent))
+			errc(EXIT_FAILURE, ENAMETOOLONG,
+				"save_file: %s",
+				path);
+
+		memcpy(parent, path, length);
+		parent[length] = '\0';
+
+		if ((directory->fd = open((length ? parent : "/"), O_RDONLY | O_DIRECTORY)) == -1)
+			err(EXIT_FAILURE,
+				"save_file: cannot open %s",
+				parent);
+
+		directory->path   = path;
+		directory->length = length;
+	}
+
+	return (name + 1);
+}
+
+
+/*
+ * temporary_file_name
+ *
+ * Procedure that builds the name a file is written to in atomic mode.  Names
+ * too long for the suffix are shortened, with a checksum of the full name
+ * keeping them unique.
+ */
+
+static void
+temporary_file_name(const char *name, char *temp, size_t temp_size)
+{
+	if (strlen(name) + 12 <= MAXNAMLEN)
+		snprintf(temp, temp_size,
+			".%s.gitup-new",
+			name);
+	else
+		snprintf(temp, temp_size,
+			".%.*s.%08x.gitup-new",
+			MAXNAMLEN - 21,
+			name,
+			hash_code_path(name));
+}
+
+
+/*
+ * save_file_data
+ *
+ * Procedure that writes a blob's data to a file or symbolic link.  The parent
+ * directory stays open in the handle passed in, so consecutive files in the
+ * same directory are created relative to it.  In atomic mode the data is
+ * written to a temporary name that is renamed into place, either straight
+ * away or, for deferred handles, by rename_saved_files once every file has
+ * been written, so readers never see a partially written file.  It does not
+ * touch any shared state, so the writer threads can call it in parallel with
+ * their own handles.
+ */
+
+static void
+save_file_data(directory_handle *directory, char *path, mode_t mode, char *buffer, uint64_t buffer_size)
+{
+	char  target[MAXPATHLEN], temp[MAXNAMLEN + 1];
+	char *name = NULL, *write_name = NULL;
+	int   fd = -1, directory_fd = AT_FDCWD;
+
+	/* Switch to the file's directory, if needed. */
+
+	name = open_directory_handle(directory, path);
+
+	if (name != path)
+		directory_fd = directory->fd;
+
+	/* In atomic mode, write to a temporary name in the same directory. */
+
+	write_name = name;
+
+	if (directory->atomic) {
+		temporary_file_name(name, temp, sizeof(temp));
+		write_name = temp;
+	}
+
+	if (S_ISLNK(mode)) {
+		/* The link target needs to be null terminated. */
+
+		if (buffer_size >= sizeof(target))
+			errc(EXIT_FAILURE, ENAMETOOLONG,
+				"save_file: symlink target of %s",
+				path);
+
+		memcpy(target, buffer, buffer_size);
+		target[buffer_size] = '\0';
+
+		if (symlinkat(target, directory_fd, write_name) == -1 &&
+		    (unlinkat(directory_fd, write_name, 0), symlinkat(target, directory_fd, write_name) == -1))
+			err(EXIT_FAILURE,
+				"save_file: symlink failure %s -> %s",
+				path,
+				target);
+	} else {
+		fd = openat(directory_fd, write_name, O_WRONLY | O_CREAT | O_TRUNC, mode & 07777);
+
+		/* If the file is read only, make sure the permissions are intact. */
+
+		if ((fd == -1) && (errno == EACCES)
+			&& (fchmodat(directory_fd, write_name, mode & 07777, 0) == 0))
+			fd = openat(directory_fd, write_name, O_WRONLY | O_TRUNC);
+
+		if (fd == -1)
+			err(EXIT_FAILURE,
+				"save_file: write file failure %s",
+				path);
+
+		fchmod(fd, mode & 07777);
+		write(fd, buffer, buffer_size);
+		close(fd);
+	}
+
+	if ((directory->atomic) && (!directory->deferred)
+		&& (renameat(directory_fd, write_name, directory_fd, name) == -1))
+		err(EXIT_FAILURE, "save_file: cannot rename %s", path);
+}
+
+
+/*
+ * rename_saved_files
+ *
+ * Procedure that moves the files written by save_objects in atomic mode into
+ * place.  A single sync flushes all of their data first, so no file shows up
+ * under its real name without its contents, and the sync at the end of the
+ * run makes the renames themselves durable.
+ */
+
+static void
+rename_saved_files(void)
+{
+	struct file_node *file = NULL;
+	directory_handle  directory = { .fd = -1 };
+	char              temp[MAXNAMLEN + 1];
+	char             *name = NULL;
+	int               directory_fd = AT_FDCWD;
+
+	sync();
+
+	RB_FOREACH(file, Tree_Remote_Path, &Remote_Path) {
+		if (!file->save)
+			continue;
+
+		name         = open_directory_handle(&directory, file->path);
+		directory_fd = (name != file->path ? directory.fd : AT_FDCWD);
+
+		temporary_file_name(name, temp, sizeof(temp));
+
+		if (renameat(directory_fd, temp, directory_fd, name) == -1)
+			err(EXIT_FAILURE, "save_file: cannot rename %s", file->path);
+	}
+
+	close_directory_handle(&directory);
+}
+
+
+/*
+ * save_file
+ *
+ * Procedure that saves a blob/file.
+ */
+
+static void
+save_file(char *path, mode_t mode, char *buffer, uint64_t buffer_size, int verbosity, int display_depth, bool atomic)
+{
+	directory_handle directory = { .fd = -1, .atomic = atomic };
+
+	save_file_directory(path);
+	save_file_display(path, verbosity, display_depth);
+	save_file_data(&directory, path, mode, buffer, buffer_size);
+	close_directory_handle(&directory);
+}
+
+
+/*
+ * calculate_object_hash
+ *
+ * Function that hashes Git's "type file-size\0" header followed by a buffer
+ * and stores the 20 byte SHA checksum in the hash buffer passed in.
+ */
+
+static char *
+calculate_object_hash(char *buffer, uint32_t buffer_size, int type, char *hash)
+{
+	EVP_MD_CTX *context = NULL;
+
+	/* Hash the header and the buffer in place rather than joining them. */
+
+	if ((context = EVP_MD_CTX_new()) == NULL)
+		errx(EXIT_FAILURE, "calculate_object_hash: EVP_MD_CTX_new");
+
+	start_object_hash(context, type, buffer_size);
+	EVP_DigestUpdate(context, buffer, buffer_size);
+	EVP_DigestFinal_ex(context, (uint8_t *)hash, NULL);
+	EVP_MD_CTX_free(context);
+
+	return (hash);
+}
+
+
+/*
+ * start_object_hash
+ *
+ * Procedure that starts a SHA checksum with Git's "type file-size\0" header,
+ * leaving the contents of the object to be added by the caller.
+ */
+
+static void
+start_object_hash(EVP_MD_CTX *context, int type, uint32_t size)
+{
+	char        header[24];
+	int         header_width = 0;
+	const char *types[8] = {
+		"", "commit", "tree", "blob", "tag",
+		"", "ofs-delta", "ref-delta"
+		};
+
+	header_width = snprintf(header, sizeof(header), "%s %u", types[type], size) + 1;
+
+	if (EVP_DigestInit_ex(context, EVP_sha1(), NULL) != 1)
+		errx(EXIT_FAILURE, "start_object_hash: cannot start the checksum");
+
+	EVP_DigestUpdate(context, header, (size_t)header_width);
+}
+
+
+/*
+ * calculate_file_hash
+ *
+ * Function that loads a local file and stores its 20 byte SHA checksum in the
+ * hash buffer passed in.
+ */
+
+static char *
+calculate_file_hash(char *path, mode_t file_mode, char *hash)
+{
+	char     *buffer = NULL, temp_path[BUFFER_UNIT_SMALL];
+	uint32_t  buffer_size = 0;
+	ssize_t   bytes_read = 0;
+
+	if (S_ISLNK(file_mode)) {
+		bytes_read = readlink(path, temp_path, BUFFER_UNIT_SMALL);
+		temp_path[bytes_read] = '\0';
+
+		calculate_object_hash(
+			temp_path,
+			(uint32_t)strlen(temp_path),
+			3,
+			hash);
+	} else {
+		load_file(path, &buffer, &buffer_size);
+		calculate_object_hash(buffer, buffer_size, 3, hash);
+		free(buffer);
+	}
+
+	return (hash);
+}
+
+
+/*
+ * append
+ *
+ * Procedure that appends one string to another.
+ */
+
+static void
+append(char **buffer, uint32_t *buffer_size, const char *addendum, size_t addendum_size)
+{
+	*buffer = (char *)realloc(*buffer, *buffer_size + addendum_size + 1);
+
+	if (*buffer == NULL)
+		err(EXIT_FAILURE, "append: realloc");
+
+	memcpy(*buffer + *buffer_size, addendum, addendum_size);
+	*buffer_size += addendum_size;
+	*(*buffer + *buffer_size) = '\0';
+}
+
+
+/*
+ * extend_updating_list
+ *
+ * Procedure that adds the path of an UPDATING file to a string.
+ */
+
+static void
+extend_updating_list(connector *session, char *path)
+{
+	uint32_t size;
+	char     temp[BUFFER_UNIT_SMALL];
+
+	size = (session->updating ? (uint32_t)strlen(session->updating) : 0);
+
+	snprintf(temp, sizeof(temp), "#\t%s\n", path);
+	append(&session->updating, &size, temp, strlen(temp));
+}
+
+
+/*
+ * load_remote_binary
+ *
+ * Function that loads the remote data from the mapped contents of the remote
+ * data file, returning false if the file is damaged.  The file starts with
+ * "GURD", the format version, the number of trees and the "have", followed
+ * by one entry per tree (its checksum and the offsets and sizes of its path
+ * and object data) sorted by path, the paths and the tree objects.
+ */
+
+static bool
+load_remote_binary(connector *session, const char *data, size_t data_size)
+{
+	struct file_node *file = NULL;
+	const char       *entry = NULL, *path = NULL, *position = NULL;
+	const char       *end = NULL, *name = NULL, *terminator = NULL;
+	char             *buffer = NULL, full_path[BUFFER_UNIT_SMALL];
+	char              hash[20], item_hash[20], legible[41];
+	uint32_t          version = 0, trees = 0, x = 0;
+	uint32_t          path_offset = 0, tree_offset = 0, tree_size = 0;
+
+	if (data_size < REMOTE_HEADER_SIZE)
+		return (false);
+
+	memcpy(&version, data + 4, 4);
+	memcpy(&trees, data + 8, 4);
+
+	if ((version != 1) || ((data_size - REMOTE_HEADER_SIZE) / REMOTE_ENTRY_SIZE < trees))
+		return (false);
+
+	/* Make sure every entry is intact before anything is loaded. */
+
+	for (x = 0; x < trees; x++) {
+		entry = data + REMOTE_HEADER_SIZE + (size_t)x * REMOTE_ENTRY_SIZE;
+
+		memcpy(&path_offset, entry + 20, 4);
+		memcpy(&tree_offset, entry + 24, 4);
+		memcpy(&tree_size, entry + 28, 4);
+
+		if ((path_offset >= data_size)
+			|| (memchr(data + path_offset, '\0', data_size - path_offset) == NULL)
+			|| (tree_offset > data_size)
+			|| (tree_size > data_size - tree_offset))
+			return (false);
+
+		position = data + tree_offset;
+		end      = position + tree_size;
+
+		while (position < end) {
+			if (((name = memchr(position, ' ', (size_t)(end - position))) == NULL)
+				|| ((terminator = memchr(name, '\0', (size_t)(end - name))) == NULL)
+				|| (end - terminator < 21))
+				return (false);
+
+			position = terminator + 21;
+		}
+	}
+
+	session->have = strdup(legible_hash(data + 12, legible));
+
+	for (x = 0; x < trees; x++) {
+		entry = data + REMOTE_HEADER_SIZE + (size_t)x * REMOTE_ENTRY_SIZE;
+
+		memcpy(&path_offset, entry + 20, 4);
+		memcpy(&tree_offset, entry + 24, 4);
+		memcpy(&tree_size, entry + 28, 4);
+
+		memcpy(hash, entry, 20);
+
+		path = data + path_offset;
+		file = new_file_node(arena_strdup(path), 040000, hash, false, false);
+
+		RB_INSERT(Tree_Remote_Path, &Remote_Path, file);
+		insert_file_path(&Remote_Path_Table, file);
+
+		/*
+		 * Add the tree items.  Subdirectories are skipped because they
+		 * have entries of their own.
+		 */
+
+		position = data + tree_offset;
+		end      = position + tree_size;
+
+		while (position < end) {
+			name       = strchr(position, ' ') + 1;
+			terminator = name + strlen(name);
+
+			memcpy(item_hash, terminator + 1, 20);
+
+			file = new_file_node(
+				NULL,
+				(mode_t)strtol(position, (char **)NULL, 8),
+				item_hash,
+				false,
+				false);
+
+			position = terminator + 21;
+
+			if (S_ISDIR(file->mode))
+				continue;
+
+			snprintf(full_path, sizeof(full_path), "%s/%s", path, name);
+
+			if (sparse_excluded(session, full_path))
+				continue;
+
+			file->path = arena_strdup(full_path);
+
+			RB_INSERT(Tree_Remote_Path, &Remote_Path, file);
+			insert_file_path(&Remote_Path_Table, file);
+		}
+
+		/* The tree object is stored as is, with its checksum. */
+
+		if (session->clone == false) {
+			if ((buffer = (char *)malloc((size_t)tree_size + 1)) == NULL)
+				err(EXIT_FAILURE, "load_remote_binary: malloc");
+
+			memcpy(buffer, data + tree_offset, tree_size);
+
+			store_object(session,
+				2,
+				buffer,
+				tree_size,
+				0,
+				0,
+				NULL,
+				(session->repair ? NULL : hash));
+		}
+	}
+
+	return (true);
+}
+
+
+/*
+ * load_remote_text
+ *
+ * Procedure that loads the remote data from a remote data file saved in the
+ * original text format.  The file is replaced with the binary format the
+ * next time the remote data is saved.
+ */
+
+static void
+load_remote_text(connector *session)
+{
+	struct file_node *file = NULL;
+	char     *buffer = NULL, *hash = NULL, binary_hash[20];
+	char     *line = NULL, *raw = NULL, *path = NULL, *data = NULL;
+	char      temp[BUFFER_UNIT_SMALL], base_path[BUFFER_UNIT_SMALL];
+	char      item[BUFFER_UNIT_SMALL];
+	uint32_t  count = 0, buffer_size = 0, data_size = 0;
+	size_t    item_length = 0;
+
+	load_file(session->remote_data_file, &data, &data_size);
+	raw = data;
+
+	while ((line = strsep(&raw, "\n"))) {
+		/* The first line stores the "have". */
+
+		if (count++ == 0) {
+			session->have = strdup(line);
+			continue;
+		}
+
+		/*
+		 * Empty lines signify the end of a directory entry, so create
+		 * an obj_tree for what has been read.
+		 */
+
+		if (strlen(line) == 0) {
+			if (buffer != NULL) {
+				if (session->clone == false)
+					store_object(session,
+						2,
+						buffer,
+						buffer_size,
+						0,
+						0,
+						NULL,
+						NULL);
+
+				buffer = NULL;
+				buffer_size = 0;
+			}
+
+			continue;
+		}
+
+		/* Split the line. */
+
+		hash = strchr(line,     '\t');
+		path = strchr(hash + 1, '\t');
+
+		if ((hash == NULL) || (path == NULL)) {
+			fprintf(stderr,
+				" ! Malformed line '%s' in %s.  Skipping...\n",
+				line,
+				session->remote_data_file);
+
+			continue;
+		} else {
+			hash++;
+			path++;
+		}
+
+		*(hash -  1) = '\0';
+		*(hash + 40) = '\0';
+
+		illegible_hash(hash, binary_hash);
+
+		/* Store the file data. */
+
+		file = new_file_node(
+			NULL,
+			(mode_t)strtol(line, (char **)NULL, 8),
+			binary_hash,
+			false,
+			false);
+
+		if (path[strlen(path) - 1] == '/') {
+			snprintf(base_path, sizeof(base_path), "%s", path);
+			snprintf(temp, sizeof(temp), "%s", path);
+			temp[strlen(path) - 1] = '\0';
+		} else {
+			snprintf(temp, sizeof(temp), "%s%s", base_path, path);
+
+			/*
+			 * Build the item and add it to the buffer that will
+			 * become the obj_tree for this directory.
+			 */
+
+			snprintf(item, sizeof(item) - 22, "%s %s", line, path);
+			item_length = strlen(item);
+			memcpy(item + item_length + 1, binary_hash, 20);
+			item_length += 21;
+			item[item_length] = '\0';
+
+			append(&buffer, &buffer_size, item, item_length);
+		}
+
+		if (sparse_excluded(session, temp))
+			continue;
+
+		file->path = arena_strdup(temp);
+
+		RB_INSERT(Tree_Remote_Path, &Remote_Path, file);
+		insert_file_path(&Remote_Path_Table, file);
+	}
+
+	free(data);
+}
+
+
+/*
+ * load_remote_data
+ *
+ * Procedure that loads the list of remote data and checksums, if it exists.
+ */
+
+static void
+load_remote_data(connector *session)
+{
+	struct stat  file;
+	char        *data = NULL, *raw = NULL, *line = NULL, *hash = NULL;
+	char        *map = NULL;
+	uint32_t     data_size = 0;
+	int          fd = -1;
+
+	if ((fd = open(session->remote_data_file, O_RDONLY)) == -1)
+		err(EXIT_FAILURE, "load_remote_data: cannot read %s", session->remote_data_file);
+
+	if (fstat(fd, &file) == -1)
+		err(EXIT_FAILURE, "load_remote_data: fstat");
+
+	if (file.st_size >= 4) {
+		map = (char *)mmap(NULL, (size_t)file.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (map == MAP_FAILED)
+			err(EXIT_FAILURE, "load_remote_data: mmap");
+	}
+
+	close(fd);
+
+	/* Files without the binary header are in the original text format. */
+
+	if ((map != NULL) && (memcmp(map, "GURD", 4) == 0)) {
+		if (!load_remote_binary(session, map, (size_t)file.st_size)) {
+			fprintf(stderr,
+				" ! %s is damaged.  Performing a clone...\n",
+				session->remote_data_file);
+
+			session->clone = true;
+		}
+	} else {
+		load_remote_text(session);
+	}
+
+	if (map != NULL)
+		munmap(map, (size_t)file.st_size);
+
+	/* Load the commit history. */
+
+	if (!path_exists(session->remote_history_file))
+		return;
+
+	load_file(session->remote_history_file, &data, &data_size);
+	raw = data;
+
+	while ((line = strsep(&raw, "\n"))) {
+		if (strlen(line) == 0)
+			continue;
+
+		hash = strchr(line, ' ');
+
+		if (hash) {
+			*hash = '\0';
+			*(hash + 41) = '\0';
+
+//			insert_commit_node(strdup(hash), line);
+		}
+	}
+
+	free(data);
+}
+
+
+/*
+ * load_index
+ *
+ * Procedure that loads the stat cache of the files in the local repository
+ * that was saved at the end of the last run, if it exists.
+ */
+
+static void
+load_index(connector *session)
+{
+	struct index_node *node = NULL;
+	char     *data = NULL, *raw = NULL, *line = NULL, *field[7];
+	uint32_t  data_size = 0, count = 0;
+	int       x = 0;
+
+	if (!path_exists(session->index_file))
+		return;
+
+	load_file(session->index_file, &data, &data_size);
+	raw = data;
+
+	while ((line = strsep(&raw, "\n"))) {
+		if (strlen(line) == 0)
+			continue;
+
+		/* The first line stores the format version and the time. */
+
+		if (count++ == 0) {
+			if (strncmp(line, "# gitup index 1 ", 16) != 0)
+				break;
+
+			session->index_time = (time_t)strtoll(line + 16,
+				(char **)NULL, 10);
+
+			continue;
+		}
+
+		/* Split the line. */
+
+		for (x = 0; x < 7; x++)
+			if ((field[x] = strsep(&line, "\t")) == NULL)
+				break;
+
+		if ((x < 7) || (strlen(field[0]) != 40)) {
+			fprintf(stderr,
+				" ! Malformed line in %s.  Skipping...\n",
+				session->index_file);
+
+			continue;
+		}
+
+		node = (struct index_node *)arena_alloc(sizeof(struct index_node));
+
+		node->mode          = (mode_t)strtol(field[1], (char **)NULL, 8);
+		node->size          = (off_t)strtoll(field[2], (char **)NULL, 10);
+		node->mtime.tv_sec  = (time_t)strtoll(field[3], &line, 10);
+		node->mtime.tv_nsec = (*line == '.' ? strtol(line + 1, (char **)NULL, 10) : 0);
+		node->ctime.tv_sec  = (time_t)strtoll(field[4], &line, 10);
+		node->ctime.tv_nsec = (*line == '.' ? strtol(line + 1, (char **)NULL, 10) : 0);
+		node->inode         = (ino_t)strtoull(field[5], (char **)NULL, 10);
+		node->path          = arena_strdup(field[6]);
+
+		illegible_hash(field[0], node->hash);
+
+		RB_INSERT(Tree_Index, &Index, node);
+	}
+
+	free(data);
+}
+
+
+/*
+ * lookup_index
+ *
+ * Function that copies a file's SHA checksum from the stat cache into the
+ * hash buffer passed in and returns true if none of the file's stat data has
+ * changed since the cache was saved.
+ */
+
+static bool
+lookup_index(connector *session, char *path, struct stat *file, char *hash)
+{
+	struct index_node find, *found = NULL;
+
+	find.path = path;
+
+	if ((found = RB_FIND(Tree_Index, &Index, &find)) == NULL)
+		return (false);
+
+	if ((found->mode != file->st_mode)
+		|| (found->size != file->st_size)
+		|| (found->inode != file->st_ino)
+		|| (found->mtime.tv_sec != file->st_mtim.tv_sec)
+		|| (found->mtime.tv_nsec != file->st_mtim.tv_nsec)
+		|| (found->ctime.tv_sec != file->st_ctim.tv_sec)
+		|| (found->ctime.tv_nsec != file->st_ctim.tv_nsec))
+		return (false);
+
+	/*
+	 * Files modified during the same second that the cache was saved
+	 * could have changed again without altering their stat data.
+	 */
+
+	if (found->mtime.tv_sec >= session->index_time)
+		return (false);
+
+	memcpy(hash, found->hash, 20);
+
+	return (true);
+}
+
+
+/*
+ * save_index
+ *
+ * Procedure that saves the stat data and SHA checksums of the files in the
+ * local repository that are known to match the remote data.
+ */
+
+static void
+save_index(connector *session)
+{
+	struct file_node  *remote_file = NULL, *local_file = NULL;
+	struct index_node  find, *found = NULL;
+	struct stat        check;
+	char               path[BUFFER_UNIT_SMALL], line[BUFFER_UNIT_SMALL * 2];
+	char               hash[41];
+	size_t             length = 0;
+	int                fd = -1;
+
+	snprintf(path, BUFFER_UNIT_SMALL, "%s.new", session->index_file);
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(EXIT_FAILURE, "save_index: cannot create %s", path);
+
+	snprintf(line, sizeof(line),
+		"# gitup index 1 %jd\n",
+		(intmax_t)time(NULL));
+
+	length = strlen(line);
+
+	if (write(fd, line, length) != (ssize_t)length)
+		err(EXIT_FAILURE, "save_index: write");
+
+	RB_FOREACH(remote_file, Tree_Remote_Path, &Remote_Path) {
+		if ((S_ISDIR(remote_file->mode)) || (S_ISWHT(remote_file->mode)))
+			continue;
+
+		/*
+		 * Only retain files that were saved during this run or whose
+		 * local copy matched the remote data when it was scanned.
+		 */
+
+		if (!remote_file->save) {
+			local_file = find_file_path(&Local_Path_Table, remote_file->path);
+
+			if ((local_file == NULL) || (memcmp(local_file->hash, remote_file->hash, 20) != 0))
+				continue;
+		}
+
+		/*
+		 * Diff driven updates never looked at the untouched files, so
+		 * carry their stat data over from the old cache.
+		 */
+
+		if ((session->diff_update) && (!remote_file->save)) {
+			find.path = remote_file->path;
+			found     = RB_FIND(Tree_Index, &Index, &find);
+
+			if ((found == NULL)
+				|| (memcmp(found->hash, remote_file->hash, 20) != 0)
+				|| (found->mtime.tv_sec >= session->index_time))
+				continue;
+
+			check.st_mode = found->mode;
+			check.st_size = found->size;
+			check.st_mtim = found->mtime;
+			check.st_ctim = found->ctime;
+			check.st_ino  = found->inode;
+		} else if (lstat(remote_file->path, &check) == -1) {
+			continue;
+		}
+
+		snprintf(line, sizeof(line),
+			"%s\t%o\t%jd\t%jd.%09ld\t%jd.%09ld\t%ju\t%s\n",
+			legible_hash(remote_file->hash, hash),
+			check.st_mode,
+			(intmax_t)check.st_size,
+			(intmax_t)check.st_mtim.tv_sec,
+			(long)check.st_mtim.tv_nsec,
+			(intmax_t)check.st_ctim.tv_sec,
+			(long)check.st_ctim.tv_nsec,
+			(uintmax_t)check.st_ino,
+			remote_file->path);
+
+		length = strlen(line);
+
+		if (write(fd, line, length) != (ssize_t)length)
+			err(EXIT_FAILURE, "save_index: write");
+	}
+
+	close(fd);
+
+	if ((rename(path, session->index_file)) != 0)
+		err(EXIT_FAILURE, "save_index: cannot rename %s", path);
+}
+
+
+/*
+ * scan_local_repository
+ *
+ * Procedure that recursively finds and adds local files and directories to
+ * separate red-black trees.
+ */
+
+static void
+scan_local_repository(connector *session, char *base_path)
+{
+	DIR              *directory = NULL;
+	struct stat       file;
+	struct dirent    *entry = NULL;
+	struct file_node *new_node = NULL, *found = NULL;
+	char             *path = NULL, *keep = NULL;
+	unsigned long     path_length = 0;
+
+	/* Make sure the base path exists in the remote data list. */
+
+	found = find_file_path(&Remote_Path_Table, base_path);
+
+	/* Add the base path to the local trees. */
+
+	new_node = new_file_node(
+		arena_strdup(base_path),
+		(found ? found->mode : 040000),
+		(found ? found->hash : NULL),
+		(strlen(base_path) == strlen(session->path_target)),
+		false);
+
+	RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
+	insert_file_path(&Local_Path_Table, new_node);
+
+	if (found)
+		insert_file_hash(new_node);
+
+	/* Skip directories whose contents are all ignored. */
+
+	if ((found == NULL) && (ignore_subtree(session, base_path)))
+		return;
+
+	/* Process the directory's contents. */
+
+	if (stat(base_path, &file) == -1)
+		return;
+
+	if ((directory = opendir(base_path)) == NULL)
+		return;
+
+	while ((entry = readdir(directory)) != NULL) {
+		if ((entry->d_namlen == 1) && (!strcmp(entry->d_name, "." )))
+			continue;
+
+		if ((entry->d_namlen == 2) && (!strcmp(entry->d_name, "..")))
+			continue;
+
+		path_length = strlen(base_path) + entry->d_namlen + 2;
+		path        = (char *)arena_alloc(path_length + 1);
+
+		snprintf(path, path_length, "%s/%s", base_path, entry->d_name);
+
+		if (sparse_excluded(session, path))
+			continue;
+
+		if (lstat(path, &file) == -1)
+			err(EXIT_FAILURE,
+				"scan_local_repository: cannot read %s",
+				path);
+
+		if (S_ISDIR(file.st_mode)) {
+			scan_local_repository(session, path);
+		} else {
+			keep = strnstr(path, ".gituprevision", path_length);
+
+			new_node = new_file_node(
+				path,
+				file.st_mode,
+				NULL,
+				(keep != NULL ? true : false),
+				false);
+
+			if (ignore_file(session, path, IGNORE_FORCE_READ)) {
+				SHA1((uint8_t *)path,
+					path_length,
+					(uint8_t *)new_node->hash);
+			} else if (!lookup_index(session, path, &file, new_node->hash)) {
+				/*
+				 * Hand the file off to the hashing workers,
+				 * which add it to the checksum table when done.
+				 */
+
+				if (session->scan_queue) {
+					RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
+					insert_file_path(&Local_Path_Table, new_node);
+					work_queue_add(session->scan_queue, new_node);
+					continue;
+				}
+
+				calculate_file_hash(path, file.st_mode, new_node->hash);
+			}
+
+			RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
+			insert_file_path(&Local_Path_Table, new_node);
+			insert_file_hash(new_node);
+		}
+	}
+
+	closedir(directory);
+}
+
+
+/*
+ * scan_worker
+ *
+ * Function run by each scanning thread that calculates the SHA checksums of
+ * the files found by scan_local_repository.
+ */
+
+static void *
+scan_worker(void *argument)
+{
+	work_queue       *queue = (work_queue *)argument;
+	struct file_node *node = NULL;
+
+	while ((node = (struct file_node *)work_queue_next(queue)) != NULL)
+		calculate_file_hash(node->path, node->mode, node->hash);
+
+	return (NULL);
+}
+
+
+/*
+ * scan_local_tree
+ *
+ * Procedure that scans the local repository, hashing the files that need it
+ * in parallel when more than one job is configured.
+ */
+
+static void
+scan_local_tree(connector *session)
+{
+	pthread_t *thread = NULL;
+	uint32_t   x = 0;
+
+	if (session->jobs < 2) {
+		scan_local_repository(session, session->path_target);
+		return;
+	}
+
+	/* Walk the directories while the workers hash the files. */
+
+	session->scan_queue = work_queue_new();
+	thread = start_workers(session, scan_worker, session->scan_queue);
+
+	scan_local_repository(session, session->path_target);
+
+	work_queue_finish(session->scan_queue);
+	join_workers(session, thread);
+
+	/* Merge the hashed files into the checksum table. */
+
+	for (x = 0; x < session->scan_queue->items; x++)
+		insert_file_hash((struct file_node *)session->scan_queue->item[x]);
+
+	work_queue_free(session->scan_queue);
+	session->scan_queue = NULL;
+}
+
+
+/*
+ * load_local_tree
+ *
+ * Procedure that fills in the local trees from the remote data instead of
+ * scanning the local repository.  The files saved by the last run are trusted
+ * to be intact, so a pull only touches the paths that changed between the old
+ * and new trees.
+ */
+
+static void
+load_local_tree(connector *session)
+{
+	struct file_node *remote_file = NULL, *new_node = NULL;
+
+	RB_FOREACH(remote_file, Tree_Remote_Path, &Remote_Path) {
+		new_node = new_file_node(
+			remote_file->path,
+			remote_file->mode,
+			remote_file->hash,
+			(strlen(remote_file->path) == strlen(session->path_target)),
+			false);
+
+		RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
+		insert_file_path(&Local_Path_Table, new_node);
+		insert_file_hash(new_node);
+	}
+}
+
+
+/*
+ * load_object
+ *
+ * Procedure that loads a local file and adds it to the array/table of pack
+ * file objects.
+ */
+
+static void
+load_object(connector *session, char *hash, char *path)
+{
+	struct file_node *find = NULL;
+	char             *buffer = NULL, legible[41];
+	uint32_t          buffer_size = 0;
+
+	/*
+	 * If the object doesn't exist, look for it first in the local object
+	 * store, then by hash, then by path and if it is found and the SHA
+	 * checksum references a file, load it and store it.
+	 */
+
+	if (find_object(hash) != NULL)
+		return;
+
+	if (load_stored_object(session, hash))
+		return;
+
+	find = find_file_hash(hash);
+
+	if ((find == NULL) && (path != NULL))
+		find = find_file_path(&Local_Path_Table, path);
+
+	if (find) {
+		if (!S_ISDIR(find->mode)) {
+			load_file(find->path, &buffer, &buffer_size);
+
+			store_object(session,
+				3,
+				buffer,
+				buffer_size,
+				0,
+				0,
+				NULL,
+				NULL);
+		}
+	} else {
+		errc(EXIT_FAILURE, ENOENT,
+			"load_object: local file for object %s -- %s not found",
+			legible_hash(hash, legible),
+			path);
+	}
+}
+
+
+/*
+ * find_stored_object
+ *
+ * Function that looks up an object in the local object store, returning its
+ * record in the memory mapped data file or NULL if it isn't there.  The first
+ * byte of the SHA checksum selects a range of the sorted index through the
+ * fanout table, which is then searched with a binary search.
+ */
+
+static const char *
+find_stored_object(connector *session, const char *hash)
+{
+	const char *hashes = NULL;
+	uint64_t    offset = 0;
+	uint32_t    low = 0, high = 0, middle = 0, size = 0;
+	uint8_t     first = (uint8_t)hash[0];
+	int         compare = 0;
+
+	if (session->store_index == NULL)
+		return (NULL);
+
+	if (first > 0)
+		memcpy(&low, session->store_index + STORE_HEADER_SIZE + (first - 1) * 4, 4);
+
+	memcpy(&high, session->store_index + STORE_HEADER_SIZE + first * 4, 4);
+
+	hashes = session->store_index + STORE_HEADER_SIZE + STORE_FANOUT_SIZE;
+
+	while (low < high) {
+		middle  = low + (high - low) / 2;
+		compare = memcmp(hashes + (size_t)middle * 20, hash, 20);
+
+		if (compare < 0) {
+			low = middle + 1;
+		} else if (compare > 0) {
+			high = middle;
+		} else {
+			memcpy(&offset, hashes + (size_t)session->store_objects * 20 + (size_t)middle * 8, 8);
+
+			if (offset + 8 > session->store_data_size)
+				return (NULL);
+
+			memcpy(&size, session->store_data + offset + 4, 4);
+
+			if (offset + 8 + size > session->store_data_size)
+				return (NULL);
+
+			return (session->store_data + offset);
+		}
+	}
+
+	return (NULL);
+}
+
+
+/*
+ * load_object_store
+ *
+ * Procedure that maps the local object store's data and index files, if they
+ * exist.  Both files start with the same generation number, so a data file
+ * and an index left over from different runs are never used together, and the
+ * fanout table must never decrease so the ranges searched by
+ * find_stored_object stay inside the index.
+ */
+
+static void
+load_object_store(connector *session)
+{
+	struct stat  file;
+	char         path[BUFFER_UNIT_SMALL];
+	char        *map[2] = { NULL, NULL };
+	size_t       size[2] = { 0, 0 };
+	uint32_t     objects = 0, count = 0, previous = 0;
+	int          fd = -1, x = 0;
+	bool         ordered = true;
+
+	for (x = 0; x < 2; x++) {
+		snprintf(path, sizeof(path),
+			"%s.objects%s",
+			session->store_path,
+			(x ? ".idx" : ""));
+
+		if ((fd = open(path, O_RDONLY)) == -1)
+			break;
+
+		if ((fstat(fd, &file) == 0) && (file.st_size >= STORE_HEADER_SIZE)) {
+			size[x] = (size_t)file.st_size;
+			map[x]  = (char *)mmap(NULL, size[x], PROT_READ, MAP_SHARED, fd, 0);
+
+			if (map[x] == MAP_FAILED)
+				map[x] = NULL;
+		}
+
+		close(fd);
+	}
+
+	if ((map[0] != NULL) && (map[1] != NULL) && (size[1] >= STORE_HEADER_SIZE + STORE_FANOUT_SIZE)) {
+		memcpy(&objects, map[1] + STORE_HEADER_SIZE + STORE_FANOUT_SIZE - 4, 4);
+
+		for (x = 0; (ordered) && (x < STORE_FANOUT_SIZE / 4); x++) {
+			memcpy(&count, map[1] + STORE_HEADER_SIZE + x * 4, 4);
+
+			if ((count < previous) || (count > objects))
+				ordered = false;
+
+			previous = count;
+		}
+
+		if ((ordered)
+			&& (memcmp(map[0], "GUOS", 4) == 0)
+			&& (memcmp(map[1], "GUIX", 4) == 0)
+			&& (memcmp(map[0] + 4, map[1] + 4, 12) == 0)
+			&& (size[1] == STORE_HEADER_SIZE + STORE_FANOUT_SIZE + (size_t)objects * 28)) {
+			session->store_data       = map[0];
+			session->store_data_size  = size[0];
+			session->store_index      = map[1];
+			session->store_index_size = size[1];
+			session->store_objects    = objects;
+
+			return;
+		}
+
+		fprintf(stderr, " ! The local object store is damaged and will be rebuilt.\n");
+	}
+
+	for (x = 0; x < 2; x++)
+		if (map[x] != NULL)
+			munmap(map[x], size[x]);
+}
+
+
+/*
+ * lock_object_store
+ *
+ * Procedure that locks or unlocks the local object store, which is shared by
+ * every section that uses the same repository.
+ */
+
+static void
+lock_object_store(connector *session, int operation)
+{
+	char path[BUFFER_UNIT_SMALL];
+
+	if (session->store_lock == -1) {
+		snprintf(path, sizeof(path), "%s.objects.lock", session->store_path);
+
+		if ((session->store_lock = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+			err(EXIT_FAILURE, "lock_object_store: cannot open %s", path);
+	}
+
+	if (flock(session->store_lock, operation) == -1)
+		err(EXIT_FAILURE, "lock_object_store: flock");
+}
+
+
+/*
+ * free_object_store
+ *
+ * Procedure that unmaps the local object store.
+ */
+
+static void
+free_object_store(connector *session)
+{
+	if (session->store_data != NULL)
+		munmap(session->store_data, session->store_data_size);
+
+	if (session->store_index != NULL)
+		munmap(session->store_index, session->store_index_size);
+
+	session->store_data    = NULL;
+	session->store_index   = NULL;
+	session->store_objects = 0;
+}
+
+
+/*
+ * load_stored_object
+ *
+ * Function that inflates an object from the local object store and stores it,
+ * returning true if it was found.  Stored objects are trusted unless the local
+ * tree is being repaired, in which case they are hashed again.
+ */
+
+static bool
+load_stored_object(connector *session, char *hash)
+{
+	const char *stored = NULL;
+	char       *buffer = NULL;
+	uint32_t    size = 0, record_size = 0;
+	uLongf      length = 0;
+
+	if ((stored = find_stored_object(session, hash)) == NULL)
+		return (false);
+
+	memcpy(&size, stored, 4);
+	memcpy(&record_size, stored + 4, 4);
+
+	if ((buffer = (char *)malloc((size_t)size + 1)) == NULL)
+		err(EXIT_FAILURE, "load_stored_object: malloc");
+
+	length = size;
+
+	if ((uncompress((Bytef *)buffer, &length, (const Bytef *)stored + 8, record_size) != Z_OK) || (length != size)) {
+		free(buffer);
+		return (false);
+	}
+
+	store_object(session,
+		3,
+		buffer,
+		size,
+		0,
+		0,
+		NULL,
+		(session->repair ? NULL : hash));
+
+	return (find_object(hash) != NULL);
+}
+
+
+/*
+ * retain_stored_file
+ *
+ * Procedure that remembers a blob in the new tree so save_object_store can
+ * make sure the local object store holds it.
+ */
+
+static void
+retain_stored_file(connector *session, struct file_node *file)
+{
+	if (!session->object_store)
+		return;
+
+	if (session->store_files % BUFFER_UNIT_SMALL == 0)
+		if ((session->store_file = (struct file_node **)realloc(session->store_file, (session->store_files + BUFFER_UNIT_SMALL) * sizeof(struct file_node *))) == NULL)
+			err(EXIT_FAILURE, "retain_stored_file: realloc");
+
+	session->store_file[session->store_files++] = file;
+}
+
+
+/*
+ * store_compare
+ *
+ * Functions that sort the retained files and the object store index entries
+ * by SHA checksum.
+ */
+
+static int
+store_file_compare(const void *a, const void *b)
+{
+	return (memcmp((*(struct file_node * const *)a)->hash, (*(struct file_node * const *)b)->hash, 20));
+}
+
+
+static int
+store_entry_compare(const void *a, const void *b)
+{
+	return (memcmp(((const store_entry *)a)->hash, ((const store_entry *)b)->hash, 20));
+}
+
+
+/*
+ * write_stored_object
+ *
+ * Procedure that compresses an object and appends its record (uncompressed
+ * size, compressed size, zlib data) to the object store's data file.
+ */
+
+static void
+write_stored_object(int fd, const char *buffer, uint32_t buffer_size, uint64_t *offset)
+{
+	char     *record = NULL;
+	uLongf    compressed_size = compressBound(buffer_size);
+	uint32_t  record_size = 0;
+
+	if ((record = (char *)malloc(compressed_size + 8)) == NULL)
+		err(EXIT_FAILURE, "write_stored_object: malloc");
+
+	if (compress2((Bytef *)record + 8, &compressed_size, (const Bytef *)buffer, buffer_size, Z_BEST_SPEED) != Z_OK)
+		errc(EXIT_FAILURE, EIO, "write_stored_object: compress2");
+
+	record_size = (uint32_t)compressed_size;
+
+	memcpy(record, &buffer_size, 4);
+	memcpy(record + 4, &record_size, 4);
+
+	if (write(fd, record, record_size + 8) != (ssize_t)(record_size + 8))
+		err(EXIT_FAILURE, "write_stored_object: write");
+
+	*offset += record_size + 8;
+
+	free(record);
+}
+
+
+/*
+ * save_object_store
+ *
+ * Procedure that brings the local object store up to date with the blobs in
+ * the new tree.  New blobs are appended to the data file and the index is
+ * rewritten.  Once more than half of the stored objects are no longer in the
+ * tree, the live objects are copied into a new data file instead, reclaiming
+ * the space used by the stale ones.
+ */
+
+static void
+save_object_store(connector *session)
+{
+	struct object_node *object = NULL;
+	struct file_node   *file = NULL;
+	store_entry        *entry = NULL;
+	const char         *stored = NULL;
+	char                data_path[BUFFER_UNIT_SMALL], index_path[BUFFER_UNIT_SMALL];
+	char                temp_path[BUFFER_UNIT_SMALL], header[STORE_HEADER_SIZE];
+	char               *buffer = NULL, *blob = NULL, check[20], link[MAXPATHLEN];
+	char                record[8];
+	uint32_t            buffer_size = 0, fanout[256], files = 0, entries = 0;
+	uint32_t            kept = 0, record_size = 0, x = 0, y = 0;
+	uint32_t            version = 1;
+	uint64_t            offset = 0, generation = 0;
+	ssize_t             link_size = 0;
+	bool                compact = false;
+	int                 fd = -1;
+
+	snprintf(data_path, sizeof(data_path), "%s.objects", session->store_path);
+	snprintf(index_path, sizeof(index_path), "%s.objects.idx", session->store_path);
+
+	/*
+	 * Another section may have updated the store since it was loaded, so
+	 * map it again once no one else can change it.
+	 */
+
+	lock_object_store(session, LOCK_EX);
+	free_object_store(session);
+	load_object_store(session);
+
+	/* Sort the blobs in the new tree and drop the duplicates. */
+
+	qsort(session->store_file, session->store_files, sizeof(struct file_node *), store_file_compare);
+
+	for (x = 0; x < session->store_files; x++)
+		if ((files == 0) || (memcmp(session->store_file[files - 1]->hash, session->store_file[x]->hash, 20) != 0))
+			session->store_file[files++] = session->store_file[x];
+
+	for (x = 0; x < files; x++)
+		if (find_stored_object(session, session->store_file[x]->hash) != NULL)
+			kept++;
+
+	compact = ((session->store_data == NULL) || ((session->store_objects - kept) * 2 > session->store_objects));
+
+	if ((entry = (store_entry *)malloc(((size_t)files + (compact ? 0 : session->store_objects) + 1) * sizeof(store_entry))) == NULL)
+		err(EXIT_FAILURE, "save_object_store: malloc");
+
+	/* Open the data file and carry over the existing entries, if needed. */
+
+	if (compact) {
+		generation = ((uint64_t)arc4random() << 32) | arc4random();
+
+		memcpy(header, "GUOS", 4);
+		memcpy(header + 4, &version, 4);
+		memcpy(header + 8, &generation, 8);
+
+		snprintf(temp_path, sizeof(temp_path), "%s.objects.new", session->store_path);
+
+		if ((fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+			err(EXIT_FAILURE, "save_object_store: cannot create %s", temp_path);
+
+		if (write(fd, header, STORE_HEADER_SIZE) != STORE_HEADER_SIZE)
+			err(EXIT_FAILURE, "save_object_store: write");
+
+		offset = STORE_HEADER_SIZE;
+	} else {
+		memcpy(header, session->store_data, STORE_HEADER_SIZE);
+
+		if ((fd = open(data_path, O_WRONLY | O_APPEND)) == -1)
+			err(EXIT_FAILURE, "save_object_store: cannot open %s", data_path);
+
+		offset = session->store_data_size;
+
+		for (x = 0; x < session->store_objects; x++) {
+			memcpy(entry[entries].hash, session->store_index + STORE_HEADER_SIZE + STORE_FANOUT_SIZE + (size_t)x * 20, 20);
+			memcpy(&entry[entries].offset, session->store_index + STORE_HEADER_SIZE + STORE_FANOUT_SIZE + (size_t)session->store_objects * 20 + (size_t)x * 8, 8);
+			entries++;
+		}
+	}
+
+	/* Add the blobs that the data file is missing. */
+
+	for (x = 0; x < files; x++) {
+		file   = session->store_file[x];
+		stored = find_stored_object(session, file->hash);
+
+		if ((stored != NULL) && (!compact))
+			continue;
+
+		memcpy(entry[entries].hash, file->hash, 20);
+		entry[entries].offset = offset;
+
+		if (stored != NULL) {
+			memcpy(&record_size, stored + 4, 4);
+
+			if (write(fd, stored, record_size + 8) != (ssize_t)(record_size + 8))
+				err(EXIT_FAILURE, "save_object_store: write");
+
+			offset += record_size + 8;
+			entries++;
+			continue;
+		}
+
+		/* The deflated copy of a lazy blob is already a stored record. */
+
+		if (((object = find_object(file->hash)) != NULL) && (object->lazy) && (object->packed_size > 0)) {
+			memcpy(record, &object->buffer_size, 4);
+			memcpy(record + 4, &object->packed_size, 4);
+
+			if ((write(fd, record, 8) != 8) || (write(fd, object->buffer, object->packed_size) != (ssize_t)object->packed_size))
+				err(EXIT_FAILURE, "save_object_store: write");
+
+			offset += object->packed_size + 8;
+			entries++;
+			continue;
+		}
+
+		if (object != NULL) {
+			blob = object_buffer(session, object);
+			write_stored_object(fd, blob, object->buffer_size, &offset);
+			release_object_buffer(object, blob);
+			entries++;
+			continue;
+		}
+
+		/* Read anything else from the local tree, making sure it matches. */
+
+		if (S_ISLNK(file->mode)) {
+			if ((link_size = readlink(file->path, link, sizeof(link))) == -1)
+				continue;
+
+			calculate_object_hash(link, (uint32_t)link_size, 3, check);
+
+			if (memcmp(check, file->hash, 20) != 0)
+				continue;
+
+			write_stored_object(fd, link, (uint32_t)link_size, &offset);
+		} else {
+			if (!path_exists(file->path))
+				continue;
+
+			buffer_size = 0;
+			load_file(file->path, &buffer, &buffer_size);
+			calculate_object_hash(buffer, buffer_size, 3, check);
+
+			if (memcmp(check, file->hash, 20) != 0)
+				continue;
+
+			write_stored_object(fd, buffer, buffer_size, &offset);
+		}
+
+		entries++;
+	}
+
+	free(buffer);
+	close(fd);
+
+	/* Write the index: header, fanout table, checksums and offsets. */
+
+	qsort(entry, entries, sizeof(store_entry), store_entry_compare);
+
+	for (x = 0, y = 0; x < 256; x++) {
+		while ((y < entries) && ((uint8_t)entry[y].hash[0] == x))
+			y++;
+
+		fanout[x] = y;
+	}
+
+	snprintf(temp_path, sizeof(temp_path), "%s.objects.idx.new", session->store_path);
+
+	if ((fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(EXIT_FAILURE, "save_object_store: cannot create %s", temp_path);
+
+	memcpy(header, "GUIX", 4);
+
+	if ((write(fd, header, STORE_HEADER_SIZE) != STORE_HEADER_SIZE)
+		|| (write(fd, fanout, STORE_FANOUT_SIZE) != STORE_FANOUT_SIZE))
+		err(EXIT_FAILURE, "save_object_store: write");
+
+	for (x = 0; x < entries; x++)
+		if (write(fd, entry[x].hash, 20) != 20)
+			err(EXIT_FAILURE, "save_object_store: write");
+
+	for (x = 0; x < entries; x++)
+		if (write(fd, &entry[x].offset, 8) != 8)
+			err(EXIT_FAILURE, "save_object_store: write");
+
+	close(fd);
+	free(entry);
+
+	/* Swap in the new files. */
+
+	free_object_store(session);
+
+	if (compact) {
+		snprintf(temp_path, sizeof(temp_path), "%s.objects.new", session->store_path);
+
+		if (rename(temp_path, data_path) != 0)
+			err(EXIT_FAILURE, "save_object_store: cannot rename %s", temp_path);
+	}
+
+	snprintf(temp_path, sizeof(temp_path), "%s.objects.idx.new", session->store_path);
+
+	if (rename(temp_path, index_path) != 0)
+		err(EXIT_FAILURE, "save_object_store: cannot rename %s", temp_path);
+
+	lock_object_store(session, LOCK_UN);
+
+	if (session->verbosity > 2)
+		fprintf(stderr,
+			"# Object store: %u objects, %s\n",
+			entries,
+			(compact ? "compacted" : "appended"));
+}
+
+
+/*
+ * create_tunnel
+ *
+ * Procedure that sends a CONNECT command to create a proxy tunnel.
+ */
+
+static void
+create_tunnel(connector *session)
+{
+	char command[BUFFER_UNIT_SMALL];
+
+	snprintf(command, BUFFER_UNIT_SMALL,
+		"CONNECT %s:%d HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"%s"
+		"\r\n",
+		session->host_bracketed,
+		session->port,
+		session->host_bracketed,
+		session->port,
+		session->proxy_credentials);
+
+		process_command(session, command);
+}
+
+
+/*
+ * connect_server
+ *
+ * Procedure that establishes a connection with the server.
+ */
+
+static void
+connect_server(connector *session)
+{
+	struct addrinfo hints, *start = NULL, *tmp = NULL, *local = NULL;
+	struct timeval  timeout;
+	int             sd = 0, error = 0, option = 1;
+	socklen_t       size = 0;
+	char            type[10], *host = NULL;
+
+	/* Get addrinfo for local address. */
+
+	if (session->source_address) {
+		bzero(&hints, sizeof(struct addrinfo));
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags    = AI_ADDRCONFIG | AI_PASSIVE;
+
+		error = getaddrinfo(session->source_address,
+			0,
+			&hints,
+			&local);
+
+		if (error)
+			errx(EXIT_FAILURE,
+				"connect_server: getaddrinfo failure: %s",
+				gai_strerror(error));
+	}
+
+	/* Get addrinfo for remote address. */
+
+	host = (session->proxy_host ? session->proxy_host : session->host);
+
+	snprintf(type, sizeof(type),
+		"%d",
+		(session->proxy_host ? session->proxy_port : session->port));
+
+	bzero(&hints, sizeof(struct addrinfo));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if ((error = getaddrinfo(host, type, &hints, &start)))
+		errx(EXIT_FAILURE,
+			"connect_server: getaddrinfo failure: %s",
+			gai_strerror(error));
+
+	/* Open the socket. */
+
+	for (tmp = start; tmp != NULL; tmp = tmp->ai_next) {
+		sd = socket(tmp->ai_family, tmp->ai_socktype, tmp->ai_protocol);
+
+		if (sd < 0)
+			/* trying each addr returned, cont. with next in list */
+			continue;
+
+		if ((local) && (bind(sd, local->ai_addr, local->ai_addrlen)))
+			err(EXIT_FAILURE, "connect_server: bind failure");
+
+		if (connect(sd, tmp->ai_addr, tmp->ai_addrlen) != -1)
+			break;
+		else
+			close(sd);
+	}
+
+	freeaddrinfo(start);
+	freeaddrinfo(local);
+
+	if (tmp == NULL)
+		err(EXIT_FAILURE, "connect_server: connect failure");
+
+	/* Set the socket options. */
+
+	if (setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(int)))
+		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_KEEPALIVE");
+
+#ifdef SO_NOSIGPIPE
+	if (setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, &option, sizeof(int)))
+		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_NOSIGPIPE");
+#endif
+
+	option = BUFFER_UNIT_LARGE;
+
+	if (setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &option, sizeof(int)))
+		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_SNDBUF");
+
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &option, sizeof(int)))
+		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_RCVBUF");
+
+	size = sizeof(struct timeval);
+	bzero(&timeout, size);
+	timeout.tv_sec = 300;
+
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, size))
+		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_RCVTIMEO");
+
+	if (setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, size))
+		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_SNDTIMEO");
+
+	session->socket_descriptor = sd;
+}
+
+
+/*
+ * setup_ssl
+ *
+ * Procedure that negotiates the TLS connection with the server, resuming the
+ * previous TLS session when the server still accepts it.  The context is
+ * created once and shared by every connection.
+ */
+
+static void
+setup_ssl(connector *session)
+{
+	int error = 0;
+
+	if (session->ctx == NULL) {
+		SSL_library_init();
+		SSL_load_error_strings();
+		session->ctx = SSL_CTX_new(SSLv23_client_method());
+		SSL_CTX_set_mode(session->ctx, SSL_MODE_AUTO_RETRY);
+		SSL_CTX_set_options(session->ctx, SSL_OP_ALL);
+		SSL_CTX_set_session_cache_mode(session->ctx, SSL_SESS_CACHE_CLIENT);
+	}
+
+	if ((session->ssl = SSL_new(session->ctx)) == NULL)
+		err(EXIT_FAILURE, "setup_ssl: SSL_new");
+
+	SSL_set_fd(session->ssl, session->socket_descriptor);
+
+	if (session->tls_session != NULL)
+		SSL_set_session(session->ssl, session->tls_session);
+
+	while ((error = SSL_connect(session->ssl)) == -1)
+		fprintf(stderr,
+			"setup_ssl: SSL_connect error: %d\n",
+			SSL_get_error(session->ssl, error));
+
+	if (session->verbosity > 2)
+		fprintf(stderr,
+			"# TLS session: %s\n",
+			(SSL_session_reused(session->ssl) ? "resumed" : "new"));
+}
+
+
+/*
+ * open_connection
+ *
+ * Procedure that connects to the server (through the proxy, if required)
+ * unless the connection from the previous command can be reused.
+ */
+
+static void
+open_connection(connector *session)
+{
+	struct pollfd check = { session->socket_descriptor, POLLIN, 0 };
+
+	/*
+	 * Nothing is expected from the server between commands, so an idle
+	 * connection with data waiting has been closed by the server.
+	 */
+
+	if ((session->ssl != NULL) && (!session->reconnect)) {
+		if (poll(&check, 1, 0) == 0)
+			return;
+
+		session->reconnect = true;
+	}
+
+	close_connection(session);
+	connect_server(session);
+
+	if (session->proxy_host)
+		create_tunnel(session);
+
+	setup_ssl(session);
+}
+
+
+/*
+ * close_connection
+ *
+ * Procedure that closes the connection to the server, keeping its TLS session
+ * so that the next connection can resume it.
+ */
+
+static void
+close_connection(connector *session)
+{
+	SSL_SESSION *tls_session = NULL;
+
+	if (session->ssl != NULL) {
+		if ((tls_session = SSL_get1_session(session->ssl)) != NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+			if (!SSL_SESSION_is_resumable(tls_session)) {
+				SSL_SESSION_free(tls_session);
+				tls_session = NULL;
+			}
+#endif
+			if (tls_session != NULL) {
+				if (session->tls_session != NULL)
+					SSL_SESSION_free(session->tls_session);
+
+				session->tls_session = tls_session;
+			}
+		}
+
+		/*
+		 * A connection the server has already closed is marked as shut
+		 * down rather than written to, which keeps its session usable.
+		 */
+
+		if (session->reconnect)
+			SSL_set_shutdown(session->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		else
+			SSL_shutdown(session->ssl);
+
+		SSL_free(session->ssl);
+	}
+
+	if (session->socket_descriptor != -1)
+		close(session->socket_descriptor);
+
+	session->ssl               = NULL;
+	session->socket_descriptor = -1;
+	session->reconnect         = false;
+}
+
+
+/*
+ * load_tls_session
+ *
+ * Procedure that loads the TLS session saved by the last run, if it exists.
+ */
+
+static void
+load_tls_session(connector *session)
+{
+	const unsigned char *position = NULL;
+	char                *data = NULL;
+	uint32_t             data_size = 0;
+
+	if (!path_exists(session->tls_session_file))
+		return;
+
+	load_file(session->tls_session_file, &data, &data_size);
+	position = (const unsigned char *)data;
+
+	session->tls_session = d2i_SSL_SESSION(NULL, &position, (long)data_size);
+
+	free(data);
+}
+
+
+/*
+ * save_tls_session
+ *
+ * Procedure that saves the TLS session so that the next run can skip the
+ * full handshake.  The file holds the session keys, so only root can read it.
+ */
+
+static void
+save_tls_session(connector *session)
+{
+	unsigned char *data = NULL, *position = NULL;
+	char           path[BUFFER_UNIT_SMALL];
+	int            data_size = 0, fd = -1;
+
+	if ((session->tls_session == NULL) || (session->tls_session_file == NULL))
+		return;
+
+	if ((data_size = i2d_SSL_SESSION(session->tls_session, NULL)) <= 0)
+		return;
+
+	if ((data = (unsigned char *)malloc((size_t)data_size)) == NULL)
+		err(EXIT_FAILURE, "save_tls_session: malloc");
+
+	position = data;
+	i2d_SSL_SESSION(session->tls_session, &position);
+
+	snprintf(path, sizeof(path), "%s.%d", session->tls_session_file, (int)getpid());
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1) {
+		if (write(fd, data, (size_t)data_size) == data_size)
+			rename(path, session->tls_session_file);
+		else
+			unlink(path);
+
+		close(fd);
+	}
+
+	free(data);
+}
+
+
+/*
+ * expand_response
+ *
+ * Procedure that makes sure the response buffer can hold the specified number
+ * of bytes plus a terminating NUL.
+ */
+
+static void
+expand_response(connector *session, size_t size)
+{
+	unsigned long blocks = (size + BUFFER_UNIT_LARGE) / BUFFER_UNIT_LARGE;
+
+	if (blocks <= session->response_blocks)
+		return;
+
+	session->response = (char *)realloc(session->response,
+		blocks * BUFFER_UNIT_LARGE);
+
+	if (session->response == NULL)
+		err(EXIT_FAILURE, "expand_response: realloc");
+
+	session->response_blocks = blocks;
+}
+
+
+/*
+ * process_command
+ *
+ * Procedure that sends a command to the server and processes the response.
+ */
+
+static void
+process_command(connector *session, char *command)
+{
+	char    *temp = NULL, *marker = NULL;
+	long     response_code = 0;
+	size_t   header_size = 0, received = 0, parsed = 0, kept = 0;
+	size_t   bytes_expected = 0, chunk_remaining = 0, length = 0;
+	ssize_t  bytes_read = 0, bytes_sent = 0, bytes_to_send = 0;
+	ssize_t  total_bytes_read = 0, total_bytes_sent = 0;
+	int      error = 0, outlen = 0;
+	bool     ok = false, chunked_transfer = true, streaming = false;
+	bool     trailer = false, done = false;
+
+
+	bytes_to_send = (ssize_t)strlen(command);
+
+	if (session->verbosity > 2)
+		fprintf(stderr, "%s\n\n", command);
+
+	/* Transmit the command to the server. */
+
+	while (total_bytes_sent < bytes_to_send) {
+		if (session->ssl)
+			bytes_sent = SSL_write(
+				session->ssl,
+				command + total_bytes_sent,
+				(int)(bytes_to_send - total_bytes_sent));
+		else
+			bytes_sent = write(
+				session->socket_descriptor,
+				command + total_bytes_sent,
+				(size_t)(bytes_to_send - total_bytes_sent));
+
+		if (bytes_sent <= 0) {
+			if (bytes_sent < 0 && (errno == EINTR || errno == 0))
+				continue;
+			else
+				err(EXIT_FAILURE, "process_command: send");
+		}
+
+		total_bytes_sent    += bytes_sent;
+		session->bytes_sent += (uint64_t)bytes_sent;
+
+		if (session->verbosity > 2)
+			fprintf(stderr,
+				"\r==> bytes sent: %ld",
+				(long)total_bytes_sent);
+	}
+
+	if (session->verbosity > 2)
+		fprintf(stderr, "\n");
+
+	/* Process the response. */
+
+	while (!done) {
+		/*
+		 * Read straight into the response buffer.  Once the pack data
+		 * is being streamed, the buffer is reused for every read since
+		 * the bytes received are consumed immediately.
+		 */
+
+		if (streaming)
+			received = 0;
+		else
+			expand_response(session, received + BUFFER_UNIT_SMALL);
+
+		length = MIN(session->response_blocks * BUFFER_UNIT_LARGE - 1 - received,
+			BUFFER_UNIT_LARGE);
+
+		if (session->ssl)
+			bytes_read = SSL_read(
+				session->ssl,
+				session->response + received,
+				(int)length);
+		else
+			bytes_read = read(
+				session->socket_descriptor,
+				session->response + received,
+				length);
+
+		if (bytes_read == 0) {
+			session->reconnect = true;
+			break;
+		}
+
+		if (bytes_read < 0)
+			err(EXIT_FAILURE,
+				"process_command: SSL_read error: %d",
+				SSL_get_error(session->ssl, error));
+
+		received                    += (size_t)bytes_read;
+		total_bytes_read            += bytes_read;
+		session->bytes_received     += (uint64_t)bytes_read;
+		session->response[received]  = '\0';
+
+		if (session->verbosity > 2)
+			fprintf(stderr, "\r==> "
+				"bytes read: %zd\t"
+				"bytes_expected: %ld\t"
+				"total_bytes_read: %ld",
+				bytes_read,
+				(long)bytes_expected,
+				(long)total_bytes_read);
+
+		while ((session->verbosity) && (isatty(STDERR_FILENO))) {
+			struct timespec now;
+			static struct   timespec then;
+			char            buf[80], htotalb[7], persec[8];
+			static ssize_t  last_total;
+			static double   sum;
+			double          secs, throughput;
+
+			if (clock_gettime(CLOCK_MONOTONIC_FAST, &now) == -1)
+				err(EXIT_FAILURE,
+					"process_command: clock_gettime");
+
+			if (then.tv_sec == 0)
+				then = now, secs = 1, sum = 1;
+			else {
+				secs = (double)(now.tv_sec - then.tv_sec) +
+					(double)(now.tv_nsec - then.tv_nsec) * 1e-9;
+
+				if (1 > secs)
+					break;
+				else
+					sum += secs;
+			}
+
+			throughput = ((double)(total_bytes_read - last_total) / secs);
+
+			humanize_number(htotalb, sizeof(htotalb),
+				total_bytes_read,
+				"B",
+				HN_AUTOSCALE,
+				HN_DECIMAL | HN_DIVISOR_1000);
+
+			humanize_number(persec, sizeof(persec),
+				(int64_t)throughput,
+				"B",
+				HN_AUTOSCALE,
+				HN_DECIMAL | HN_DIVISOR_1000);
+
+			snprintf(buf, sizeof(buf) - 1,
+				"  %s in %dm%02ds, %s/s now",
+				htotalb,
+				(int)(sum / 60),
+				(int)sum % 60,
+				persec);
+
+			if (isatty(STDERR_FILENO))
+				outlen = fprintf(stderr, "%-*s\r", outlen, buf) - 1;
+
+			last_total = total_bytes_read;
+			then = now;
+			break;
+		}
+
+		if (streaming) {
+			stream_response(session, session->response, (size_t)bytes_read);
+			done = session->pack->http_done;
+			continue;
+		}
+
+		/*
+		 * Find the boundary between the header and the data, starting
+		 * the search just before the bytes that were added.
+		 */
+
+		if (header_size == 0) {
+			temp = session->response + received - (size_t)bytes_read;
+			temp = (temp - session->response > 3 ? temp - 3 : session->response);
+
+			if ((marker = strnstr(temp, "\r\n\r\n", received - (size_t)(temp - session->response))) == NULL)
+				continue;
+
+			header_size = (size_t)(marker - session->response) + 4;
+
+			/* Check the response code. */
+
+			if (strstr(session->response, "HTTP/1.") == session->response) {
+				response_code = strtol(
+					strchr(session->response, ' ') + 1,
+					(char **)NULL, 10);
+
+				if (response_code == 200)
+					ok = true;
+
+				if ((session->proxy_host) && (response_code >= 200) && (response_code < 300))
+					ok = true;
+			}
+
+			/* The next command needs a new connection. */
+
+			temp = strcasestr(session->response, "\r\nConnection: close");
+
+			if ((temp != NULL) && (temp < marker) && (strstr(command, "CONNECT ") != command))
+				session->reconnect = true;
+
+			/*
+			 * Size the buffer for the whole body up front when its
+			 * length is known, unless it is going to be streamed.
+			 */
+
+			temp = strnstr(session->response, "Content-Length: ", header_size);
+
+			if (temp != NULL) {
+				bytes_expected   = strtoul(temp + 16, (char **)NULL, 10);
+				chunked_transfer = false;
+
+				if (!session->pack)
+					expand_response(session, header_size + bytes_expected);
+			}
+
+			/*
+			 * The body of a successful response overwrites the header,
+			 * otherwise the header is kept for the error message.
+			 */
+
+			parsed = header_size;
+			kept   = (ok ? 0 : header_size);
+
+			/* Successful CONNECT responses do not contain a body. */
+
+			if ((strstr(command, "CONNECT ") == command) && (ok))
+				break;
+
+			/*
+			 * If a pack stream is open, hand the body to it as it
+			 * arrives instead of collecting the whole response first.
+			 */
+
+			if ((session->pack) && (ok)) {
+				streaming = true;
+
+				session->pack->chunked        = chunked_transfer;
+				session->pack->http_remaining = (chunked_transfer ? 0 : (long)bytes_expected);
+				session->pack->http_trailer   = false;
+				session->pack->http_done      = false;
+
+				stream_response(session,
+					session->response + header_size,
+					received - header_size);
+
+				done = session->pack->http_done;
+				continue;
+			}
+		}
+
+		if (!chunked_transfer) {
+			done = (received >= header_size + bytes_expected);
+			continue;
+		}
+
+		/*
+		 * Remove the chunk markers from the data received so far.  Each
+		 * byte of chunk data is moved once, no matter how many reads
+		 * it takes for the rest of the response to arrive.
+		 */
+
+		while ((!done) && (parsed < received)) {
+			if (chunk_remaining > 0) {
+				length = MIN(chunk_remaining, received - parsed);
+
+				if (kept != parsed)
+					memmove(session->response + kept,
+						session->response + parsed,
+						length);
+
+				kept            += length;
+				parsed          += length;
+				chunk_remaining -= length;
+				continue;
+			}
+
+			/*
+			 * Read the next chunk size, skipping the CRLF that ends
+			 * each chunk.  The last chunk is followed by any trailer
+			 * fields and an empty line.
+			 */
+
+			if ((marker = memchr(session->response + parsed, '\n', received - parsed)) == NULL)
+				break;
+
+			temp = session->response + parsed;
+
+			if ((temp == marker) || ((*temp == '\r') && (temp + 1 == marker)))
+				done = trailer;
+			else if (!trailer) {
+				chunk_remaining = strtoul(temp, (char **)NULL, 16);
+				trailer         = (chunk_remaining == 0);
+			}
+
+			parsed = (size_t)(marker + 1 - session->response);
+		}
+	}
+
+	if ((session->verbosity) && (isatty(STDERR_FILENO)))
+		fprintf(stderr, "\r\e[0K\r");
+
+	/* Streamed responses leave nothing behind in the buffer. */
+
+	if (streaming) {
+		session->response_size = 0;
+		session->response[0]   = '\0';
+		return;
+	}
+
+	/* Move the body of a response with a Content-Length into place. */
+
+	if ((header_size > 0) && (!chunked_transfer)) {
+		length = MIN(bytes_expected, received - header_size);
+
+		if (kept != header_size)
+			memmove(session->response + kept,
+				session->response + header_size,
+				length);
+
+		kept += length;
+	}
+
+	if (header_size == 0)
+		kept = received;
+
+	session->response[kept] = '\0';
+
+	if (!ok)
+		errc(EXIT_FAILURE, EINVAL,
+			"process_command: read failure:\n%s\n",
+			session->response);
+
+	session->response_size = (uint32_t)kept;
+}
+
+
+/*
+ * send_command
+ *
+ * Function that constructs the command to the fetch the full pack data.
+ */
+
+static void
+send_command(connector *session, char *want)
+{
+	char   *command = NULL;
+	size_t  want_size = 0;
+
+	want_size = strlen(want);
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
+		err(EXIT_FAILURE, "send_command: malloc");
+
+	snprintf(command, BUFFER_UNIT_SMALL + want_size,
+		"POST %s/git-upload-pack HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"User-Agent: gitup/%s\r\n"
+		"Accept-encoding: deflate, gzip\r\n"
+		"Content-type: application/x-git-upload-pack-request\r\n"
+		"Accept: application/x-git-upload-pack-result\r\n"
+		"Git-Protocol: version=2\r\n"
+		"Content-length: %zu\r\n"
+		"\r\n"
+		"%s",
+		session->repository_path,
+		session->host_bracketed,
+		session->port,
+		GITUP_VERSION,
+		want_size,
+		want);
+
+	open_connection(session);
+	process_command(session, command);
+
+	free(command);
+}
+
+
+/*
+ * build_clone_command
+ *
+ * Function that constructs and executes the command to the fetch the shallow
+ * pack data.
+ */
+
+static char *
+build_clone_command(connector *session)
+{
+	char *command = NULL;
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
+		err(EXIT_FAILURE, "build_clone_command: malloc");
+
+	snprintf(command, BUFFER_UNIT_SMALL,
+		"0011command=fetch0001"
+		"000fno-progress"
+		"000dofs-delta"
+		"%s"
+		"0034shallow %s"
+		"0032want %s\n"
+		"0009done\n0000",
+		(session->filter_blobs ? "0015filter blob:none\n" : ""),
+		session->want,
+		session->want);
+
+	return (command);
+}
+
+
+/*
+ * build_commit_command
+ *
+ * Function that constructs and executes the command to the fetch the commit
+ * data.
+ */
+
+static char *
+build_commit_command(connector *session)
+{
+	char *command = NULL, temp[64];
+	bool  have = false;
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
+		err(EXIT_FAILURE, "build_commit_command: malloc");
+
+	/* Only ask for the commits newer than the saved history. */
+
+	if (session->history_tip)
+		have = true;
+
+	if ((session->keep_pack_file) && (!path_exists(session->pack_history_file)))
+		have = false;
+
+	if (have == false) {
+		free(session->history_tip);
+		session->history_tip = NULL;
+		temp[0] = '\0';
+	} else {
+		snprintf(temp, sizeof(temp), "0032have %s\n", session->history_tip);
+	}
+
+	snprintf(command, BUFFER_UNIT_SMALL,
+		"0011command=fetch0001"
+		"000dthin-pack"
+		"000fno-progress"
+		"000dofs-delta"
+		"0012filter tree:0\n"
+		"0032want %s\n"
+		"%s"
+		"0009done\n0000",
+		session->want,
+		temp);
+
+	return (command);
+}
+
+
+/*
+ * build_pull_command
+ *
+ * Function that constructs and executes the command to the fetch the
+ * incremental pack data.
+ */
+
+static char *
+build_pull_command(connector *session)
+{
+	char *command = NULL;
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
+		err(EXIT_FAILURE, "build_pull_command: malloc");
+
+	/*
+	 * Sparse checkouts don't have the trees and blobs outside of their
+	 * paths, so they can't use a thin pack.
+	 */
+
+	snprintf(command, BUFFER_UNIT_SMALL,
+		"0011command=fetch0001"
+		"%s"
+		"000fno-progress"
+		"000dofs-delta"
+		"%s"
+		"0034shallow %s"
+		"0034shallow %s"
+		"000cdeepen 1"
+		"0032want %s\n"
+		"0032have %s\n"
+		"0009done\n0000",
+		(session->sparse_paths > 0 ? "" : "000dthin-pack"),
+		(session->filter_blobs ? "0015filter blob:none\n" : ""),
+		session->want,
+		session->have,
+		session->want,
+		session->have);
+
+	return (command);
+}
+
+
+/*
+ * build_repair_command
+ *
+ * Procedure that compares the local repository tree with the data saved from
+ * the last run to see if anything has been modified.  Files whose objects are
+ * in the local object store are loaded from there and counted in stored, the
+ * rest are requested from the server.
+ */
+
+static char *
+build_repair_command(connector *session, uint32_t *stored)
+{
+	struct file_node *find = NULL, *found = NULL;
+	char             *command = NULL, *want = NULL, line[BUFFER_UNIT_SMALL];
+	char              hash[41];
+	const char       *message[2] = { "is missing.", "has been modified." };
+	uint32_t          want_size = 0;
+
+	*stored = 0;
+
+	RB_FOREACH(find, Tree_Remote_Path, &Remote_Path) {
+		found = find_file_path(&Local_Path_Table, find->path);
+
+		if ((found == NULL) || ((memcmp(found->hash, find->hash, 20) != 0) && (!ignore_file(session, find->path, IGNORE_FORCE_READ)))) {
+			if (session->verbosity)
+				fprintf(stderr,
+					" ! %s %s\n",
+					find->path,
+					message[found ? 1 : 0]);
+
+			/* Objects in the local object store needn't be fetched. */
+
+			if ((!S_ISDIR(find->mode)) && (load_stored_object(session, find->hash))) {
+				(*stored)++;
+				continue;
+			}
+
+			snprintf(line, sizeof(line),
+				"0032want %s\n",
+				legible_hash(find->hash, hash));
+
+			append(&want, &want_size, line, strlen(line));
+		}
+	}
+
+	if (want_size == 0)
+		return (NULL);
+
+	if (want_size > 3276800)
+		errc(EXIT_FAILURE, E2BIG,
+			"build_repair_command: There are too many files to "
+			"repair -- please re-clone the repository");
+
+	command = build_fetch_command(want, want_size);
+
+	free(want);
+
+	return (command);
+}
+
+
+/*
+ * build_fetch_command
+ *
+ * Function that constructs the command to fetch the objects in a list of
+ * "want" lines.
+ */
+
+static char *
+build_fetch_command(char *want, uint32_t want_size)
+{
+	char *command = NULL;
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
+		err(EXIT_FAILURE, "build_fetch_command: malloc");
+
+	snprintf(command, BUFFER_UNIT_SMALL + want_size,
+		"0011command=fetch0001"
+		"000dthin-pack"
+		"000fno-progress"
+		"000dofs-delta"
+		"%.*s"
+		"000cdeepen 1"
+		"0009done\n0000",
+		(int)want_size,
+		want);
+
+	return (command);
+}
+
+
+/*
+ * get_commit_details
+ */
+
+static void
+get_commit_details(connector *session)
+{
+	char       command[BUFFER_UNIT_SMALL], ref[BUFFER_UNIT_SMALL], want[41];
+	char       peeled[BUFFER_UNIT_SMALL];
+	char      *position = NULL;
+	time_t     current;
+	struct tm  now;
+	int        tries = 2, year = 0, quarter = 0;
+	unsigned long   length = 0;
+	bool       detached = (session->want != NULL ? true : false);
+
+	/* Send the initial info/refs command. */
+
+	snprintf(command, BUFFER_UNIT_SMALL,
+		"GET %s/info/refs?service=git-upload-pack HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"User-Agent: gitup/%s\r\n"
+		"Git-Protocol: version=2\r\n"
+		"\r\n",
+		session->repository_path,
+		session->host_bracketed,
+		session->port,
+		GITUP_VERSION);
+
+	open_connection(session);
+	process_command(session, command);
+
+	if (session->verbosity > 2)
+		printf("%s\n", session->response);
+
+	/* Make sure the server supports the version 2 protocol. */
+
+	if (strnstr(session->response, "version 2", session->response_size) == NULL)
+		errc(EXIT_FAILURE, EPROTONOSUPPORT,
+			"%s does not support the version 2 wire protocol",
+			session->host);
+
+	if ((strnstr(session->response, "filter", session->response_size) == NULL) && (session->commit_history)) {
+/*
+		fprintf(stderr,
+			"! %s does not support the filter feature and the "
+			"commit history is unavailable\n",
+			session->host);
+*/
+		session->commit_history = false;
+	}
+
+	/* Sparse checkouts only fetch the blobs they need, if possible. */
+
+	if ((session->sparse_paths > 0) && (strnstr(session->response, "filter", session->response_size) != NULL))
+		session->filter_blobs = true;
+
+	/* Fetch the list of refs. */
+
+	snprintf(command, BUFFER_UNIT_SMALL,
+		"0014command=ls-refs\n"
+		"0016object-format=sha1"
+		"0001"
+		"0009peel\n"
+		"000csymrefs\n"
+		"0014ref-prefix HEAD\n"
+		"001bref-prefix refs/heads/\n"
+		"001aref-prefix refs/tags/\n"
+		"0000");
+
+	send_command(session, command);
+
+	if (session->verbosity > 2)
+		printf("%s\n", session->response);
+
+	/* Extract the "want" checksum. */
+
+	want[0] = '\0';
+
+	while ((tries-- > 0) && (want[0] == '\0') && (detached == false)) {
+		if (strncmp(session->branch, "quarterly", 9) == 0) {
+			/*
+			 * If the current calendar quarter doesn't exist, try
+			 * the previous one.
+			 */
+
+			current = time(NULL);
+			now     = *localtime(&current);
+			year    = 1900 + now.tm_year + ((tries == 0) && (now.tm_mon < 3) ? -1 : 0);
+			quarter = ((now.tm_mon / 3) + (tries == 0 ? 3 : 0)) % 4 + 1;
+
+			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%04dQ%d", year, quarter);
+		} else if (session->tag != NULL) {
+			snprintf(ref, BUFFER_UNIT_SMALL, " refs/tags/%s", session->tag);
+		} else {
+			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%s", session->branch);
+		}
+
+		/*
+		 * Look for the "want" in peeled references first, then look
+		 * before the ref.
+		 */
+
+		snprintf(peeled, sizeof(peeled), "%s peeled:", ref);
+
+		if ((position = strstr(session->response, peeled)) != NULL)
+			memcpy(want, position + strlen(peeled), 40);
+		else if ((position = strstr(session->response, ref)) != NULL)
+			memcpy(want, position - 40, 40);
+		else if (tries == 0)
+			errc(EXIT_FAILURE, EINVAL,
+				"get_commit_details:%s doesn't exist in %s",
+				ref,
+				session->repository_path);
+	}
+
+	/* Retain the name of the quarterly branch being used. */
+
+	if (strncmp(session->branch, "quarterly", 9) == 0) {
+		free(session->branch);
+		session->branch = strdup(ref + 12);
+	}
+
+	if (want[0] != '\0') {
+		if (session->want == NULL)
+			if ((session->want = (char *)malloc(41)) == NULL)
+				err(EXIT_FAILURE, "get_commit_details: malloc");
+
+		memcpy(session->want, want, 40);
+		session->want[40] = '\0';
+
+		if (session->verbosity)
+			fprintf(stderr, "# Want: %s\n", session->want);
+	}
+
+	/*
+	 * Because there is no way to lookup commit history, if a want commit
+	 * is specified, change the branch to (detached).
+	 */
+
+	if (detached == true) {
+		free(session->branch);
+		session->branch = strdup("(detached)");
+	}
+
+	if ((session->verbosity) && (session->tag == NULL))
+		fprintf(stderr, "# Branch: %s\n", session->branch);
 
-			new_node = new_file_node(
-				path,
-				file.st_mode,
-				NULL,
-				(keep != NULL ? true : false),
-				false);
+	/* Create the pack file names. */
 
-			if (ignore_file(session, path, IGNORE_FORCE_READ)) {
-				new_node->hash = (char *)malloc(20);
+	if (session->keep_pack_file == true) {
+		length = strlen(session->section) + 47;
 
-				if (new_node->hash == NULL)
-					err(EXIT_FAILURE,
-						"scan_local_repository: "
-						"malloc");
+		session->pack_data_file    = (char *)malloc(length + 1);
+		session->pack_history_file = (char *)malloc(length + 9);
 
-				SHA1((uint8_t *)path,
-					path_length,
-					(uint8_t *)file_hash);
+		if (session->pack_data_file == NULL)
+			err(EXIT_FAILURE, "get_commit_details: malloc");
 
-				memcpy(new_node->hash, file_hash, 20);
-			} else
-				new_node->hash = calculate_file_hash(
-					path,
-					file.st_mode);
+		if (session->pack_history_file == NULL)
+			err(EXIT_FAILURE, "get_commit_details: malloc");
 
-			RB_INSERT(Tree_Local_Hash, &Local_Hash, new_node);
-			RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
-		}
-	}
+		snprintf(session->pack_data_file, length,
+			"%s-%s.pack",
+			session->section,
+			session->want);
 
-	closedir(directory);
+		snprintf(session->pack_history_file, length + 8,
+			"%s.history",
+			session->pack_data_file);
+	}
 }
 
 
 /*
- * load_object
+ * load_pack
  *
- * Procedure that loads a local file and adds it to the array/tree of pack
- * file objects.
+ * Procedure that loads a local copy of the pack data or fetches it from
+ * the server.
  */
 
 static void
-load_object(connector *session, char *hash, char *path)
+load_pack(connector *session, char *file, bool history_file)
 {
-	struct object_node  lookup_object;
-	struct file_node   *find = NULL, lookup_file;
-	char               *buffer = NULL;
-	uint32_t            buffer_size = 0;
+	char    *command = NULL, *buffer = NULL;
+	ssize_t  bytes_read = 0;
+	int      fd = -1;
 
-	lookup_object.hash = hash;
-	lookup_file.hash   = hash;
-	lookup_file.path   = path;
+	if ((path_exists(file)) && (session->use_pack_file)) {
+		if (session->verbosity)
+			fprintf(stderr, "# Loading pack file: %s\n", file);
 
-	/*
-	 * If the object doesn't exist, look for it first by hash, then by path
-	 * and if it is found and the SHA checksum references a file, load it
-	 * and store it.
-	 */
+		/* Feed the pack file to the unpacker one block at a time. */
 
-	if (RB_FIND(Tree_Objects, &Objects, &lookup_object) != NULL)
-		return;
+		if ((fd = open(file, O_RDONLY)) == -1)
+			err(EXIT_FAILURE, "load_pack: cannot read %s", file);
 
-	find = RB_FIND(Tree_Local_Hash, &Local_Hash, &lookup_file);
+		if ((buffer = (char *)malloc(BUFFER_UNIT_LARGE)) == NULL)
+			err(EXIT_FAILURE, "load_pack: malloc");
 
-	if ((find == NULL) && (path != NULL))
-		find = RB_FIND(Tree_Local_Path, &Local_Path, &lookup_file);
+		open_pack_stream(session, NULL);
+		session->pack->packfile = true;
 
-	if (find) {
-		if (!S_ISDIR(find->mode)) {
-			load_file(find->path, &buffer, &buffer_size);
+		while ((bytes_read = read(fd, buffer, BUFFER_UNIT_LARGE)) > 0)
+			unpack_objects(session, buffer, (size_t)bytes_read);
 
-			store_object(session,
-				3,
-				buffer,
-				buffer_size,
-				0,
-				0,
-				NULL);
-		}
+		if (bytes_read == -1)
+			err(EXIT_FAILURE, "load_pack: cannot read %s", file);
+
+		close_pack_stream(session);
+		close(fd);
+		free(buffer);
 	} else {
-		errc(EXIT_FAILURE, ENOENT,
-			"load_object: local file for object %s -- %s not found",
-			hash,
-			path);
+		if (history_file)
+			command = build_commit_command(session);
+		else if (!session->clone)
+			command = build_pull_command(session);
+		else
+			command = build_clone_command(session);
+
+		fetch_pack(session,
+			command,
+			((!path_exists(file)) && (session->keep_pack_file) ? file : NULL));
 	}
+
+	report_phase(session, (history_file ? "fetch commit history" : "fetch and unpack"));
+
+	free(session->response);
+	session->response        = NULL;
+	session->response_size   = 0;
+	session->response_blocks = 0;
 }
 
 
 /*
- * create_tunnel
+ * fetch_pack
  *
- * Procedure that sends a CONNECT command to create a proxy tunnel.
+ * Procedure that fetches pack data from the server, unpacking the objects
+ * as they arrive and optionally saving a copy of the pack data to a file.
  */
 
 static void
-create_tunnel(connector *session)
+fetch_pack(connector *session, char *command, char *file)
 {
-	char command[BUFFER_UNIT_SMALL];
-
-	snprintf(command, BUFFER_UNIT_SMALL,
-		"CONNECT %s:%d HTTP/1.1\r\n"
-		"Host: %s:%d\r\n"
-		"%s"
-		"\r\n",
-		session->host_bracketed,
-		session->port,
-		session->host_bracketed,
-		session->port,
-		session->proxy_credentials);
+	open_pack_stream(session, file);
+	send_command(session, command);
+	close_pack_stream(session);
 
-		process_command(session, command);
+	free(command);
 }
 
 
 /*
- * connect_server
+ * open_pack_stream
  *
- * Procedure that establishes a connection with the server.
+ * Procedure that prepares the session to receive pack data incrementally.
+ * If a file name is supplied, the raw pack data is also written to it.
  */
 
 static void
-connect_server(connector *session)
+open_pack_stream(connector *session, char *file)
 {
-	struct addrinfo hints, *start = NULL, *tmp = NULL, *local = NULL;
-	struct timeval  timeout;
-	int             sd = 0, error = 0, option = 1;
-	socklen_t       size = 0;
-	char            type[10], *host = NULL;
+	pack_stream *pack = NULL;
+	int          length = 0;
 
-	/* Get addrinfo for local address. */
+	if ((pack = (pack_stream *)calloc(1, sizeof(pack_stream))) == NULL)
+		err(EXIT_FAILURE, "open_pack_stream: calloc");
 
-	if (session->source_address) {
-		bzero(&hints, sizeof(struct addrinfo));
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_flags    = AI_ADDRCONFIG | AI_PASSIVE;
+	pack->state           = PACK_HEADER;
+	pack->save_descriptor = -1;
 
-		error = getaddrinfo(session->source_address,
-			0,
-			&hints,
-			&local);
+	if (((pack->context = EVP_MD_CTX_new()) == NULL)
+		|| (EVP_DigestInit_ex(pack->context, EVP_sha1(), NULL) != 1))
+		errx(EXIT_FAILURE, "open_pack_stream: cannot start the pack checksum");
 
-		if (error)
-			errx(EXIT_FAILURE,
-				"connect_server: getaddrinfo failure: %s",
-				gai_strerror(error));
-	}
+	if ((session->lazy_blobs) && ((pack->object_context = EVP_MD_CTX_new()) == NULL))
+		errx(EXIT_FAILURE, "open_pack_stream: EVP_MD_CTX_new");
 
-	/* Get addrinfo for remote address. */
+	/* Write to a temporary file so a failed fetch never leaves a partial pack behind. */
 
-	host = (session->proxy_host ? session->proxy_host : session->host);
+	if (file) {
+		if (session->verbosity)
+			fprintf(stderr, "# Saving pack file: %s\n", file);
 
-	snprintf(type, sizeof(type),
-		"%d",
-		(session->proxy_host ? session->proxy_port : session->port));
+		length = (int)strlen(file) + 5;
 
-	bzero(&hints, sizeof(struct addrinfo));
-	hints.ai_family   = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
+		if ((pack->save_file = (char *)malloc((size_t)length)) == NULL)
+			err(EXIT_FAILURE, "open_pack_stream: malloc");
 
-	if ((error = getaddrinfo(host, type, &hints, &start)))
-		errx(EXIT_FAILURE,
-			"connect_server: getaddrinfo failure: %s",
-			gai_strerror(error));
+		snprintf(pack->save_file, (size_t)length, "%s.new", file);
 
-	/* Open the socket. */
+		pack->save_descriptor = open(pack->save_file,
+			O_WRONLY | O_CREAT | O_TRUNC,
+			0644);
 
-	for (tmp = start; tmp != NULL; tmp = tmp->ai_next) {
-		sd = socket(tmp->ai_family, tmp->ai_socktype, tmp->ai_protocol);
+		if (pack->save_descriptor == -1)
+			err(EXIT_FAILURE,
+				"open_pack_stream: write file failure %s",
+				pack->save_file);
+	}
 
-		if (sd < 0)
-			/* trying each addr returned, cont. with next in list */
-			continue;
+	session->pack = pack;
+}
 
-		if ((local) && (bind(sd, local->ai_addr, local->ai_addrlen)))
-			err(EXIT_FAILURE, "connect_server: bind failure");
 
-		if (connect(sd, tmp->ai_addr, tmp->ai_addrlen) != -1)
-			break;
-		else
-			close(sd);
-	}
+/*
+ * close_pack_stream
+ *
+ * Procedure that makes sure the pack data was received in its entirety,
+ * moves any saved copy of it into place and releases the stream.
+ */
 
-	freeaddrinfo(start);
-	freeaddrinfo(local);
+static void
+close_pack_stream(connector *session)
+{
+	pack_stream *pack = session->pack;
+	size_t       length = 0;
+	char        *file = NULL;
 
-	if (tmp == NULL)
-		err(EXIT_FAILURE, "connect_server: connect failure");
+	if (!pack->packfile)
+		errc(EXIT_FAILURE, EFTYPE,
+			"fetch_pack: malformed pack data:\n%.*s",
+			(int)pack->text_size,
+			pack->text);
 
-	/* Set the socket options. */
+	if (pack->state != PACK_DONE)
+		errc(EXIT_FAILURE, EFTYPE,
+			"unpack_objects: truncated pack data -- "
+			"%u of %u objects received",
+			pack->objects,
+			pack->total_objects);
 
-	if (setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(int)))
-		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_KEEPALIVE");
+	if (session->verbosity > 2)
+		fprintf(stderr,
+			"# Pack: %u objects, %u bytes, checksum verified\n",
+			pack->objects,
+			pack->position + pack->trailer_size);
 
-	option = BUFFER_UNIT_LARGE;
+	if (pack->save_descriptor != -1) {
+		close(pack->save_descriptor);
 
-	if (setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &option, sizeof(int)))
-		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_SNDBUF");
+		length = strlen(pack->save_file) - 4;
 
-	if (setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &option, sizeof(int)))
-		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_RCVBUF");
+		if ((file = strndup(pack->save_file, length)) == NULL)
+			err(EXIT_FAILURE, "close_pack_stream: strndup");
 
-	size = sizeof(struct timeval);
-	bzero(&timeout, size);
-	timeout.tv_sec = 300;
+		if (rename(pack->save_file, file) != 0)
+			err(EXIT_FAILURE,
+				"close_pack_stream: cannot rename %s",
+				pack->save_file);
 
-	if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, size))
-		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_RCVTIMEO");
+		free(file);
+	}
 
-	if (setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, size))
-		err(EXIT_FAILURE, "setup_ssl: setsockopt SO_SNDTIMEO");
+	if (pack->stream_ready)
+		inflateEnd(&pack->stream);
 
-	session->socket_descriptor = sd;
+	EVP_MD_CTX_free(pack->context);
+	EVP_MD_CTX_free(pack->object_context);
+	free(pack->offset);
+	free(pack->offset_index);
+	free(pack->save_file);
+	free(pack);
+
+	session->pack = NULL;
 }
 
 
 /*
- * setup_ssl
+ * stream_response
  *
- * Procedure that sends a command to the server and processes the response.
+ * Procedure that removes the HTTP transfer encoding from the response body
+ * as it arrives and passes the payload on to the pkt-line decoder.
  */
 
 static void
-setup_ssl(connector *session)
+stream_response(connector *session, char *data, size_t size)
 {
-	int error = 0;
+	pack_stream *pack = session->pack;
+	size_t       length = 0;
 
-	SSL_library_init();
-	SSL_load_error_strings();
-	session->ctx = SSL_CTX_new(SSLv23_client_method());
-	SSL_CTX_set_mode(session->ctx, SSL_MODE_AUTO_RETRY);
-	SSL_CTX_set_options(session->ctx, SSL_OP_ALL | SSL_OP_NO_TICKET);
+	if ((!pack->chunked) && (pack->http_remaining <= 0))
+		pack->http_done = true;
 
-	if ((session->ssl = SSL_new(session->ctx)) == NULL)
-		err(EXIT_FAILURE, "setup_ssl: SSL_new");
+	while ((size > 0) && (!pack->http_done)) {
+		/* Responses with a Content-Length header are passed through. */
 
-	SSL_set_fd(session->ssl, session->socket_descriptor);
+		if (!pack->chunked) {
+			length = MIN(size, (size_t)pack->http_remaining);
 
-	while ((error = SSL_connect(session->ssl)) == -1)
-		fprintf(stderr,
-			"setup_ssl: SSL_connect error: %d\n",
-			SSL_get_error(session->ssl, error));
+			demux_pack_data(session, data, length);
+
+			pack->http_remaining -= (long)length;
+			pack->http_done       = (pack->http_remaining == 0);
+			break;
+		}
+
+		/* Pass along the remainder of the current chunk. */
+
+		if (pack->http_remaining > 0) {
+			length = MIN(size, (size_t)pack->http_remaining);
+
+			demux_pack_data(session, data, length);
+
+			pack->http_remaining -= (long)length;
+			data                 += length;
+			size                 -= length;
+			continue;
+		}
+
+		/*
+		 * Collect the chunk size line, skipping the preceding CRLF.
+		 * The last chunk is followed by any trailer fields and an
+		 * empty line, which has to be read as well so that nothing is
+		 * left on the connection for the next response.
+		 */
+
+		if (*data == '\n') {
+			pack->http_line[pack->http_line_size] = '\0';
+
+			if (pack->http_line_size == 0) {
+				pack->http_done = pack->http_trailer;
+			} else if (!pack->http_trailer) {
+				pack->http_remaining = strtol(pack->http_line, (char **)NULL, 16);
+				pack->http_trailer   = (pack->http_remaining == 0);
+			}
+
+			pack->http_line_size = 0;
+		} else if ((*data != '\r') && (pack->http_line_size < sizeof(pack->http_line) - 1)) {
+			pack->http_line[pack->http_line_size++] = *data;
+		}
+
+		data++;
+		size--;
+	}
 }
 
 
 /*
- * process_command
+ * demux_pack_data
  *
- * Procedure that sends a command to the server and processes the response.
+ * Procedure that splits the response body into pkt-lines and routes the
+ * contents of the pack data sideband to unpack_objects.
  */
 
 static void
-process_command(connector *session, char *command)
+demux_pack_data(connector *session, char *data, size_t size)
 {
-	char     read_buffer[BUFFER_UNIT_SMALL], *temp = NULL;
-	char    *marker_start = NULL, *marker_end = NULL, *data_start = NULL;
-	long     chunk_size = -1, response_code = 0;
-	ssize_t  marker_offset = 0, data_start_offset = 0;
-	ssize_t  bytes_read = 0, bytes_sent = 0, bytes_to_send = 0;
-	ssize_t  total_bytes_read = 0, total_bytes_sent = 0;
-	ssize_t  bytes_to_move = 0, bytes_expected = 0, check_bytes = 0;
-	int      error = 0, outlen = 0;
-	bool     ok = false, chunked_transfer = true;
+	pack_stream *pack = session->pack;
+	size_t       length = 0;
 
+	while (size > 0) {
+		/* Read the four hex digit length of the next pkt-line. */
 
-	bytes_to_send = (ssize_t)strlen(command);
+		if (pack->pkt_remaining == 0) {
+			pack->pkt_length[pack->pkt_length_size++] = *data++;
+			size--;
 
-	if (session->verbosity > 2)
-		fprintf(stderr, "%s\n\n", command);
+			if (pack->pkt_length_size < 4)
+				continue;
 
-	/* Transmit the command to the server. */
+			pack->pkt_length[4]   = '\0';
+			pack->pkt_length_size = 0;
+			pack->pkt_remaining   = (uint32_t)strtol(pack->pkt_length, (char **)NULL, 16);
 
-	while (total_bytes_sent < bytes_to_send) {
-		if (session->ssl)
-			bytes_sent = SSL_write(
-				session->ssl,
-				command + total_bytes_sent,
-				(int)(bytes_to_send - total_bytes_sent));
-		else
-			bytes_sent = write(
-				session->socket_descriptor,
-				command + total_bytes_sent,
-				(size_t)(bytes_to_send - total_bytes_sent));
+			/* Flush, delimiter and response end packets carry no data. */
 
-		if (bytes_sent <= 0) {
-			if (bytes_sent < 0 && (errno == EINTR || errno == 0))
-				continue;
+			if (pack->pkt_remaining < 4)
+				pack->pkt_remaining = 0;
 			else
-				err(EXIT_FAILURE, "process_command: send");
-		}
+				pack->pkt_remaining -= 4;
 
-		total_bytes_sent += bytes_sent;
-
-		if (session->verbosity > 2)
-			fprintf(stderr,
-				"\r==> bytes sent: %ld",
-				(long)total_bytes_sent);
-	}
+			/*
+			 * Keep the text of the section lines around for error
+			 * messages, while making sure the current line fits.
+			 */
 
-	if (session->verbosity > 2)
-		fprintf(stderr, "\n");
+			if ((pack->packfile) || (pack->text_size > sizeof(pack->text) / 2))
+				pack->text_size = 0;
 
-	/* Process the response. */
+			pack->pkt_band  = pack->packfile;
+			pack->text_line = pack->text_size;
+			continue;
+		}
 
-	while (chunk_size) {
-		if (session->ssl)
-			bytes_read = SSL_read(
-				session->ssl,
-				read_buffer,
-				BUFFER_UNIT_SMALL);
-		else
-			bytes_read = read(
-				session->socket_descriptor,
-				read_buffer,
-				BUFFER_UNIT_SMALL);
+		/* Inside the packfile section the first byte names the band. */
 
-		if (bytes_read == 0)
-			break;
+		if (pack->pkt_band) {
+			pack->band     = (uint8_t)*data++;
+			pack->pkt_band = false;
+			pack->pkt_remaining--;
+			size--;
+			continue;
+		}
 
-		if (bytes_read < 0)
-			err(EXIT_FAILURE,
-				"process_command: SSL_read error: %d",
-				SSL_get_error(session->ssl, error));
+		length = MIN(size, pack->pkt_remaining);
 
-		/*
-		 * Expand the buffer if needed, preserving the position and
-		 * data_start if the buffer moves.
-		 */
+		if ((pack->packfile) && (pack->band == 1)) {
+			unpack_objects(session, data, length);
+		} else {
+			for (size_t x = 0; (x < length) && (pack->text_size < sizeof(pack->text) - 1); x++)
+				pack->text[pack->text_size++] = data[x];
 
-		if ((unsigned long)(total_bytes_read + bytes_read + 1) > session->response_blocks * BUFFER_UNIT_LARGE) {
-			marker_offset     = marker_start - session->response;
-			data_start_offset = data_start   - session->response;
+			pack->text[pack->text_size] = '\0';
 
-			session->response = (char *)realloc(session->response,
-				++session->response_blocks * BUFFER_UNIT_LARGE);
+			if ((pack->packfile) && (pack->band == 3) && (pack->pkt_remaining == length))
+				errc(EXIT_FAILURE, EINVAL,
+					"fetch_pack: server error: %s",
+					pack->text);
 
-			if (session->response == NULL)
-				err(EXIT_FAILURE, "process_command: realloc");
+			if ((!pack->packfile) && (pack->pkt_remaining == length)) {
+				if (strncmp(pack->text + pack->text_line, "ERR ", 4) == 0)
+					errc(EXIT_FAILURE, EINVAL,
+						"fetch_pack: server error: %s",
+						pack->text + pack->text_line + 4);
 
-			marker_start = session->response + marker_offset;
-			data_start   = session->response + data_start_offset;
+				if (strcmp(pack->text + pack->text_line, "packfile\n") == 0)
+					pack->packfile = true;
+			}
 		}
 
-		/* Add the bytes received to the buffer. */
-
-		memcpy(session->response + total_bytes_read,
-			read_buffer,
-			(unsigned long)bytes_read);
+		pack->pkt_remaining -= (uint32_t)length;
+		data                += length;
+		size                -= length;
+	}
+}
 
-		total_bytes_read += bytes_read;
-		session->response[total_bytes_read] = '\0';
 
-		if (session->verbosity > 2)
-			fprintf(stderr, "\r==> "
-				"bytes read: %zd\t"
-				"bytes_expected: %ld\t"
-				"total_bytes_read: %ld",
-				bytes_read,
-				(long)bytes_expected,
-				(long)total_bytes_read);
+/*
+ * store_object
+ *
+ * Function that creates a new object and stores it in the array and
+ * lookup table, returning either the new object or the existing copy of it.
+ * The object checksum is calculated unless the caller already has it.
+ */
 
-		while ((session->verbosity) && (isatty(STDERR_FILENO))) {
-			struct timespec now;
-			static struct   timespec then;
-			char            buf[80], htotalb[7], persec[8];
-			static ssize_t  last_total;
-			static double   sum;
-			double          secs, throughput;
+static struct object_node *
+store_object(connector *session, uint8_t type, char *buffer, uint32_t buffer_size, uint32_t offset_pack, uint32_t index_delta, char *ref_delta_hash, char *hash)
+{
+	struct object_node *object = NULL;
+	char               *temp = NULL, *parents = NULL, object_hash[20];
+	char                legible[41], legible_ref_delta[41];
+	bool                ok = true;
 
-			if (clock_gettime(CLOCK_MONOTONIC_FAST, &now) == -1)
-				err(EXIT_FAILURE,
-					"process_command: clock_gettime");
+	if (hash == NULL)
+		hash = calculate_object_hash(buffer, buffer_size, type, object_hash);
 
-			if (then.tv_sec == 0)
-				then = now, secs = 1, sum = 1;
-			else {
-				secs = (double)(now.tv_sec - then.tv_sec) +
-					(double)(now.tv_nsec - then.tv_nsec) * 1e-9;
+	/* Check to make sure the object doesn't already exist. */
 
-				if (1 > secs)
-					break;
-				else
-					sum += secs;
-			}
+	object = find_object(hash);
 
-			throughput = ((double)(total_bytes_read - last_total) / secs);
+	if ((object == NULL) || (session->repair == true)) {
+		/* Extend the array if needed, create a new node and add it. */
 
-			humanize_number(htotalb, sizeof(htotalb),
-				total_bytes_read,
-				"B",
-				HN_AUTOSCALE,
-				HN_DECIMAL | HN_DIVISOR_1000);
+		if (session->objects % BUFFER_UNIT_SMALL == 0)
+			if ((session->object = (struct object_node **)realloc(session->object, (session->objects + BUFFER_UNIT_SMALL) * sizeof(struct object_node *))) == NULL)
+				err(EXIT_FAILURE, "store_object: realloc");
 
-			humanize_number(persec, sizeof(persec),
-				(int64_t)throughput,
-				"B",
-				HN_AUTOSCALE,
-				HN_DECIMAL | HN_DIVISOR_1000);
+		object = (struct object_node *)arena_alloc(sizeof(struct object_node));
 
-			snprintf(buf, sizeof(buf) - 1,
-				"  %s in %dm%02ds, %s/s now",
-				htotalb,
-				(int)(sum / 60),
-				(int)sum % 60,
-				persec);
+		object->index          = session->objects;
+		object->type           = type;
+		object->offset_pack    = offset_pack;
+		object->index_delta    = index_delta;
+		object->ref_delta_hash = NULL;
+		object->parent         = NULL;
+		object->parents        = 0;
+		object->buffer         = buffer;
+		object->buffer_size    = buffer_size;
+		object->offset_cache   = -1;
+		object->lazy           = false;
+		object->packed_size    = 0;
 
-			if (isatty(STDERR_FILENO))
-				outlen = fprintf(stderr, "%-*s\r", outlen, buf) - 1;
+		memcpy(object->hash, hash, 20);
 
-			last_total = total_bytes_read;
-			then = now;
-			break;
+		if (ref_delta_hash) {
+			object->ref_delta_hash = (char *)arena_alloc(20);
+			memcpy(object->ref_delta_hash, ref_delta_hash, 20);
 		}
 
-		/* Find the boundary between the header and the data. */
+		if (session->verbosity > 2)
+			fprintf(stdout,
+				"###### %05d-%d\t%d\t%u\t%s\t%d\t%s\n",
+				object->index,
+				object->type,
+				object->offset_pack,
+				object->buffer_size,
+				legible_hash(object->hash, legible),
+				object->index_delta,
+				(object->ref_delta_hash ? legible_hash(object->ref_delta_hash, legible_ref_delta) : ""));
+
+		/* Find the parent commits for commit objects. */
 
-		if (chunk_size == -1) {
-			if ((marker_start = strnstr(session->response, "\r\n\r\n", (size_t)total_bytes_read)) == NULL) {
-				continue;
-			} else {
-				bytes_expected = marker_start - session->response + 4;
-				marker_start += 2;
-				data_start = marker_start;
+		if (type == 1) {
+			temp = buffer;
 
-				/* Check the response code. */
+			while ((temp + 47 - buffer < (long)buffer_size) && ((temp = strnstr(temp, "parent ", buffer + buffer_size - temp)) != NULL)) {
+				ok    = true;
+				temp += 47;
 
-				if (strstr(session->response, "HTTP/1.") == session->response) {
-					response_code = strtol(
-						strchr(session->response, ' ') + 1,
-						(char **)NULL, 10);
+				/* Make sure the commit is valid. */
 
-					if (response_code == 200)
-						ok = true;
+				if (*temp != '\n')
+					continue;
 
-					if ((session->proxy_host) && (response_code >= 200) && (response_code < 300))
-						ok = true;
-				}
+				for (int x = 0; x < 40; x++)
+					if (!isxdigit((uint8_t)temp[x - 40]))
+						ok = false;
+
+				if (!ok)
+					continue;
+
+				/* Store the parent commit. */
 
-				temp = strstr(session->response, "Content-Length: ");
+				parents = object->parent;
 
-				if (temp != NULL) {
-					bytes_expected += (ssize_t)strtol(
-						temp + 16,
-						(char **)NULL, 10);
+				object->parent = (char *)arena_alloc((object->parents + 1) * 20);
 
-					chunk_size = -2;
-					chunked_transfer = false;
-				}
+				if (object->parents > 0)
+					memcpy(object->parent, parents, object->parents * 20);
+
+				illegible_hash(temp - 40, object->parent + object->parents * 20);
+				object->parents++;
 			}
 		}
+/*
+			char path[1024];
+			int fd;
 
-		/* Successful CONNECT responses do not contain a body. */
+			snprintf(path, sizeof(path), "./temp/b%04d-%d-%s.out", object->index, object->type, legible_hash(object->hash, legible));
 
-		if ((strstr(command, "CONNECT ") == command) && (ok))
-			break;
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
+			chmod(path, 0644);
+			write(fd, object->buffer, object->buffer_size);
+			close(fd);
+*/
+		if (type < 6)
+			hash_table_insert(&Objects,
+				hash_code_digest(object->hash),
+				object,
+				object->hash,
+				object_node_match);
 
-		if ((!chunked_transfer) && (total_bytes_read < bytes_expected))
-			continue;
+		if (session->low_memory) {
+			object->buffer = cache_object(session, object, buffer, buffer_size);
+			free(buffer);
+		}
 
-		while ((chunked_transfer) && (total_bytes_read + chunk_size > bytes_expected)) {
-			/* Make sure the whole chunk marker has been read. */
+		session->object[session->objects++] = object;
+	}
 
-			check_bytes = (ssize_t)(total_bytes_read - (marker_start + 2 - session->response));
+	return (object);
+}
 
-			if (check_bytes < 0)
-				break;
 
-			marker_end = strnstr(marker_start + 2, "\r\n", (size_t)check_bytes);
+/*
+ * object_buffer
+ *
+ * Function that returns the contents of an object.  Lazy blobs are inflated
+ * from the copy of their pack data, or rebuilt from the delta they were
+ * resolved from, into a new buffer that release_object_buffer frees.
+ */
 
-			if (marker_end == NULL)
-				break;
+static char *
+object_buffer(connector *session, struct object_node *object)
+{
+	delta_job  job;
+	z_stream   stream;
+	char      *buffer = NULL;
+	int        stream_code = 0;
 
-			/* Remove the chunk length marker. */
+	if (!object->lazy)
+		return (object->buffer);
 
-			chunk_size    = strtol(marker_start, (char **)NULL, 16);
-			bytes_to_move = (ssize_t)(total_bytes_read - (marker_end + 2 - session->response) + 1);
+	/* An index_delta of a lazy blob refers to the delta it came from. */
 
-			if (bytes_to_move < 0)
-				break;
+	if (object->packed_size == 0) {
+		job.delta = session->object[object->index_delta];
+		resolve_delta(session, &job);
 
-			memmove(marker_start, marker_end + 2, (size_t)bytes_to_move);
-			total_bytes_read -= (marker_end + 2 - marker_start);
+		return (job.buffer);
+	}
 
-			if (chunk_size == 0)
-				break;
+	if ((buffer = (char *)malloc(object->buffer_size + 1)) == NULL)
+		err(EXIT_FAILURE, "object_buffer: malloc");
 
-			marker_start   += (unsigned)chunk_size;
-			bytes_expected += (unsigned)chunk_size;
-		}
-	}
+	memset(&stream, 0, sizeof(z_stream));
 
-	if ((session->verbosity) && (isatty(STDERR_FILENO)))
-		fprintf(stderr, "\r\e[0K\r");
+	if (inflateInit(&stream) != Z_OK)
+		errc(EXIT_FAILURE, EILSEQ, "object_buffer: zlib data stream failure");
 
-	if (!ok)
-		errc(EXIT_FAILURE, EINVAL,
-			"process_command: read failure:\n%s\n",
-			session->response);
+	stream.next_in   = (uint8_t *)object->buffer;
+	stream.avail_in  = object->packed_size;
+	stream.next_out  = (uint8_t *)buffer;
+	stream.avail_out = object->buffer_size + 1;
+
+	stream_code = inflate(&stream, Z_FINISH);
 
-	/* Remove the header. */
+	if ((stream_code != Z_STREAM_END) || (stream.total_out != object->buffer_size))
+		errc(EXIT_FAILURE, EILSEQ, "object_buffer: zlib data stream failure");
 
-	session->response_size = (uint32_t)(total_bytes_read - (data_start - session->response));
-	memmove(session->response, data_start, session->response_size);
-	session->response[session->response_size] = '\0';
+	inflateEnd(&stream);
+
+	return (buffer);
 }
 
 
 /*
- * send_command
+ * release_object_buffer
  *
- * Function that constructs the command to the fetch the full pack data.
+ * Procedure that frees a buffer returned by object_buffer for a lazy blob.
  */
 
 static void
-send_command(connector *session, char *want)
+release_object_buffer(struct object_node *object, char *buffer)
 {
-	char   *command = NULL;
-	size_t  want_size = 0;
-
-	want_size = strlen(want);
-
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
-		err(EXIT_FAILURE, "send_command: malloc");
-
-	snprintf(command, BUFFER_UNIT_SMALL + want_size,
-		"POST %s/git-upload-pack HTTP/1.1\r\n"
-		"Host: %s:%d\r\n"
-		"User-Agent: gitup/%s\r\n"
-		"Accept-encoding: deflate, gzip\r\n"
-		"Content-type: application/x-git-upload-pack-request\r\n"
-		"Accept: application/x-git-upload-pack-result\r\n"
-		"Git-Protocol: version=2\r\n"
-		"Content-length: %zu\r\n"
-		"\r\n"
-		"%s",
-		session->repository_path,
-		session->host_bracketed,
-		session->port,
-		GITUP_VERSION,
-		want_size,
-		want);
-
-	process_command(session, command);
-
-	free(command);
+	if (object->lazy)
+		free(buffer);
 }
 
 
 /*
- * build_clone_command
+ * parse_object_header
  *
- * Function that constructs and executes the command to the fetch the shallow
- * pack data.
+ * Function that decodes the object header collected so far, returning
+ * true once it is complete.
  */
 
-static char *
-build_clone_command(connector *session)
+static bool
+parse_object_header(pack_stream *pack)
 {
-	char *command = NULL;
+	uint32_t position = 0, lookup_offset = 0, shift = 4;
+	uint32_t low = 0, high = 0, middle = 0, base = 0;
+	uint8_t  byte = 0;
 
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
-		err(EXIT_FAILURE, "build_clone_command: malloc");
+	/* Extract the object type and size. */
 
-	snprintf(command, BUFFER_UNIT_SMALL,
-		"0011command=fetch0001"
-		"000fno-progress"
-		"000dofs-delta"
-		"0034shallow %s"
-		"0032want %s\n"
-		"0009done\n0000",
-		session->want,
-		session->want);
+	byte              = (uint8_t)pack->header[position++];
+	pack->object_type = byte >> 4 & 0x07;
+	pack->object_size = byte & 0x0F;
 
-	return (command);
+	while (byte & 0x80) {
+		if (position == pack->header_size)
+			return (false);
+
+		byte               = (uint8_t)pack->header[position++];
+		pack->object_size += (uint32_t)(byte & 0x7F) << shift;
+		shift             += 7;
+	}
+
+	pack->index_delta    = 0;
+	pack->ref_delta_hash = NULL;
+
+	/* Find the object->index referred to by the ofs-delta. */
+
+	if (pack->object_type == 6) {
+		do {
+			if (position == pack->header_size)
+				return (false);
+
+			byte          = (uint8_t)pack->header[position++];
+			lookup_offset = (lookup_offset << 7) + (byte & 0x7F) + 1;
+		}
+		while (byte & 0x80);
+
+		/* The offsets are recorded in pack order, so search them. */
+
+		base = pack->offset_pack - lookup_offset + 1;
+		high = pack->objects;
+
+		while (low < high) {
+			middle = low + (high - low) / 2;
+
+			if (pack->offset[middle] < base)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+
+		if ((lookup_offset > pack->offset_pack) || (low == pack->objects) || (pack->offset[low] != base))
+			errc(EXIT_FAILURE, EINVAL,
+				"unpack_objects: cannot find ofs-delta "
+				"base object");
+
+		pack->index_delta = pack->offset_index[low];
+	}
+
+	/* Extract the ref-delta checksum. */
+
+	if (pack->object_type == 7) {
+		if (pack->header_size < position + 20)
+			return (false);
+
+		pack->ref_delta_hash = pack->header + position;
+	}
+
+	return (true);
 }
 
 
 /*
- * build_commit_command
+ * inflate_lazy_blob
  *
- * Function that constructs and executes the command to the fetch the commit
- * data.
+ * Function that inflates the data on hand for a lazy blob through a small
+ * window, adding it to the blob's checksum without keeping it.
  */
 
-static char *
-build_commit_command(connector *session)
+static int
+inflate_lazy_blob(pack_stream *pack)
 {
-	char *command = NULL, temp[64];
-	bool  have = false;
+	uint8_t  window[16384];
+	uint32_t length = 0;
+	int      stream_code = Z_OK;
 
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
-		err(EXIT_FAILURE, "build_commit_command: malloc");
+	do {
+		pack->stream.avail_out = sizeof(window);
+		pack->stream.next_out  = window;
 
-	if (session->have)
-		have = true;
+		stream_code = inflate(&pack->stream, Z_NO_FLUSH);
 
-	if ((session->keep_pack_file) && (!path_exists(session->pack_history_file)))
-		have = false;
+		/* Everything on hand was used up. */
 
-	if (!path_exists(session->remote_history_file))
-		have = false;
+		if (stream_code == Z_BUF_ERROR)
+			return (Z_OK);
 
-	if (have == false)
-		temp[0] = '\0';
-	else
-		snprintf(temp, sizeof(temp), "0032have %s\n", session->have);
+		if ((stream_code != Z_OK) && (stream_code != Z_STREAM_END))
+			return (stream_code);
 
-	snprintf(command, BUFFER_UNIT_SMALL,
-		"0011command=fetch0001"
-		"000dthin-pack"
-		"000fno-progress"
-		"000dofs-delta"
-		"0012filter tree:0\n"
-		"0032want %s\n"
-		"%s"
-		"0009done\n0000",
-		session->want,
-		temp);
+		length             = (uint32_t)sizeof(window) - pack->stream.avail_out;
+		pack->buffer_size += length;
 
-	return (command);
+		if (pack->buffer_size > pack->object_size)
+			break;
+
+		EVP_DigestUpdate(pack->object_context, window, length);
+	}
+	while ((stream_code == Z_OK) && ((pack->stream.avail_out == 0) || (pack->stream.avail_in > 0)));
+
+	return (stream_code);
 }
 
 
 /*
- * build_pull_command
+ * store_lazy_blob
  *
- * Function that constructs and executes the command to the fetch the
- * incremental pack data.
+ * Function that stores a lazy blob whose pack data has been hashed, keeping
+ * just the deflated copy of it for object_buffer.
  */
 
-static char *
-build_pull_command(connector *session)
+static struct object_node *
+store_lazy_blob(connector *session, pack_stream *pack)
 {
-	char *command = NULL;
-
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
-		err(EXIT_FAILURE, "build_pull_command: malloc");
-
-	snprintf(command, BUFFER_UNIT_SMALL,
-		"0011command=fetch0001"
-		"000dthin-pack"
-		"000fno-progress"
-		"000dofs-delta"
-		"0034shallow %s"
-		"0034shallow %s"
-		"000cdeepen 1"
-		"0032want %s\n"
-		"0032have %s\n"
-		"0009done\n0000",
-		session->want,
-		session->have,
-		session->want,
-		session->have);
+	struct object_node *object = NULL;
+	char                hash[20];
+
+	EVP_DigestFinal_ex(pack->object_context, (uint8_t *)hash, NULL);
+
+	if ((pack->buffer = (char *)realloc(pack->buffer, pack->packed_size)) == NULL)
+		err(EXIT_FAILURE, "store_lazy_blob: realloc");
+
+	object = store_object(session,
+		3,
+		pack->buffer,
+		pack->object_size,
+		pack->offset_pack,
+		pack->index_delta,
+		pack->ref_delta_hash,
+		hash);
+
+	if (object->buffer == pack->buffer) {
+		object->lazy        = true;
+		object->packed_size = pack->packed_size;
+	} else {
+		free(pack->buffer);
+	}
 
-	return (command);
+	return (object);
 }
 
 
 /*
- * build_repair_command
+ * unpack_objects
  *
- * Procedure that compares the local repository tree with the data saved from
- * the last run to see if anything has been modified.
+ * Procedure that extracts the objects from the pack data as it arrives,
+ * picking up wherever the previous block of data left off.
  */
 
-static char *
-build_repair_command(connector *session)
+static void
+unpack_objects(connector *session, char *data, size_t size)
 {
-	struct file_node *find = NULL, *found = NULL;
-	char             *command = NULL, *want = NULL, line[BUFFER_UNIT_SMALL];
-	const char       *message[2] = { "is missing.", "has been modified." };
-	uint32_t          want_size = 0;
+	pack_stream        *pack = session->pack;
+	struct object_node *object = NULL;
+	unsigned long       x = 0;
+	uint32_t            used = 0;
+	int                 stream_code = 0, version = 0;
+	char                expected[41], received[41];
+
+	if (pack->save_descriptor != -1)
+		if (write(pack->save_descriptor, data, size) != (ssize_t)size)
+			err(EXIT_FAILURE,
+				"unpack_objects: write file failure %s",
+				pack->save_file);
 
-	RB_FOREACH(find, Tree_Remote_Path, &Remote_Path) {
-		found = RB_FIND(Tree_Local_Path, &Local_Path, find);
+	while (size > 0) {
+		/* Check the pack version number and the number of objects. */
 
-		if ((found == NULL) || ((strncmp(found->hash, find->hash, 40) != 0) && (!ignore_file(session, find->path, IGNORE_FORCE_READ)))) {
-			if (session->verbosity)
+		if (pack->state == PACK_HEADER) {
+			pack->header[pack->header_size++] = *data++;
+			pack->position++;
+			size--;
+
+			if (pack->header_size < 12)
+				continue;
+
+			if (memcmp(pack->header, "PACK", 4) != 0)
+				errc(EXIT_FAILURE, EFTYPE,
+					"unpack_objects: malformed pack data");
+
+			version = (uint8_t)pack->header[7];
+
+			if (version != 2)
+				errc(EXIT_FAILURE, EFTYPE,
+					"unpack_objects: pack version %d not supported",
+					version);
+
+			for (x = 8; x < 12; x++)
+				pack->total_objects = (pack->total_objects << 8)
+					+ (uint8_t)pack->header[x];
+
+			if (session->verbosity > 2)
 				fprintf(stderr,
-					" ! %s %s\n",
-					find->path,
-					message[found ? 1 : 0]);
+					"\nversion: %d, total_objects: %d\n\n",
+					version,
+					pack->total_objects);
 
-			snprintf(line, sizeof(line),
-				"0032want %s\n",
-				find->hash);
+			EVP_DigestUpdate(pack->context, pack->header, 12);
 
-			append(&want, &want_size, line, strlen(line));
+			pack->header_size = 0;
+			pack->state       = (pack->total_objects > 0 ? PACK_OBJECT_HEADER : PACK_TRAILER);
+			continue;
 		}
-	}
 
-	if (want_size == 0)
-		return (NULL);
+		/* Collect the object header one byte at a time. */
 
-	if (want_size > 3276800)
-		errc(EXIT_FAILURE, E2BIG,
-			"build_repair_command: There are too many files to "
-			"repair -- please re-clone the repository");
+		if (pack->state == PACK_OBJECT_HEADER) {
+			if (pack->header_size == 0)
+				pack->offset_pack = pack->position;
 
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
-		err(EXIT_FAILURE, "build_repair_command: malloc");
+			pack->header[pack->header_size++] = *data++;
+			pack->position++;
+			size--;
 
-	snprintf(command, BUFFER_UNIT_SMALL + want_size,
-		"0011command=fetch0001"
-		"000dthin-pack"
-		"000fno-progress"
-		"000dofs-delta"
-		"%s"
-		"000cdeepen 1"
-		"0009done\n0000",
-		want);
+			if (!parse_object_header(pack)) {
+				if (pack->header_size == sizeof(pack->header))
+					errc(EXIT_FAILURE, EFTYPE,
+						"unpack_objects: malformed object header");
 
-	free(want);
+				continue;
+			}
 
-	return (command);
-}
+			EVP_DigestUpdate(pack->context, pack->header, pack->header_size);
 
+			/*
+			 * The object header holds the inflated size, so the data
+			 * is inflated straight into a buffer of that size.  The
+			 * extra byte catches objects that are larger than claimed.
+			 * Lazy blobs keep a copy of their deflated data instead and
+			 * are only hashed as they are inflated.
+			 */
 
-/*
- * get_commit_details
- */
+			pack->lazy        = ((session->lazy_blobs) && (pack->object_type == 3));
+			pack->buffer_size = 0;
 
-static void
-get_commit_details(connector *session)
-{
-	char       command[BUFFER_UNIT_SMALL], ref[BUFFER_UNIT_SMALL], want[41];
-	char       peeled[BUFFER_UNIT_SMALL];
-	char      *position = NULL;
-	time_t     current;
-	struct tm  now;
-	int        tries = 2, year = 0, quarter = 0;
-	unsigned long   length = 0;
-	bool       detached = (session->want != NULL ? true : false);
+			if (pack->lazy) {
+				pack->packed_size     = 0;
+				pack->packed_capacity = BUFFER_UNIT_SMALL;
 
-	/* Send the initial info/refs command. */
+				start_object_hash(pack->object_context, 3, pack->object_size);
+			}
 
-	snprintf(command, BUFFER_UNIT_SMALL,
-		"GET %s/info/refs?service=git-upload-pack HTTP/1.1\r\n"
-		"Host: %s:%d\r\n"
-		"User-Agent: gitup/%s\r\n"
-		"Git-Protocol: version=2\r\n"
-		"\r\n",
-		session->repository_path,
-		session->host_bracketed,
-		session->port,
-		GITUP_VERSION);
+			pack->buffer = (char *)malloc(pack->lazy ? pack->packed_capacity : pack->object_size + 1);
 
-	process_command(session, command);
+			if (pack->buffer == NULL)
+				err(EXIT_FAILURE, "unpack_objects: malloc");
 
-	if (session->verbosity > 2)
-		printf("%s\n", session->response);
+			/* One zlib stream is reset and reused for every object. */
 
-	/* Make sure the server supports the version 2 protocol. */
+			if (pack->stream_ready) {
+				stream_code = inflateReset(&pack->stream);
+			} else {
+				pack->stream.zalloc = Z_NULL;
+				pack->stream.zfree  = Z_NULL;
+				pack->stream.opaque = Z_NULL;
 
-	if (strnstr(session->response, "version 2", session->response_size) == NULL)
-		errc(EXIT_FAILURE, EPROTONOSUPPORT,
-			"%s does not support the version 2 wire protocol",
-			session->host);
+				stream_code        = inflateInit(&pack->stream);
+				pack->stream_ready = (stream_code == Z_OK);
+			}
 
-	if ((strnstr(session->response, "filter", session->response_size) == NULL) && (session->commit_history)) {
-/*
-		fprintf(stderr,
-			"! %s does not support the filter feature and the "
-			"commit history is unavailable\n",
-			session->host);
-*/
-		session->commit_history = false;
-	}
+			if (stream_code != Z_OK)
+				errc(EXIT_FAILURE, EILSEQ,
+					"unpack_objects: zlib data stream failure");
 
-	/* Fetch the list of refs. */
+			pack->state = PACK_OBJECT_DATA;
+			continue;
+		}
 
-	snprintf(command, BUFFER_UNIT_SMALL,
-		"0014command=ls-refs\n"
-		"0016object-format=sha1"
-		"0001"
-		"0009peel\n"
-		"000csymrefs\n"
-		"0014ref-prefix HEAD\n"
-		"001bref-prefix refs/heads/\n"
-		"001aref-prefix refs/tags/\n"
-		"0000");
+		/* Inflate as much of the object as the data on hand allows. */
 
-	send_command(session, command);
+		if (pack->state == PACK_OBJECT_DATA) {
+			pack->stream.avail_in  = (uint32_t)size;
+			pack->stream.next_in   = (uint8_t *)data;
 
-	if (session->verbosity > 2)
-		printf("%s\n", session->response);
+			if (pack->lazy) {
+				stream_code = inflate_lazy_blob(pack);
+			} else {
+				pack->stream.avail_out = pack->object_size + 1 - pack->buffer_size;
+				pack->stream.next_out  = (uint8_t *)pack->buffer + pack->buffer_size;
 
-	/* Extract the "want" checksum. */
+				stream_code       = inflate(&pack->stream, Z_NO_FLUSH);
+				pack->buffer_size = pack->object_size + 1 - pack->stream.avail_out;
+			}
 
-	want[0] = '\0';
+			if ((stream_code == Z_DATA_ERROR) || (stream_code == Z_NEED_DICT) || (stream_code == Z_MEM_ERROR) || (stream_code == Z_BUF_ERROR))
+				errc(EXIT_FAILURE, EILSEQ,
+					"unpack_objects: zlib data stream failure");
+
+			if ((pack->buffer_size > pack->object_size) || ((stream_code == Z_STREAM_END) && (pack->buffer_size != pack->object_size)))
+				errc(EXIT_FAILURE, EFTYPE,
+					"unpack_objects: object at offset %u is %u bytes, "
+					"expected %u",
+					pack->offset_pack,
+					pack->buffer_size,
+					pack->object_size);
+
+			used = (uint32_t)size - pack->stream.avail_in;
+
+			EVP_DigestUpdate(pack->context, data, used);
+
+			if (pack->lazy) {
+				if (pack->packed_size + used > pack->packed_capacity) {
+					while (pack->packed_size + used > pack->packed_capacity)
+						pack->packed_capacity *= 2;
+
+					pack->buffer = (char *)realloc(pack->buffer, pack->packed_capacity);
+
+					if (pack->buffer == NULL)
+						err(EXIT_FAILURE, "unpack_objects: realloc");
+				}
+
+				memcpy(pack->buffer + pack->packed_size, data, used);
+				pack->packed_size += used;
+			}
+
+			pack->position += used;
+			data           += used;
+			size           -= used;
+
+			if (stream_code != Z_STREAM_END)
+				continue;
+
+			if (pack->lazy)
+				object = store_lazy_blob(session, pack);
+			else
+				object = store_object(session,
+					pack->object_type,
+					pack->buffer,
+					pack->buffer_size,
+					pack->offset_pack,
+					pack->index_delta,
+					pack->ref_delta_hash,
+					NULL);
 
-	while ((tries-- > 0) && (want[0] == '\0') && (detached == false)) {
-		if (strncmp(session->branch, "quarterly", 9) == 0) {
 			/*
-			 * If the current calendar quarter doesn't exist, try
-			 * the previous one.
+			 * Remember where the object started so later ofs-deltas can
+			 * find it, even if it was already known from another pack.
 			 */
 
-			current = time(NULL);
-			now     = *localtime(&current);
-			year    = 1900 + now.tm_year + ((tries == 0) && (now.tm_mon < 3) ? -1 : 0);
-			quarter = ((now.tm_mon / 3) + (tries == 0 ? 3 : 0)) % 4 + 1;
+			if (pack->objects % BUFFER_UNIT_SMALL == 0) {
+				pack->offset = (uint32_t *)realloc(pack->offset,
+					(pack->objects + BUFFER_UNIT_SMALL) * sizeof(uint32_t));
 
-			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%04dQ%d", year, quarter);
-		} else if (session->tag != NULL) {
-			snprintf(ref, BUFFER_UNIT_SMALL, " refs/tags/%s", session->tag);
-		} else {
-			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%s", session->branch);
-		}
+				pack->offset_index = (uint32_t *)realloc(pack->offset_index,
+					(pack->objects + BUFFER_UNIT_SMALL) * sizeof(uint32_t));
 
-		/*
-		 * Look for the "want" in peeled references first, then look
-		 * before the ref.
-		 */
+				if ((pack->offset == NULL) || (pack->offset_index == NULL))
+					err(EXIT_FAILURE, "unpack_objects: realloc");
+			}
 
-		snprintf(peeled, sizeof(peeled), "%s peeled:", ref);
+			pack->offset[pack->objects]       = pack->offset_pack;
+			pack->offset_index[pack->objects] = object->index;
 
-		if ((position = strstr(session->response, peeled)) != NULL)
-			memcpy(want, position + strlen(peeled), 40);
-		else if ((position = strstr(session->response, ref)) != NULL)
-			memcpy(want, position - 40, 40);
-		else if (tries == 0)
-			errc(EXIT_FAILURE, EINVAL,
-				"get_commit_details:%s doesn't exist in %s",
-				ref,
-				session->repository_path);
-	}
+			pack->header_size = 0;
+			pack->state       = (++pack->objects < pack->total_objects ? PACK_OBJECT_HEADER : PACK_TRAILER);
+			continue;
+		}
 
-	/* Retain the name of the quarterly branch being used. */
+		/* Verify the pack data checksum. */
 
-	if (strncmp(session->branch, "quarterly", 9) == 0) {
-		free(session->branch);
-		session->branch = strdup(ref + 12);
-	}
+		if (pack->state == PACK_TRAILER) {
+			pack->trailer[pack->trailer_size++] = *data++;
+			size--;
 
-	if (want[0] != '\0') {
-		if (session->want == NULL)
-			if ((session->want = (char *)malloc(41)) == NULL)
-				err(EXIT_FAILURE, "get_commit_details: malloc");
+			if (pack->trailer_size < 20)
+				continue;
 
-		memcpy(session->want, want, 40);
-		session->want[40] = '\0';
+			EVP_DigestFinal_ex(pack->context, (uint8_t *)pack->header, NULL);
 
-		if (session->verbosity)
-			fprintf(stderr, "# Want: %s\n", session->want);
-	}
+			if (memcmp(pack->trailer, pack->header, 20) != 0)
+				errc(EXIT_FAILURE, EAUTH,
+					"unpack_objects: pack checksum mismatch -- "
+					"expected: %s, received: %s",
+					legible_hash(pack->trailer, expected),
+					legible_hash(pack->header, received));
 
-	/*
-	 * Because there is no way to lookup commit history, if a want commit
-	 * is specified, change the branch to (detached).
-	 */
+			pack->state = PACK_DONE;
+			continue;
+		}
 
-	if (detached == true) {
-		free(session->branch);
-		session->branch = strdup("(detached)");
+		/* Ignore anything following the pack data. */
+
+		break;
 	}
+}
 
-	if ((session->verbosity) && (session->tag == NULL))
-		fprintf(stderr, "# Branch: %s\n", session->branch);
 
-	/* Create the pack file names. */
+/*
+ * unpack_delta_integer
+ *
+ * Function that reconstructs a 32 bit integer from the data stream.
+ */
 
-	if (session->keep_pack_file == true) {
-		length = strlen(session->section) + 47;
+static uint32_t
+unpack_delta_integer(char *data, uint32_t *position, uint8_t bits)
+{
+	uint32_t result = 0, read_bytes = 0, temp = 0, mask = 8;
 
-		session->pack_data_file    = (char *)malloc(length + 1);
-		session->pack_history_file = (char *)malloc(length + 9);
+	/* Determine how many bytes in the stream are needed. */
 
-		if (session->pack_data_file == NULL)
-			err(EXIT_FAILURE, "get_commit_details: malloc");
+	do if (bits & mask) read_bytes++;
+	while (mask >>= 1);
 
-		if (session->pack_history_file == NULL)
-			err(EXIT_FAILURE, "get_commit_details: malloc");
+	/*
+	 * Put the bytes in their proper position based on the bit field
+	 * passed in.
+	 */
+
+	if (read_bytes > 0) {
+		temp = read_bytes;
+		mask = 3;
 
-		snprintf(session->pack_data_file, length,
-			"%s-%s.pack",
-			session->section,
-			session->want);
+		do {
+			if (bits & (1 << mask))
+				result += (uint32_t)((uint8_t)data[*position + --temp] << (mask * 8));
+		}
+		while (mask-- > 0);
 
-		snprintf(session->pack_history_file, length + 8,
-			"%s.history",
-			session->pack_data_file);
+		*position += read_bytes;
 	}
+
+	return (result);
 }
 
 
 /*
- * load_pack
+ * unpack_integer
  *
- * Procedure that loads a local copy of the pack data or fetches it from
- * the server.
+ * Function that reconstructs a variable length integer from the data stream.
  */
 
-static void
-load_pack(connector *session, char *file, bool history_file)
+static uint32_t
+unpack_integer(char *data, uint32_t *position)
 {
-	char   hash[20], *command = NULL;
-	size_t pack_size = 0;
+	uint32_t result = 0, count = 0;
 
-	if ((path_exists(file)) && (session->use_pack_file)) {
-		if (session->verbosity)
-			fprintf(stderr, "# Loading pack file: %s\n", file);
+	do result += (uint32_t)((data[*position] & 0x7F) << (7 * count++));
+	while (data[(*position)++] & 0x80);
 
-		session->response_size = 0;
+	return (result);
+}
 
-		load_file(file,
-			&session->response,
-			&session->response_size);
-	} else {
-		if (history_file)
-			command = build_commit_command(session);
-		else if (!session->clone)
-			command = build_pull_command(session);
-		else
-			command = build_clone_command(session);
 
-		fetch_pack(session, command);
-	}
+/*
+ * delta_cache_copy
+ *
+ * Function that copies the reconstructed version of a delta object out of
+ * the delta base cache, marking it as the most recently used entry.
+ */
 
-	pack_size = session->response_size - 20;
+static bool
+delta_cache_copy(uint32_t index, uint8_t *type, char **buffer, uint32_t *buffer_size)
+{
+	struct cache_node *cache = NULL, find;
 
-	/* Verify the pack data checksum. */
+	find.index = index;
 
-	SHA1((uint8_t *)session->response, pack_size, (uint8_t *)hash);
+	pthread_mutex_lock(&Delta_Cache_Lock);
 
-	if (memcmp(session->response + pack_size, hash, 20) != 0)
-		errc(EXIT_FAILURE, EAUTH,
-			"load_pack: pack checksum mismatch -- "
-			"expected: %s, received: %s",
-			legible_hash(session->response + pack_size),
-			legible_hash(hash));
+	if ((cache = RB_FIND(Tree_Delta_Cache, &Delta_Cache, &find)) != NULL) {
+		TAILQ_REMOVE(&Delta_Cache_LRU, cache, lru);
+		TAILQ_INSERT_TAIL(&Delta_Cache_LRU, cache, lru);
 
-	/* Save the pack data. */
+		if ((*buffer = (char *)malloc(cache->buffer_size + 1)) == NULL)
+			err(EXIT_FAILURE, "delta_cache_copy: malloc");
 
-	if ((!path_exists(file)) && (session->keep_pack_file)) {
-		if (session->verbosity)
-			fprintf(stderr, "# Saving pack file: %s\n", file);
+		memcpy(*buffer, cache->buffer, cache->buffer_size);
 
-		save_file(file,
-			0644,
-			session->response,
-			session->response_size,
-			0,
-			0);
+		*type        = cache->type;
+		*buffer_size = cache->buffer_size;
 	}
 
-	/* Process the pack data. */
+	pthread_mutex_unlock(&Delta_Cache_Lock);
 
-	unpack_objects(session);
-
-	free(session->response);
-	session->response        = NULL;
-	session->response_size   = 0;
-	session->response_blocks = 0;
+	return (cache != NULL);
 }
 
 
 /*
- * fetch_pack
+ * delta_cache_add
  *
- * Procedure that fetches pack data from the server.
+ * Procedure that stores a copy of a reconstructed delta object in the delta
+ * base cache, evicting the least recently used entries to stay within the
+ * configured limit.
  */
 
 static void
-fetch_pack(connector *session, char *command)
+delta_cache_add(connector *session, uint32_t index, uint8_t type, char *buffer, uint32_t buffer_size)
 {
-	char   *pack_start = NULL, hash[20];
-	long    chunk_size = 1, source = 0, target = 0;
-	size_t  pack_size = 0;
+	struct cache_node *cache = NULL, find;
 
-	/* Request the pack data. */
+	if (buffer_size > session->delta_cache_limit)
+		return;
 
-	send_command(session, command);
+	if ((cache = (struct cache_node *)malloc(sizeof(struct cache_node))) == NULL)
+		err(EXIT_FAILURE, "delta_cache_add: malloc");
 
-	/* Find the start of the pack data and remove the header. */
+	if ((cache->buffer = (char *)malloc(buffer_size + 1)) == NULL)
+		err(EXIT_FAILURE, "delta_cache_add: malloc");
 
-	if ((pack_start = strstr(session->response, "PACK")) == NULL)
-		errc(EXIT_FAILURE, EFTYPE,
-			"fetch_pack: malformed pack data:\n%s",
-			session->response);
+	memcpy(cache->buffer, buffer, buffer_size);
 
-	pack_start -= 5;
-	session->response_size -= (uint64_t)(pack_start - session->response + 11);
-	memmove(session->response, session->response + 8, 4);
+	cache->index       = index;
+	cache->type        = type;
+	cache->buffer_size = buffer_size;
+	find.index         = index;
 
-	/* Remove the chunk size markers from the pack data. */
+	pthread_mutex_lock(&Delta_Cache_Lock);
 
-	source = pack_start - session->response;
+	/* Another thread may have reconstructed the same layer already. */
 
-	while (chunk_size > 0) {
-		chunk_size = strtol(session->response + source, (char **)NULL, 16);
+	if (RB_FIND(Tree_Delta_Cache, &Delta_Cache, &find) != NULL) {
+		pthread_mutex_unlock(&Delta_Cache_Lock);
+		free(cache->buffer);
+		free(cache);
+		return;
+	}
 
-		if (chunk_size == 0)
-			break;
+	RB_INSERT(Tree_Delta_Cache, &Delta_Cache, cache);
+	TAILQ_INSERT_TAIL(&Delta_Cache_LRU, cache, lru);
+
+	session->delta_cache_used += buffer_size;
 
-		memmove(session->response + target,
-			session->response + source + 5,
-			(unsigned long)chunk_size - 5);
+	while ((session->delta_cache_used > session->delta_cache_limit) && ((cache = TAILQ_FIRST(&Delta_Cache_LRU)) != NULL)) {
+		TAILQ_REMOVE(&Delta_Cache_LRU, cache, lru);
+		RB_REMOVE(Tree_Delta_Cache, &Delta_Cache, cache);
 
-		target += chunk_size - 5;
-		source += chunk_size;
-		session->response_size -= 5;
+		session->delta_cache_used -= cache->buffer_size;
+
+		free(cache->buffer);
+		free(cache);
 	}
 
-	session->response_size += 5;
-	pack_size = session->response_size - 20;
+	pthread_mutex_unlock(&Delta_Cache_Lock);
+}
 
-	/* Verify the pack data checksum. */
 
-	SHA1((uint8_t *)session->response, pack_size, (uint8_t *)hash);
+/*
+ * delta_cache_free
+ *
+ * Procedure that empties the delta base cache.
+ */
 
-	if (memcmp(session->response + pack_size, hash, 20) != 0)
-		errc(EXIT_FAILURE, EAUTH,
-			"fetch_pack: pack checksum mismatch -- "
-			"expected: %s, received: %s",
-			legible_hash(session->response + pack_size),
-			legible_hash(hash));
+static void
+delta_cache_free(connector *session)
+{
+	struct cache_node *cache = NULL;
 
-	/* Process the pack data. */
+	while ((cache = TAILQ_FIRST(&Delta_Cache_LRU)) != NULL) {
+		TAILQ_REMOVE(&Delta_Cache_LRU, cache, lru);
+		RB_REMOVE(Tree_Delta_Cache, &Delta_Cache, cache);
 
-	unpack_objects(session);
+		free(cache->buffer);
+		free(cache);
+	}
 
-	free(command);
+	session->delta_cache_used = 0;
 }
 
 
 /*
- * store_object
+ * resolve_delta
  *
- * Procedure that creates a new object and stores it in the array and
- * lookup tree.
+ * Procedure that reconstructs the object a delta describes, along with its
+ * checksum.  It only reads from the object array and the lookup table, so
+ * several of them can run at once.
  */
 
 static void
-store_object(connector *session, uint8_t type, char *buffer, uint32_t buffer_size, uint32_t offset_pack, uint32_t index_delta, char *ref_delta_hash)
+resolve_delta(connector *session, delta_job *job)
 {
-	struct object_node *object = NULL, find;
-	char               *hash = NULL, *temp = NULL, parent[41];
-	bool                ok = true;
+	struct object_node *delta, *base = NULL;
+	int       x = 0, y = 0, delta_count = 0;
+	char     *start, *source = NULL, *target = NULL, *layer[2] = { NULL, NULL };
+	char     *data = NULL, *base_hash = NULL, *base_buffer = NULL, legible[41];
+	uint8_t   length_bits = 0, offset_bits = 0, type = 0;
+	uint32_t  deltas[BUFFER_UNIT_SMALL], instruction = 0;
+	uint32_t  offset = 0, position = 0, length = 0, layer_size = 0;
+	uint32_t  new_file_size = 0, new_position = 0, source_size = 0;
+	bool      cached = false;
 
-	parent[40] = '\0';
+	delta = job->delta;
 
-	hash = calculate_object_hash(buffer, buffer_size, type);
+	/*
+	 * Follow the chain of ofs-deltas down to the base object, stopping
+	 * early at a layer that is still in the cache.
+	 */
 
-	/* Check to make sure the object doesn't already exist. */
+	while ((delta->type == 6) && (!(cached = delta_cache_copy(delta->index, &type, &layer[0], &source_size)))) {
+		if (delta_count == BUFFER_UNIT_SMALL)
+			errc(EXIT_FAILURE, E2BIG,
+				"apply_deltas: delta chain of %05d is too long",
+				job->delta->index);
+
+		deltas[delta_count++] = delta->index;
+		delta = session->object[delta->index_delta];
+	}
+
+	/* The ref-delta base objects were loaded before the workers started. */
+
+	if ((delta->type == 7) && (!(cached = delta_cache_copy(delta->index, &type, &layer[0], &source_size)))) {
+		if (delta_count == BUFFER_UNIT_SMALL)
+			errc(EXIT_FAILURE, E2BIG,
+				"apply_deltas: delta chain of %05d is too long",
+				job->delta->index);
+
+		deltas[delta_count++] = delta->index;
+	}
 
-	find.hash = hash;
-	object    = RB_FIND(Tree_Objects, &Objects, &find);
+	/*
+	 * Lookup the base object.  The first layer is built straight from its
+	 * buffer, so the base is never copied.
+	 */
 
-	if ((object != NULL) && (session->repair == false)) {
-		free(hash);
+	if (cached) {
+		source = layer[0];
 	} else {
-		/* Extend the array if needed, create a new node and add it. */
+		base_hash = (delta->type == 7 ? delta->ref_delta_hash : delta->hash);
 
-		if (session->objects % BUFFER_UNIT_SMALL == 0)
-			if ((session->object = (struct object_node **)realloc(session->object, (session->objects + BUFFER_UNIT_SMALL) * sizeof(struct object_node *))) == NULL)
-				err(EXIT_FAILURE, "store_object: realloc");
+		if ((base = find_object(base_hash)) == NULL)
+			errc(EXIT_FAILURE, ENOENT,
+				"apply_deltas: cannot find %05d -> %d/%s",
+				delta->index,
+				delta->index_delta,
+				legible_hash(base_hash, legible));
+
+		type        = base->type;
+		base_buffer = object_buffer(session, base);
+		source      = base_buffer;
+		source_size = base->buffer_size;
+	}
 
-		object = (struct object_node *)malloc(sizeof(struct object_node));
+	/*
+	 * Size the layer buffers for the largest object in the chain, read
+	 * from the delta headers, so they never need to grow.
+	 */
 
-		if (object == NULL)
-			err(EXIT_FAILURE, "store_object: malloc");
+	layer_size = 0;
 
-		object->index          = session->objects;
-		object->type           = type;
-		object->hash           = hash;
-		object->offset_pack    = offset_pack;
-		object->index_delta    = index_delta;
-		object->ref_delta_hash = (ref_delta_hash ? legible_hash(ref_delta_hash) : NULL);
-		object->parent         = NULL;
-		object->parents        = 0;
-		object->buffer         = buffer;
-		object->buffer_size    = buffer_size;
-		object->offset_cache   = -1;
+	for (x = 0; x < delta_count; x++) {
+		position = 0;
 
-		if (session->verbosity > 2)
-			fprintf(stdout,
-				"###### %05d-%d\t%d\t%u\t%s\t%d\t%s\n",
-				object->index,
-				object->type,
-				object->offset_pack,
-				object->buffer_size,
-				object->hash,
-				object->index_delta,
-				object->ref_delta_hash);
+		unpack_integer(session->object[deltas[x]]->buffer, &position);
+		new_file_size = unpack_integer(session->object[deltas[x]]->buffer, &position);
 
-		/* Find the parent commits for commit objects. */
+		if (new_file_size > layer_size)
+			layer_size = new_file_size;
+	}
 
-		if (type == 1) {
-			temp = buffer;
+	if ((cached) && (layer_size > source_size)) {
+		if ((layer[0] = (char *)realloc(layer[0], layer_size + 1)) == NULL)
+			err(EXIT_FAILURE, "apply_deltas: realloc");
 
-			while ((temp + 47 - buffer < (long)buffer_size) && ((temp = strstr(temp, "parent ")) != NULL)) {
-				ok    = true;
-				temp += 47;
+		source = layer[0];
+	}
 
-				/* Make sure the commit is valid. */
+	new_file_size = source_size;
 
-				if (*temp != '\n')
-					continue;
+	/*
+	 * Loop though the deltas to be applied, building each layer from the
+	 * previous one and swapping the roles of the two layer buffers.
+	 */
 
-				memcpy(parent, temp - 40, 40);
+	for (x = delta_count - 1; x >= 0; x--) {
+		delta  = session->object[deltas[x]];
+		data   = delta->buffer;
+		y      = (source == layer[0] ? 1 : 0);
 
-				for (int x = 0; x < 40; x++)
-					if (!isxdigit((uint8_t)parent[x]))
-						ok = false;
+		if (layer[y] == NULL)
+			if ((layer[y] = (char *)malloc(layer_size + 1)) == NULL)
+				err(EXIT_FAILURE, "apply_deltas: malloc");
 
-				if (!ok)
-					continue;
+		target = layer[y];
 
-				/* Store the parent commit. */
+		position      = 0;
+		new_position  = 0;
 
-				object->parent = (char **)realloc(object->parent, (object->parents + 1) * sizeof(char *));
+		/*
+		 * The first unpack_integer is for the unused old file
+		 * size.
+		 */
 
-				if (object->parent == NULL)
-					err(EXIT_FAILURE, "store_object: realloc");
+		unpack_integer(data, &position);
+		new_file_size = unpack_integer(data, &position);
 
-				object->parent[object->parents++] = strdup(parent);
-			}
-		}
-/*
-			char path[1024];
-			int fd;
+		/*
+		 * Loop through the copy/insert instructions and build
+		 * up the layer buffer.
+		 */
 
-			snprintf(path, sizeof(path), "./temp/b%04d-%d-%s.out", object->index, object->type, object->hash);
+		while (position < delta->buffer_size) {
+			instruction = (uint8_t)data[position++];
 
-			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
-			chmod(path, 0644);
-			write(fd, object->buffer, object->buffer_size);
-			close(fd);
-*/
-		if (type < 6)
-			RB_INSERT(Tree_Objects, &Objects, object);
+			if (instruction & 0x80) {
+				length_bits = (instruction & 0x70) >> 4;
+				offset_bits = (instruction & 0x0F);
 
-		if (session->low_memory) {
-			lseek(session->cache, session->cache_length, SEEK_SET);
-			write(session->cache, buffer, (size_t)buffer_size);
+				offset = unpack_delta_integer(
+					data,
+					&position,
+					offset_bits);
 
-			object->buffer         = NULL;
-			object->offset_cache   = session->cache_length;
-			session->cache_length += (off_t)buffer_size;
+				start = source + offset;
 
-			free(buffer);
+				length = unpack_delta_integer(
+					data,
+					&position,
+					length_bits);
+
+				if (length == 0)
+					length = 65536;
+
+				if ((uint64_t)offset + length > source_size)
+					errc(EXIT_FAILURE, ERANGE,
+						"apply_deltas: copy"
+						" overflow -- %u + %u > %u",
+						offset,
+						length,
+						source_size);
+			} else {
+				offset    = position;
+				start     = data + offset;
+				length    = instruction;
+				position += length;
+			}
+
+			if (new_position + length > new_file_size)
+				errc(EXIT_FAILURE, ERANGE,
+					"apply_deltas: position"
+					" overflow -- %u + %u > %u",
+					new_position,
+					length,
+					new_file_size);
+
+			memcpy(target + new_position,
+				start,
+				length);
+
+			new_position += length;
 		}
 
-		session->object[session->objects++] = object;
+		/*
+		 * Keep the intermediate layers for the other chains.  The
+		 * final layer is left out: apply_deltas works back from the
+		 * end of the pack and an ofs-delta's base always comes before
+		 * it, so no chain resolved later can pass through this object,
+		 * and ref-deltas find it in the object table once it is
+		 * stored.  Caching it would only push out layers that are
+		 * still needed.
+		 */
+
+		if (x > 0)
+			delta_cache_add(session,
+				delta->index,
+				type,
+				target,
+				new_file_size);
+
+		source      = target;
+		source_size = new_file_size;
 	}
+
+	/* Hand the final layer over and release the other one. */
+
+	free(source == layer[0] ? layer[1] : layer[0]);
+
+	if (base)
+		release_object_buffer(base, base_buffer);
+
+	job->type        = type;
+	job->buffer      = source;
+	job->buffer_size = new_file_size;
+
+	calculate_object_hash(source, new_file_size, type, job->hash);
 }
 
 
 /*
- * unpack_objects
+ * delta_worker
  *
- * Procedure that extracts all of the objects from the pack data.
+ * Function that resolves queued deltas until the queue is finished, reporting
+ * each one so apply_deltas knows when a batch is complete.
  */
 
-static void
-unpack_objects(connector *session)
+static void *
+delta_worker(void *argument)
 {
-	unsigned long  stream_bytes = 0, x = 0;
-	uint32_t       buffer_size = 0, size = 0, offset_pack = 0;
-	uint32_t       index_delta = 0, lookup_offset = 0;
-	uint32_t       position = 4, total_objects = 0;
-	uint8_t        object_type = 0, bits = 0, mask = 0, zlib_out[16384];
-	int            stream_code = 0, version = 0;
-	char          *buffer = NULL, *ref_delta_hash = NULL;
+	connector *session = (connector *)argument;
+	delta_job *job = NULL;
 
-	/* Check the pack version number. */
+	while ((job = (delta_job *)work_queue_next(session->delta_queue)) != NULL) {
+		resolve_delta(session, job);
+		work_queue_complete(session->delta_queue);
+	}
 
-	version   = (uint8_t)session->response[position + 3];
-	position += 4;
+	return (NULL);
+}
 
-	if (version != 2)
-		errc(EXIT_FAILURE, EFTYPE,
-			"unpack_objects: pack version %d not supported",
-			version);
 
-	/* Determine the number of objects in the pack data. */
+/*
+ * apply_deltas
+ *
+ * Procedure that applies the changes in all of the delta objects to their
+ * base objects.  The deltas are resolved in batches, in parallel when more
+ * than one job is configured, and the results are stored in pack order.  The
+ * worker threads are started once and wait on the queue between batches.
+ */
 
-	for (x = 0; x < 4; x++, position++)
-		total_objects = (total_objects << 8)
-			+ (uint8_t)session->response[position];
+static void
+apply_deltas(connector *session)
+{
+	struct object_node *delta = NULL, *object = NULL;
+	pthread_t          *thread = NULL;
+	delta_job          *job = NULL;
+	uint32_t            batch = 0, jobs = 0, x = 0;
+	int                 o = 0;
 
-	if (session->verbosity > 2)
-		fprintf(stderr,
-			"\nversion: %d, total_objects: %d, pack_size: %d\n\n",
-			version,
-			total_objects,
-			session->response_size);
+	/* Keep fewer reconstructed objects in memory in low memory mode. */
 
-	/* Unpack the objects. */
+	batch = (session->low_memory ? 4 * (uint32_t)session->jobs : BUFFER_UNIT_SMALL);
 
-	while ((position < session->response_size) && (total_objects-- > 0)) {
-		object_type    = (uint8_t)session->response[position] >> 4 & 0x07;
-		offset_pack    = position;
-		index_delta    = 0;
-		size           = 0;
-		stream_bytes   = 0;
-		ref_delta_hash = NULL;
+	if ((job = (delta_job *)malloc(batch * sizeof(delta_job))) == NULL)
+		err(EXIT_FAILURE, "apply_deltas: malloc");
 
-		/* Extract the file size. */
+	if (session->jobs > 1) {
+		session->delta_queue = work_queue_new();
+		thread = start_workers(session, delta_worker, session);
+	}
 
-		do {
-			mask = (stream_bytes == 0 ? 0x0F : 0x7F);
-			bits = (uint8_t)(session->response[position] & mask);
-			size = (size << 7) + bits;
-			stream_bytes++;
-		}
-		while (session->response[position++] & 0x80);
+	o = (int)session->objects - 1;
 
-		/* Find the object->index referred to by the ofs-delta. */
+	while (o >= 0) {
+		/*
+		 * Gather the next batch of deltas, loading any ref-delta
+		 * base objects from the local tree beforehand.
+		 */
 
-		if (object_type == 6) {
-			lookup_offset = 0;
-			index_delta   = session->objects;
+		for (jobs = 0; (o >= 0) && (jobs < batch); o--) {
+			if (session->object[o]->type < 6)
+				continue;
 
-			do lookup_offset = (lookup_offset << 7) + (session->response[position] & 0x7F) + 1;
-			while (session->response[position++] & 0x80);
+			delta = session->object[o];
 
-			while (--index_delta > 0)
-				if (offset_pack - lookup_offset + 1 == session->object[index_delta]->offset_pack)
-					break;
+			while (delta->type == 6)
+				delta = session->object[delta->index_delta];
 
-			if (index_delta == 0)
-				errc(EXIT_FAILURE, EINVAL,
-					"unpack_objects: cannot find ofs-delta "
-					"base object");
-		}
+			/*
+			 * A ref-delta base may be one of the objects still being
+			 * resolved, so store the pending results first.
+			 */
 
-		/* Extract the ref-delta checksum. */
+			if (delta->type == 7) {
+				if ((jobs > 0) && (find_object(delta->ref_delta_hash) == NULL))
+					break;
 
-		if (object_type == 7) {
-			if ((ref_delta_hash = (char *)malloc(20)) == NULL)
-				err(EXIT_FAILURE, "unpack_objects: malloc");
+				load_object(session, delta->ref_delta_hash, NULL);
+			}
 
-			memcpy(ref_delta_hash, session->response + position, 20);
-			position += 20;
+			job[jobs++].delta = session->object[o];
 		}
 
-		/* Inflate and store the object. */
-
-		buffer      = NULL;
-		buffer_size = 0;
-
-		z_stream stream = {
-			.zalloc   = Z_NULL,
-			.zfree    = Z_NULL,
-			.opaque   = Z_NULL,
-			.avail_in = (uint32_t)session->response_size - position,
-			.next_in  = (uint8_t *)(session->response + position),
-			};
-
-		stream_code = inflateInit(&stream);
-
-		if (stream_code == Z_DATA_ERROR)
-			errc(EXIT_FAILURE, EILSEQ,
-				"unpack_objects: zlib data stream failure");
+		if ((session->jobs < 2) || (jobs < 2)) {
+			for (x = 0; x < jobs; x++)
+				resolve_delta(session, &job[x]);
+		} else {
+			for (x = 0; x < jobs; x++)
+				work_queue_add(session->delta_queue, &job[x]);
 
-		do {
-			stream.avail_out = 16384,
-			stream.next_out  = zlib_out;
-			stream_code      = inflate(&stream, Z_NO_FLUSH);
-			stream_bytes     = 16384 - stream.avail_out;
+			work_queue_wait(session->delta_queue);
+		}
 
-			if (stream_code == Z_DATA_ERROR)
-				errc(EXIT_FAILURE, EILSEQ,
-					"unpack_objects: zlib data stream failure");
+		/*
+		 * Store the completed objects.  Lazy blobs only keep the
+		 * delta they came from and are rebuilt when they are needed.
+		 */
 
-			buffer = (char *)realloc(
-				buffer,
-				buffer_size + stream_bytes);
+		for (x = 0; x < jobs; x++) {
+			object = store_object(session,
+				job[x].type,
+				job[x].buffer,
+				job[x].buffer_size,
+				0,
+				0,
+				NULL,
+				job[x].hash);
 
-			if (buffer == NULL)
-				err(EXIT_FAILURE, "unpack_objects: realloc");
+			if ((session->lazy_blobs) && (job[x].type == 3) && (object->buffer == job[x].buffer)) {
+				object->lazy        = true;
+				object->index_delta = job[x].delta->index;
+				object->buffer      = NULL;
 
-			memcpy(buffer + buffer_size, zlib_out, stream_bytes);
-			buffer_size += stream_bytes;
+				free(job[x].buffer);
+			}
 		}
-		while (stream.avail_out == 0);
-
-		inflateEnd(&stream);
-		position += (uint32_t)stream.total_in;
+	}
 
-		store_object(session,
-			object_type,
-			buffer,
-			buffer_size,
-			offset_pack,
-			index_delta,
-			ref_delta_hash);
+	if (session->delta_queue != NULL) {
+		work_queue_finish(session->delta_queue);
+		join_workers(session, thread);
+		work_queue_free(session->delta_queue);
 
-		free(ref_delta_hash);
+		session->delta_queue = NULL;
 	}
+
+	free(job);
+	delta_cache_free(session);
 }
 
 
 /*
- * unpack_delta_integer
+ * extract_tree_item
  *
- * Function that reconstructs a 32 bit integer from the data stream.
+ * Procedure that extracts mode/path/hash items in a tree and returns them in
+ * a new file_node.
  */
 
-static uint32_t
-unpack_delta_integer(char *data, uint32_t *position, uint8_t bits)
+static void
+extract_tree_item(struct file_node *file, char **position)
 {
-	uint32_t result = 0, read_bytes = 0, temp = 0, mask = 8;
-
-	/* Determine how many bytes in the stream are needed. */
+	size_t path_size = 0;
 
-	do if (bits & mask) read_bytes++;
-	while (mask >>= 1);
+	/* Extract the file mode. */
 
-	/*
-	 * Put the bytes in their proper position based on the bit field
-	 * passed in.
-	 */
+	file->mode = (mode_t)strtol(*position, (char **)NULL, 8);
+	*position  = strchr(*position, ' ') + 1;
 
-	if (read_bytes > 0) {
-		temp = read_bytes;
-		mask = 3;
+	/* Extract the file path. */
 
-		do {
-			if (bits & (1 << mask))
-				result += (uint32_t)((uint8_t)data[*position + --temp] << (mask * 8));
-		}
-		while (mask-- > 0);
+	path_size = strlen(*position) + 1;
+	snprintf(file->path, path_size, "%s", *position);
+	*position += path_size;
 
-		*position += read_bytes;
-	}
+	/* Extract the file SHA checksum. */
 
-	return (result);
+	memcpy(file->hash, *position, 20);
+	*position += 20;
 }
 
 
 /*
- * unpack_integer
+ * retain_remote_tree
  *
- * Function that reconstructs a variable length integer from the data stream.
+ * Procedure that adds a tree to the list saved in the remote data file.
  */
 
-static uint32_t
-unpack_integer(char *data, uint32_t *position)
+static void
+retain_remote_tree(connector *session, char *path, char *hash)
 {
-	uint32_t result = 0, count = 0;
+	if (session->remote_trees % BUFFER_UNIT_SMALL == 0)
+		if ((session->remote_tree = (struct file_node **)realloc(session->remote_tree, (session->remote_trees + BUFFER_UNIT_SMALL) * sizeof(struct file_node *))) == NULL)
+			err(EXIT_FAILURE, "retain_remote_tree: realloc");
 
-	do result += (uint32_t)((data[*position] & 0x7F) << (7 * count++));
-	while (data[(*position)++] & 0x80);
+	session->remote_tree[session->remote_trees++] = new_file_node(arena_strdup(path), 040000, hash, true, false);
+}
 
-	return (result);
+
+/*
+ * remote_tree_compare
+ *
+ * Function that sorts the trees saved in the remote data file by path.
+ */
+
+static int
+remote_tree_compare(const void *a, const void *b)
+{
+	return (strcmp((*(struct file_node * const *)a)->path, (*(struct file_node * const *)b)->path));
 }
 
 
 /*
- * apply_deltas
+ * save_remote_data
  *
- * Procedure that applies the changes in all of the delta objects to their
- * base objects.
+ * Procedure that saves the "want" and the trees collected by process_tree in
+ * the binary format read by load_remote_binary.
  */
 
 static void
-apply_deltas(connector *session)
+save_remote_data(connector *session)
 {
-	struct object_node *delta, *base, lookup;
-	int       x = 0, o = 0, delta_count = -1;
-	char     *start, *merge_buffer = NULL, *layer_buffer = NULL;
-	uint8_t   length_bits = 0, offset_bits = 0;
-	uint32_t  deltas[BUFFER_UNIT_SMALL], instruction = 0;
-	uint32_t  offset = 0, position = 0, length = 0, layer_buffer_size = 0;
-	uint32_t  new_file_size = 0, new_position = 0;
-	uint64_t  merge_buffer_size = 0;
+	struct object_node *tree = NULL;
+	char                path[BUFFER_UNIT_SMALL], *table = NULL, *entry = NULL;
+	char               *paths = NULL;
+	uint32_t            version = 1, path_offset = 0, tree_offset = 0;
+	uint32_t            paths_size = 0, x = 0;
+	size_t              table_size = 0, length = 0;
+	int                 fd = -1;
 
-	for (o = (int)session->objects - 1; o >= 0; o--) {
-		merge_buffer = NULL;
-		delta        = session->object[o];
-		delta_count  = 0;
+	qsort(session->remote_tree, session->remote_trees, sizeof(struct file_node *), remote_tree_compare);
 
-		if (delta->type < 6)
-			continue;
+	for (x = 0; x < session->remote_trees; x++)
+		paths_size += (uint32_t)strlen(session->remote_tree[x]->path) + 1;
 
-		/* Follow the chain of ofs-deltas down to the base object. */
+	/* Build the header and the entry table. */
 
-		while (delta->type == 6) {
-			deltas[delta_count++] = delta->index;
-			delta = session->object[delta->index_delta];
-			lookup.hash = delta->hash;
-		}
+	table_size = REMOTE_HEADER_SIZE + (size_t)session->remote_trees * REMOTE_ENTRY_SIZE;
 
-		/* Find the ref-delta base object. */
+	if ((table = (char *)malloc(table_size)) == NULL)
+		err(EXIT_FAILURE, "save_remote_data: malloc");
 
-		if (delta->type == 7) {
-			deltas[delta_count++] = delta->index;
-			lookup.hash = delta->ref_delta_hash;
-			load_object(session, lookup.hash, NULL);
-		}
+	if ((paths = (char *)malloc((size_t)paths_size + 1)) == NULL)
+		err(EXIT_FAILURE, "save_remote_data: malloc");
 
-		/* Lookup the base object and setup the merge buffer. */
+	memcpy(table, "GURD", 4);
+	memcpy(table + 4, &version, 4);
+	memcpy(table + 8, &session->remote_trees, 4);
+	illegible_hash(session->want, table + 12);
 
-		if ((base = RB_FIND(Tree_Objects, &Objects, &lookup)) == NULL)
-			errc(EXIT_FAILURE, ENOENT,
-				"apply_deltas: cannot find %05d -> %d/%s",
-				delta->index,
-				delta->index_delta,
-				delta->ref_delta_hash);
+	path_offset = (uint32_t)table_size;
+	tree_offset = path_offset + paths_size;
 
-		if ((merge_buffer = (char *)malloc(base->buffer_size)) == NULL)
-			err(EXIT_FAILURE,
-				"apply_deltas: malloc");
+	for (x = 0; x < session->remote_trees; x++) {
+		entry  = table + REMOTE_HEADER_SIZE + (size_t)x * REMOTE_ENTRY_SIZE;
+		tree   = find_object(session->remote_tree[x]->hash);
+		length = strlen(session->remote_tree[x]->path) + 1;
 
-		load_buffer(session, base);
+		memcpy(paths + path_offset - table_size, session->remote_tree[x]->path, length);
 
-		memcpy(merge_buffer, base->buffer, base->buffer_size);
-		merge_buffer_size = base->buffer_size;
+		memcpy(entry, tree->hash, 20);
+		memcpy(entry + 20, &path_offset, 4);
+		memcpy(entry + 24, &tree_offset, 4);
+		memcpy(entry + 28, &tree->buffer_size, 4);
 
-		/* Loop though the deltas to be applied. */
+		path_offset += (uint32_t)length;
+		tree_offset += tree->buffer_size;
+	}
 
-		for (x = delta_count - 1; x >= 0; x--) {
-			delta = session->object[deltas[x]];
-			load_buffer(session, delta);
+	/* Write the file and swap it in. */
 
-			position      = 0;
-			new_position  = 0;
+	snprintf(path, sizeof(path), "%s.new", session->remote_data_file);
 
-			/*
-			 * The first unpack_integer is for the unused old file
-			 * size.
-			 */
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(EXIT_FAILURE, "save_remote_data: cannot create %s", path);
 
-			unpack_integer(delta->buffer, &position);
-			new_file_size = unpack_integer(delta->buffer, &position);
+	if ((write(fd, table, table_size) != (ssize_t)table_size)
+		|| (write(fd, paths, paths_size) != (ssize_t)paths_size))
+		err(EXIT_FAILURE, "save_remote_data: write");
 
-			/* Make sure the layer buffer is large enough. */
+	for (x = 0; x < session->remote_trees; x++) {
+		tree = find_object(session->remote_tree[x]->hash);
 
-			if (new_file_size > layer_buffer_size || layer_buffer_size == 0) {
-				layer_buffer_size = new_file_size;
+		if (write(fd, tree->buffer, tree->buffer_size) != (ssize_t)tree->buffer_size)
+			err(EXIT_FAILURE, "save_remote_data: write");
+	}
 
-				layer_buffer = (char *)realloc(
-					layer_buffer,
-					layer_buffer_size);
+	close(fd);
+	free(paths);
+	free(table);
 
-				if (layer_buffer == NULL)
-					err(EXIT_FAILURE,
-						"apply_deltas: realloc");
-			}
+	if (((remove(session->remote_data_file)) != 0) && (errno != ENOENT))
+		err(EXIT_FAILURE,
+			"save_remote_data: cannot remove %s",
+			session->remote_data_file);
 
-			/*
-			 * Loop through the copy/insert instructions and build
-			 * up the layer buffer.
-			 */
+	if ((rename(path, session->remote_data_file)) != 0)
+		err(EXIT_FAILURE,
+			"save_remote_data: cannot rename %s",
+			session->remote_data_file);
+}
 
-			while (position < delta->buffer_size) {
-				instruction = (uint8_t)delta->buffer[position++];
 
-				if (instruction & 0x80) {
-					length_bits = (instruction & 0x70) >> 4;
-					offset_bits = (instruction & 0x0F);
+/*
+ * find_sparse_objects
+ *
+ * Procedure that walks the parts of a tree inside the sparse paths and adds a
+ * "want" line for each object that is neither in the pack data nor available
+ * locally.  Missing trees are fetched whole, along with the files in them.
+ */
 
-					offset = unpack_delta_integer(
-						delta->buffer,
-						&position,
-						offset_bits);
+static void
+find_sparse_objects(connector *session, char *hash, char *base_path, char **want, uint32_t *want_size)
+{
+	struct object_node *tree = NULL;
+	struct file_node    file, *found_file = NULL;
+	char                full_path[BUFFER_UNIT_SMALL], line[BUFFER_UNIT_SMALL];
+	char               *position = NULL, legible[41];
 
-					start = merge_buffer + offset;
+	if ((tree = find_object(hash)) == NULL)
+		errc(EXIT_FAILURE, ENOENT,
+			"find_sparse_objects: tree %s -- %s cannot be found",
+			base_path,
+			legible_hash(hash, legible));
 
-					length = unpack_delta_integer(
-						delta->buffer,
-						&position,
-						length_bits);
+	if ((file.path = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
+		err(EXIT_FAILURE, "find_sparse_objects: malloc");
 
-					if (length == 0)
-						length = 65536;
-				} else {
-					offset    = position;
-					start     = delta->buffer + offset;
-					length    = instruction;
-					position += length;
-				}
+	position = tree->buffer;
 
-				if (new_position + length > new_file_size)
-					errc(EXIT_FAILURE, ERANGE,
-						"apply_deltas: position"
-						" overflow -- %u + %u > %u",
-						new_position,
-						length,
-						new_file_size);
+	while ((uint32_t)(position - tree->buffer) < tree->buffer_size) {
+		extract_tree_item(&file, &position);
 
-				memcpy(layer_buffer + new_position,
-					start,
-					length);
+		snprintf(full_path, sizeof(full_path),
+			"%s/%s",
+			base_path,
+			file.path);
 
-				new_position += length;
-			}
+		if ((S_ISWHT(file.mode)) || (sparse_excluded(session, full_path)))
+			continue;
 
-			/* Make sure the merge buffer is large enough. */
+		if (find_object(file.hash) != NULL) {
+			if (S_ISDIR(file.mode))
+				find_sparse_objects(session, file.hash, full_path, want, want_size);
 
-			if (new_file_size > merge_buffer_size) {
-				merge_buffer_size = new_file_size;
+			continue;
+		}
 
-				merge_buffer = (char *)realloc(
-					merge_buffer,
-					merge_buffer_size);
+		/* Unchanged files and copies of them don't need to be fetched. */
 
-				if (merge_buffer == NULL)
-					err(EXIT_FAILURE,
-						"apply_deltas: realloc");
-			}
+		if (!S_ISDIR(file.mode)) {
+			found_file = find_file_path(&Local_Path_Table, full_path);
 
-			/*
-			 * Store the layer buffer in the merge buffer for the
-			 * next loop iteration.
-			 */
+			if ((found_file != NULL) && (memcmp(found_file->hash, file.hash, 20) == 0))
+				continue;
 
-			memcpy(merge_buffer, layer_buffer, new_file_size);
-			release_buffer(session, delta);
+			if ((find_file_hash(file.hash) != NULL) || (load_stored_object(session, file.hash)))
+				continue;
 		}
 
-		/* Store the completed object. */
-
-		release_buffer(session, base);
+		snprintf(line, sizeof(line),
+			"0032want %s\n",
+			legible_hash(file.hash, legible));
 
-		store_object(session,
-			base->type,
-			merge_buffer,
-			new_file_size,
-			0,
-			0,
-			NULL);
+		append(want, want_size, line, strlen(line));
 	}
+
+	free(file.path);
 }
 
 
 /*
- * extract_tree_item
+ * fetch_sparse_objects
  *
- * Procedure that extracts mode/path/hash items in a tree and returns them in
- * a new file_node.
+ * Procedure that fetches the objects inside the sparse paths that the pack
+ * data left out, which are all of the files when the server filtered out the
+ * blobs.  Large requests are split into batches the size of the biggest
+ * repair.
  */
 
 static void
-extract_tree_item(struct file_node *file, char **position)
+fetch_sparse_objects(connector *session)
 {
-	int x = 0;
-	size_t path_size = 0;
+	struct object_node *commit = NULL;
+	char               *want = NULL, hash[20], tree[20];
+	uint32_t            want_size = 0, offset = 0, batch = 0;
 
-	/* Extract the file mode. */
+	if ((commit = find_object(illegible_hash(session->want, hash))) == NULL)
+		errc(EXIT_FAILURE, EINVAL,
+			"fetch_sparse_objects: cannot find %s",
+			session->want);
 
-	file->mode = (mode_t)strtol(*position, (char **)NULL, 8);
-	*position  = strchr(*position, ' ') + 1;
+	if (memcmp(commit->buffer, "tree ", 5) != 0)
+		errc(EXIT_FAILURE, EINVAL,
+			"fetch_sparse_objects: first object is not a commit");
 
-	/* Extract the file path. */
+	illegible_hash(commit->buffer + 5, tree);
 
-	path_size = strlen(*position) + 1;
-	snprintf(file->path, path_size, "%s", *position);
-	*position += path_size;
+	find_sparse_objects(session, tree, session->path_target, &want, &want_size);
 
-	/* Extract the file SHA checksum. */
+	if (want_size == 0)
+		return;
 
-	for (x = 0; x < 20; x++)
-		snprintf(&file->hash[x * 2], 3,
-			"%02x",
-			(uint8_t)*(*position)++);
+	if (session->verbosity)
+		fprintf(stderr, "# Fetching %u sparse objects\n", want_size / 50);
 
-	file->hash[40] = '\0';
+	for (offset = 0; offset < want_size; offset += batch) {
+		batch = MIN(want_size - offset, 65536 * 50);
+		fetch_pack(session, build_fetch_command(want + offset, batch), NULL);
+	}
+
+	free(want);
+	report_phase(session, "fetch sparse objects");
+
+	apply_deltas(session);
+	report_phase(session, "apply sparse deltas");
 }
 
 
@@ -2646,53 +6253,38 @@ extract_tree_item(struct file_node *file, char **position)
  */
 
 static void
-process_tree(connector *session, int remote_descriptor, char *hash, char *base_path)
+process_tree(connector *session, char *hash, char *base_path)
 {
-	struct object_node  object, *found_object = NULL, *tree = NULL;
+	struct object_node *found_object = NULL, *tree = NULL;
 	struct file_node    file, *found_file = NULL;
 	struct file_node   *new_node = NULL, *remote_file = NULL;
 	struct stat         check;
-	char                full_path[BUFFER_UNIT_SMALL], *buffer = NULL;
-	char                line[BUFFER_UNIT_SMALL], *position = NULL;
-	uint32_t            buffer_size = 0;
+	char                full_path[BUFFER_UNIT_SMALL], *position = NULL;
+	char                legible[41];
 	uint32_t            new_is_dir, old_is_dir, new_is_link, old_is_link;
 	mode_t              temp_mode;
 
-	object.hash = hash;
-
-	if ((tree = RB_FIND(Tree_Objects, &Objects, &object)) == NULL)
+	if ((tree = find_object(hash)) == NULL)
 		errc(EXIT_FAILURE, ENOENT,
 			"process_tree: tree %s -- %s cannot be found",
 			base_path,
-			object.hash);
+			legible_hash(hash, legible));
 
 	/* Remove the base path from the list of upcoming deletions. */
 
-	load_buffer(session, tree);
-
-	file.path  = base_path;
-	found_file = RB_FIND(Tree_Local_Path, &Local_Path, &file);
+	found_file = find_file_path(&Local_Path_Table, base_path);
 
 	if (found_file != NULL) {
 		found_file->keep = true;
 		found_file->save = false;
 	}
 
-	/* Add the base path to the output. */
+	/* Add the tree to the remote data list. */
 
 	if ((file.path = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
 		err(EXIT_FAILURE, "process_tree: malloc");
 
-	if ((file.hash = (char *)malloc(41)) == NULL)
-		err(EXIT_FAILURE, "process_tree: malloc");
-
-	snprintf(line, sizeof(line),
-		"%o\t%s\t%s/\n",
-		040000,
-		hash,
-		base_path);
-
-	append(&buffer, &buffer_size, line, strlen(line));
+	retain_remote_tree(session, base_path, hash);
 
 	/* Process the tree items. */
 
@@ -2706,21 +6298,15 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 			base_path,
 			file.path);
 
-		snprintf(line, sizeof(line),
-			"%o\t%s\t%s\n",
-			file.mode,
-			file.hash,
-			file.path);
+		/* Paths outside of a sparse checkout are left alone. */
 
-		append(&buffer, &buffer_size, line, strlen(line));
+		if (sparse_excluded(session, full_path))
+			continue;
 
 		/* Recursively walk the trees and process the files/links. */
 
 		if (S_ISDIR(file.mode)) {
-			process_tree(session,
-				remote_descriptor,
-				file.hash,
-				full_path);
+			process_tree(session, file.hash, full_path);
 
 			continue;
 		}
@@ -2730,11 +6316,8 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 		 * the file.
 		 */
 
-		memcpy(object.hash, file.hash, 41);
-		memcpy(file.path, full_path, strlen(full_path) + 1);
-
-		found_object = RB_FIND(Tree_Objects, &Objects, &object);
-		found_file   = RB_FIND(Tree_Local_Path, &Local_Path, &file);
+		found_object = find_object(file.hash);
+		found_file   = find_file_path(&Local_Path_Table, full_path);
 
 		/* If the local file hasn't changed, skip it. */
 
@@ -2742,8 +6325,10 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 			found_file->keep = true;
 			found_file->save = false;
 
-			if (strncmp(file.hash, found_file->hash, 40) == 0)
+			if (memcmp(file.hash, found_file->hash, 20) == 0) {
+				retain_stored_file(session, found_file);
 				continue;
+			}
 		}
 
 		/* Create the submodule directory. */
@@ -2752,13 +6337,14 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 			make_path(full_path, 0755);
 
 			new_node = new_file_node(
-				strdup(full_path),
+				arena_strdup(full_path),
 				file.mode,
-				strdup(file.hash),
+				file.hash,
 				true,
 				false);
 
 			RB_INSERT(Tree_Remote_Path, &Remote_Path, new_node);
+			insert_file_path(&Remote_Path_Table, new_node);
 
 			continue;
 		}
@@ -2770,7 +6356,7 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 
 		if (found_object == NULL) {
 			load_object(session, file.hash, full_path);
-			found_object = RB_FIND(Tree_Objects, &Objects, &object);
+			found_object = find_object(file.hash);
 		}
 
 		/* If the object is still missing, exit. */
@@ -2779,28 +6365,29 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 			errc(EXIT_FAILURE, ENOENT,
 				"process_tree: file %s -- %s cannot be found",
 				full_path,
-				file.hash);
+				legible_hash(file.hash, legible));
 
 		/* Otherwise retain it. */
 
-		remote_file = RB_FIND(Tree_Remote_Path, &Remote_Path, &file);
+		remote_file = find_file_path(&Remote_Path_Table, full_path);
 
 		if (remote_file == NULL) {
 			new_node = new_file_node(
-				strdup(full_path),
+				arena_strdup(full_path),
 				file.mode,
-				strdup(found_object->hash),
+				found_object->hash,
 				true,
 				true);
 
 			RB_INSERT(Tree_Remote_Path, &Remote_Path, new_node);
+			insert_file_path(&Remote_Path_Table, new_node);
+			retain_stored_file(session, new_node);
 		} else {
-			free(remote_file->hash);
-
 			remote_file->mode = file.mode;
-			remote_file->hash = strdup(found_object->hash);
+			memcpy(remote_file->hash, found_object->hash, 20);
 			remote_file->keep = true;
 			remote_file->save = true;
+			retain_stored_file(session, remote_file);
 		}
 
 		/* Check for permission and file type changes. */
@@ -2848,14 +6435,6 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 		}
 	}
 
-	/* Add the tree data to the remote data list. */
-
-	release_buffer(session, tree);
-	write(remote_descriptor, buffer, buffer_size);
-	write(remote_descriptor, "\n", 1);
-
-	free(buffer);
-	free(file.hash);
 	free(file.path);
 }
 
@@ -2869,10 +6448,10 @@ process_tree(connector *session, int remote_descriptor, char *hash, char *base_p
 static void
 save_repairs(connector *session)
 {
-	struct object_node  find_object, *found_object;
+	struct object_node *found_object;
 	struct file_node   *local_file, *remote_file, *found_file;
 	struct stat         st;
-	char               *check_hash = NULL, *buffer_hash = NULL;
+	char                check_hash[20], buffer_hash[20], *buffer = NULL;
 	bool                missing = false, update = false;
 
 	/*
@@ -2881,9 +6460,7 @@ save_repairs(connector *session)
 	 */
 
 	RB_FOREACH(found_file, Tree_Remote_Path, &Remote_Path) {
-		find_object.hash = found_file->hash;
-
-		found_object = RB_FIND(Tree_Objects, &Objects, &find_object);
+		found_object = find_object(found_file->hash);
 
 		if (found_object == NULL)
 			continue;
@@ -2904,47 +6481,48 @@ save_repairs(connector *session)
 			 * only update the altered files.
 			 */
 
-			if (missing == false) {
-				load_buffer(session, found_object);
+			buffer  = object_buffer(session, found_object);
 
-				check_hash = calculate_file_hash(
+			if (missing == false) {
+				calculate_file_hash(
 					found_file->path,
-					st.st_mode);
+					st.st_mode,
+					check_hash);
 
-				buffer_hash = calculate_object_hash(
-					found_object->buffer,
+				calculate_object_hash(
+					buffer,
 					found_object->buffer_size,
-					3);
+					3,
+					buffer_hash);
 
-				release_buffer(session, found_object);
-
-				if (strncmp(check_hash, buffer_hash, 40) == 0)
+				if (memcmp(check_hash, buffer_hash, 20) == 0)
 					update = false;
 			}
 
 			if (update == true) {
-				load_buffer(session, found_object);
-
 				save_file(found_file->path,
 					found_file->mode,
-					found_object->buffer,
+					buffer,
 					found_object->buffer_size,
 					session->verbosity,
-					session->display_depth);
-
-				release_buffer(session, found_object);
+					session->display_depth,
+					session->atomic_writes);
 
 				if (strstr(found_file->path, "UPDATING"))
 					extend_updating_list(session,
 						found_file->path);
 			}
+
+			release_object_buffer(found_object, buffer);
 		}
 	}
 
+	delta_cache_free(session);
+
 	/* Make sure no files are deleted. */
 
 	RB_FOREACH(remote_file, Tree_Remote_Path, &Remote_Path) {
-		local_file = RB_FIND(Tree_Local_Path, &Local_Path, remote_file);
+		local_file = find_file_path(&Local_Path_Table, remote_file->path);
 
 		if (local_file != NULL)
 			local_file->keep = true;
@@ -2952,150 +6530,307 @@ save_repairs(connector *session)
 }
 
 
+/*
+ * load_history_tip
+ *
+ * Procedure that finds the newest commit in the saved commit history, which
+ * save_commit_history always writes last, so that only newer commits need to
+ * be fetched.
+ */
+
+static void
+load_history_tip(connector *session)
+{
+	struct stat  file;
+	char         buffer[BUFFER_UNIT_SMALL + 1], *line = NULL;
+	ssize_t      bytes_read = 0;
+	off_t        offset = 0;
+	int          fd = -1, x = 0;
+
+	free(session->history_tip);
+	session->history_tip = NULL;
+
+	if ((fd = open(session->remote_history_file, O_RDONLY)) == -1)
+		return;
+
+	if (fstat(fd, &file) == 0) {
+		offset     = (file.st_size > BUFFER_UNIT_SMALL ? file.st_size - BUFFER_UNIT_SMALL : 0);
+		bytes_read = pread(fd, buffer, BUFFER_UNIT_SMALL, offset);
+	}
+
+	close(fd);
+
+	if (bytes_read < 42)
+		return;
+
+	/* Step back over the trailing newline to the start of the last line. */
+
+	buffer[bytes_read - 1] = '\0';
+
+	line = ((line = strrchr(buffer, '\n')) == NULL ? buffer : line + 1);
+
+	for (x = 0; x < 40; x++)
+		if (!isxdigit((uint8_t)line[x]))
+			return;
+
+	if ((line[40] != ' ') && (line[40] != '\0'))
+		return;
+
+	session->history_tip = strndup(line, 40);
+}
+
+
 /*
  * save_commit_history
  *
- * Procedure that saves the commit history to disk.
+ * Procedure that saves the commit history to disk.  Commits fetched on top of
+ * the saved history are appended to it, otherwise the history is replaced.
+ * The "want" is always written last so that load_history_tip can find it.
  */
 
 static void
 save_commit_history(connector *session)
 {
-	struct object_node *found_object = NULL;
-	char path[BUFFER_UNIT_SMALL];
-	int  fd, x = 0;
+	struct object_node *found_object = NULL, *want = NULL;
+	char     path[BUFFER_UNIT_SMALL], hash[20], *buffer = NULL, *position = NULL;
+	size_t   buffer_size = 0;
+	int      fd, x = 0;
+	uint32_t o = 0;
 
-	snprintf(path, BUFFER_UNIT_SMALL,
-		"%s.new",
-		session->remote_history_file);
+	want = find_object(illegible_hash(session->want, hash));
+
+	/*
+	 * Repairs can store an object more than once, so only write the copy
+	 * held in the lookup table.
+	 */
+
+	for (o = 0; o < session->objects; o++) {
+		found_object = session->object[o];
 
-	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
+		if ((found_object->type == 1) && (find_object(found_object->hash) == found_object))
+			buffer_size += 41 + (size_t)found_object->parents * 41;
+	}
 
-	if ((fd == -1) && (errno != EEXIST))
-		err(EXIT_FAILURE, "save_objects: write failure %s", path);
+	if ((buffer = (char *)malloc(buffer_size + 1)) == NULL)
+		err(EXIT_FAILURE, "save_commit_history: malloc");
 
-	RB_FOREACH(found_object, Tree_Objects, &Objects)
-		if (found_object->type == 1) {
-			write(fd, found_object->hash, 40);
+	position = buffer;
 
-			for (x = 0; x < found_object->parents; x++) {
-				write(fd, " ", 1);
-				write(fd, found_object->parent[x], 40);
-			}
+	for (o = 0; o <= session->objects; o++) {
+		if (o < session->objects) {
+			found_object = session->object[o];
+
+			if ((found_object->type != 1) || (found_object == want) || (find_object(found_object->hash) != found_object))
+				continue;
+		} else if ((found_object = want) == NULL) {
+			break;
+		}
 
-			write(fd, "\n", 1);
+		legible_hash(found_object->hash, position);
+		position += 40;
+
+		for (x = 0; x < found_object->parents; x++) {
+			*position++ = ' ';
+			legible_hash(found_object->parent + x * 20, position);
+			position += 40;
 		}
 
+		*position++ = '\n';
+	}
+
+	if (session->history_tip) {
+		fd = open(session->remote_history_file, O_WRONLY | O_APPEND);
+
+		if (fd == -1)
+			err(EXIT_FAILURE, "save_commit_history: cannot open %s", session->remote_history_file);
+
+		if (write(fd, buffer, (size_t)(position - buffer)) != position - buffer)
+			err(EXIT_FAILURE, "save_commit_history: write");
+
+		close(fd);
+		free(buffer);
+
+		return;
+	}
+
+	snprintf(path, BUFFER_UNIT_SMALL,
+		"%s.new",
+		session->remote_history_file);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd == -1)
+		err(EXIT_FAILURE, "save_commit_history: write failure %s", path);
+
+	if (write(fd, buffer, (size_t)(position - buffer)) != position - buffer)
+		err(EXIT_FAILURE, "save_commit_history: write");
+
 	close(fd);
-	chmod(path, 0644);
+	free(buffer);
 
 	if (((remove(session->remote_history_file)) != 0) && (errno != ENOENT))
-		err(EXIT_FAILURE, "save_objects: cannot remove %s", path);
+		err(EXIT_FAILURE, "save_commit_history: cannot remove %s", path);
 
 	if ((rename(path, session->remote_history_file)) != 0)
-		err(EXIT_FAILURE, "save_objects: cannot rename %s", path);
+		err(EXIT_FAILURE, "save_commit_history: cannot rename %s", path);
 }
 
 
 /*
- * save_objects
+ * save_worker
  *
- * Procedure that commits the objects and trees to disk.
+ * Function run by each writer thread that saves the files queued by
+ * save_objects.
  */
 
-static void
-save_objects(connector *session)
+static void *
+save_worker(void *argument)
 {
-	struct object_node *found_object = NULL, find_object;
-	struct file_node   *found_file = NULL;
-	char tree[41], path[BUFFER_UNIT_SMALL];
-	int  fd;
+	connector          *session = (connector *)argument;
+	struct file_node   *file = NULL;
+	struct object_node *object = NULL;
+	directory_handle    directory = { .fd = -1, .atomic = session->atomic_writes, .deferred = true };
+	char               *buffer = NULL;
 
-	/* Save the commit history. */
+	while ((file = (struct file_node *)work_queue_next(session->save_queue)) != NULL) {
+		object = find_object(file->hash);
+		buffer = object_buffer(session, object);
+
+		save_file_data(&directory,
+			file->path,
+			file->mode,
+			buffer,
+			object->buffer_size);
 
-	save_commit_history(session);
+		release_object_buffer(object, buffer);
+	}
 
-	/* Open the remote data file. */
+	close_directory_handle(&directory);
 
-	snprintf(path, BUFFER_UNIT_SMALL,
-		"%s.new",
-		session->remote_data_file);
+	return (NULL);
+}
 
-	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
 
-	if ((fd == -1) && (errno != EEXIST))
-		err(EXIT_FAILURE, "save_objects: write file failure %s", path);
+/*
+ * save_objects
+ *
+ * Procedure that commits the objects and trees to disk.
+ */
+
+static void
+save_objects(connector *session)
+{
+	struct object_node *found_object = NULL;
+	struct file_node   *found_file = NULL;
+	pthread_t          *thread = NULL;
+	directory_handle    handle = { .fd = -1, .atomic = session->atomic_writes, .deferred = true };
+	char                tree[20], want[20], hash[41];
+	char               *directory = NULL, *trim = NULL, *buffer = NULL;
+	size_t              directory_length = 0, length = 0;
+
+	/* The commit history is saved as soon as it is fetched, if enabled. */
 
-	chmod(path, 0644);
-	write(fd, session->want, strlen(session->want));
-	write(fd, "\n", 1);
+	if (!session->commit_history)
+		save_commit_history(session);
 
 	/* Find the tree object referenced in the commit. */
 
-	find_object.hash = session->want;
-	found_object     = RB_FIND(Tree_Objects, &Objects, &find_object);
+	found_object = find_object(illegible_hash(session->want, want));
 
 	if (found_object == NULL)
 		errc(EXIT_FAILURE, EINVAL,
 			"save_objects: cannot find %s",
 			session->want);
 
-	load_buffer(session, found_object);
-
 	if (memcmp(found_object->buffer, "tree ", 5) != 0)
 		errc(EXIT_FAILURE, EINVAL,
 			"save_objects: first object is not a commit");
 
-	memcpy(tree, found_object->buffer + 5, 40);
-	tree[40] = '\0';
-
-	release_buffer(session, found_object);
+	illegible_hash(found_object->buffer + 5, tree);
 
 	/* Recursively start processing the tree. */
 
-	process_tree(session, fd, tree, session->path_target);
-	close(fd);
+	process_tree(session, tree, session->path_target);
 
 	/* Save the remote data list. */
 
-	if (((remove(session->remote_data_file)) != 0) && (errno != ENOENT))
-		err(EXIT_FAILURE,
-			"save_objects: cannot remove %s",
-			session->remote_data_file);
+	save_remote_data(session);
 
-	if ((rename(path, session->remote_data_file)) != 0)
-		err(EXIT_FAILURE,
-			"save_objects: cannot rename %s",
-			session->remote_data_file);
+	/*
+	 * Save all of the new and modified files.  The directories are created
+	 * and the paths printed here, in order, while the writer threads fill
+	 * in the file contents.
+	 */
 
-	/* Save all of the new and modified files. */
+	if (session->jobs > 1) {
+		session->save_queue = work_queue_new();
+		thread = start_workers(session, save_worker, session);
+	}
 
 	RB_FOREACH(found_file, Tree_Remote_Path, &Remote_Path) {
 		if (!found_file->save)
 			continue;
 
-		find_object.hash = found_file->hash;
-		found_object = RB_FIND(Tree_Objects, &Objects, &find_object);
+		found_object = find_object(found_file->hash);
+
+		if (found_object == NULL)
+			errc(EXIT_FAILURE, EINVAL,
+				"save_objects: cannot find %s",
+				legible_hash(found_file->hash, hash));
+
+		/* Only create each directory once. */
+
+		trim = strrchr(found_file->path, '/');
+		length = (trim ? (size_t)(trim - found_file->path) : 0);
+
+		if ((directory == NULL) || (length != directory_length) || (strncmp(found_file->path, directory, length) != 0)) {
+			save_file_directory(found_file->path);
+			directory        = found_file->path;
+			directory_length = length;
+		}
+
+		save_file_display(found_file->path,
+			session->verbosity,
+			session->display_depth);
+
+		if (session->save_queue) {
+			work_queue_add(session->save_queue, found_file);
+		} else {
+			buffer = object_buffer(session, found_object);
+
+			save_file_data(&handle,
+				found_file->path,
+				found_file->mode,
+				buffer,
+				found_object->buffer_size);
+
+			release_object_buffer(found_object, buffer);
+		}
+
+		if (strstr(found_file->path, "UPDATING"))
+			extend_updating_list(session, found_file->path);
+	}
+
+	if (session->save_queue) {
+		work_queue_finish(session->save_queue);
+		join_workers(session, thread);
+		work_queue_free(session->save_queue);
+		session->save_queue = NULL;
+	}
+
+	close_directory_handle(&handle);
 
-		if (found_object == NULL)
-			errc(EXIT_FAILURE, EINVAL,
-				"save_objects: cannot find %s",
-				found_file->hash);
+	if (session->atomic_writes)
+		rename_saved_files();
 
-		load_buffer(session, found_object);
+	/* Release the layers cached while rebuilding lazy blobs. */
 
-		save_file(found_file->path,
-			found_file->mode,
-			found_object->buffer,
-			found_object->buffer_size,
-			session->verbosity,
-			session->display_depth);
+	delta_cache_free(session);
 
-		release_buffer(session, found_object);
+	/* Bring the local object store up to date. */
 
-		if (strstr(found_file->path, "UPDATING"))
-			extend_updating_list(session, found_file->path);
-	}
+	if (session->object_store)
+		save_object_store(session);
 }
 
 
@@ -3169,6 +6904,144 @@ extract_proxy_data(connector *session, const char *data)
 }
 
 
+/*
+ * extract_ignore_literal
+ *
+ * Function that returns the longest run of literal characters that every
+ * match of an ignore pattern must contain, or NULL if there isn't a useful
+ * one.  Bracket expressions, groups, alternations and quantified characters
+ * end a run.
+ */
+
+static char *
+extract_ignore_literal(const char *pattern)
+{
+	char   run[BUFFER_UNIT_SMALL], best[BUFFER_UNIT_SMALL];
+	size_t run_length = 0, best_length = 0, length = strlen(pattern);
+	size_t x = 0;
+	char   c = 0;
+
+	/*
+	 * The "(/.*)?$" suffix is optional, while alternations and other
+	 * groups could make any run optional.
+	 */
+
+	if ((length > 7) && (strcmp(pattern + length - 7, "(/.*)?$") == 0))
+		length -= 7;
+
+	if ((length >= BUFFER_UNIT_SMALL)
+		|| (memchr(pattern, '|', length))
+		|| (memchr(pattern, '(', length))
+		|| (memchr(pattern, ')', length)))
+		return (NULL);
+
+	while (length > 0) {
+		c = 0;
+
+		if ((*pattern == '\\') && (length > 1)) {
+			if (!isalnum((unsigned char)pattern[1]))
+				c = pattern[1];
+
+			pattern += 2;
+			length  -= 2;
+		} else if (*pattern == '[') {
+			pattern++;
+			length--;
+
+			if ((length > 0) && (*pattern == '^')) {
+				pattern++;
+				length--;
+			}
+
+			if ((length > 0) && (*pattern == ']')) {
+				pattern++;
+				length--;
+			}
+
+			while ((length > 0) && (*pattern != ']')) {
+				if ((length > 1) && (*pattern == '[')
+					&& ((pattern[1] == ':')
+					|| (pattern[1] == '.')
+					|| (pattern[1] == '='))) {
+					c = pattern[1];
+					pattern += 2;
+					length  -= 2;
+
+					while ((length > 1)
+						&& ((*pattern != c)
+						|| (pattern[1] != ']'))) {
+						pattern++;
+						length--;
+					}
+
+					c = 0;
+
+					if (length < 2)
+						return (NULL);
+
+					pattern++;
+					length--;
+				}
+
+				pattern++;
+				length--;
+			}
+
+			if (length > 0) {
+				pattern++;
+				length--;
+			}
+		} else if (*pattern == '{') {
+			while ((length > 0) && (*pattern != '}')) {
+				pattern++;
+				length--;
+			}
+
+			if (length > 0) {
+				pattern++;
+				length--;
+			}
+		} else if (strchr(".^$*+?\\", *pattern) == NULL) {
+			c = *pattern++;
+			length--;
+		} else {
+			pattern++;
+			length--;
+		}
+
+		/* Characters followed by '*', '?' or '{' are optional. */
+
+		for (x = 0; (c) && (x < length) && (strchr("*+?{", pattern[x])); x++)
+			if (pattern[x] != '+')
+				c = 0;
+
+		if (c)
+			run[run_length++] = c;
+
+		if ((c == 0) || ((length > 0) && (*pattern == '+'))) {
+			if (run_length > best_length) {
+				memcpy(best, run, run_length);
+				best_length = run_length;
+			}
+
+			run_length = 0;
+		}
+	}
+
+	if (run_length > best_length) {
+		memcpy(best, run, run_length);
+		best_length = run_length;
+	}
+
+	if (best_length < 2)
+		return (NULL);
+
+	best[best_length] = '\0';
+
+	return (strdup(best));
+}
+
+
 /*
  * add_ignore
  *
@@ -3182,10 +7055,10 @@ add_ignore(connector *session, const char *string)
 	int          ret_temp;
 	bool         negate = (string[0] == '!' ? true : false);
 	ignore_node *node = NULL;
+	const char  *pattern = string + (negate ? 1 : 0);
+	size_t       length = strlen(pattern);
 
-	ret_temp = regcomp(&reg_temp,
-		string + (negate ? 1 : 0),
-		REG_EXTENDED | REG_NOSUB);
+	ret_temp = regcomp(&reg_temp, pattern, REG_EXTENDED | REG_NOSUB);
 
 	if (ret_temp) {
 		warnx("! warning: can't compile %s, ignoring\n", string);
@@ -3204,10 +7077,68 @@ add_ignore(connector *session, const char *string)
 			err(EXIT_FAILURE, "add_ignore: malloc 3");
 
 		memcpy(node->pattern, &reg_temp, sizeof(regex_t));
-		node->negate = negate;
+		node->negate  = negate;
+		node->literal = extract_ignore_literal(pattern);
+		node->subtree = 0;
+
+		/*
+		 * Patterns that match a directory (or its contents) and then
+		 * anything below it can be checked once per directory.
+		 */
+
+		if ((strchr(pattern, '|') == NULL) && (length > 7)
+			&& (pattern[length - 8] != '\\')
+			&& (strcmp(pattern + length - 7, "(/.*)?$") == 0))
+			node->subtree = IGNORE_DIRECTORY;
+
+		if ((strchr(pattern, '|') == NULL) && (length > 4)
+			&& (pattern[length - 5] != '\\')
+			&& (strcmp(pattern + length - 4, "/.*$") == 0))
+			node->subtree = IGNORE_CONTENTS;
 
 		session->ignore[session->ignores++] = node;
+
+		/* Cached directory verdicts are stale now. */
+
+		hash_table_free(&Ignore_Directory);
+	}
+}
+
+
+/*
+ * add_sparse_path
+ *
+ * Procedure that adds a path, relative to the target directory, to the list
+ * of subtrees that make up a sparse checkout.
+ */
+
+static void
+add_sparse_path(connector *session, const char *string)
+{
+	size_t length = 0;
+
+	while (*string == '/')
+		string++;
+
+	length = strlen(string);
+
+	while ((length > 0) && (string[length - 1] == '/'))
+		length--;
+
+	if (length == 0) {
+		warnx("! warning: empty sparse path, ignoring\n");
+		return;
 	}
+
+	session->sparse_path = (char **)realloc(
+		session->sparse_path,
+		(session->sparse_paths + 1) * sizeof(char *));
+
+	if (session->sparse_path == NULL)
+		err(EXIT_FAILURE, "add_sparse_path: malloc");
+
+	if ((session->sparse_path[session->sparse_paths++] = strndup(string, length)) == NULL)
+		err(EXIT_FAILURE, "add_sparse_path: strndup");
 }
 
 
@@ -3220,7 +7151,7 @@ add_ignore(connector *session, const char *string)
 static void
 load_config_section(connector *session, const ucl_object_t *section)
 {
-	const ucl_object_t *pair = NULL, *ignore = NULL;
+	const ucl_object_t *pair = NULL, *ignore = NULL, *sparse = NULL;
 	ucl_object_iter_t   its = NULL, iti = NULL;
 	const char         *key = NULL, *string = NULL;
 	char                temp[BUFFER_UNIT_SMALL];
@@ -3241,6 +7172,9 @@ load_config_section(connector *session, const ucl_object_t *section)
 		else
 			integer = 0;
 
+		if (strnstr(key, "atomic_writes", 13) != NULL)
+			session->atomic_writes = boolean;
+
 		if (strnstr(key, "branch", 6) != NULL) {
 			free(session->branch);
 			session->branch = strdup(string);
@@ -3249,6 +7183,12 @@ load_config_section(connector *session, const ucl_object_t *section)
 		if (strnstr(key, "commit_history", 14) != NULL)
 			session->commit_history = boolean;
 
+		if (strnstr(key, "delta_cache_size", 16) != NULL)
+			session->delta_cache_size = (uint32_t)integer;
+
+		if (strnstr(key, "diff_update", 11) != NULL)
+			session->diff_update = boolean;
+
 		if (strnstr(key, "display_depth", 16) != NULL)
 			session->display_depth = (uint8_t)integer;
 
@@ -3298,9 +7238,18 @@ load_config_section(connector *session, const ucl_object_t *section)
 			ucl_object_iterate_free(iti);
 		}
 
+		if (strnstr(key, "jobs", 4) != NULL)
+			session->jobs = (uint16_t)integer;
+
+		if (strnstr(key, "lazy_blobs", 10) != NULL)
+			session->lazy_blobs = boolean;
+
 		if (strnstr(key, "low_memory", 10) != NULL)
 			session->low_memory = boolean;
 
+		if (strnstr(key, "object_store", 12) != NULL)
+			session->object_store = boolean;
+
 		if (strnstr(key, "port", 4) != NULL)
 			session->port = (uint16_t)integer;
 
@@ -3344,6 +7293,18 @@ load_config_section(connector *session, const ucl_object_t *section)
 			session->source_address = strdup(string);
 		}
 
+		if ((strnstr(key, "sparse_paths", 12) != NULL) && (ucl_object_type(pair) == UCL_ARRAY)) {
+			iti = ucl_object_iterate_new(pair);
+
+			while ((sparse = ucl_object_iterate_safe(iti, true)))
+				add_sparse_path(session, ucl_object_tostring(sparse));
+
+			ucl_object_iterate_free(iti);
+		}
+
+		if (strnstr(key, "stats", 5) != NULL)
+			session->stats = boolean;
+
 		if (strnstr(key, "target_directory", 16) != NULL)
 			target = true;
 		else if (strnstr(key, "target", 6) != NULL)
@@ -3656,16 +7617,12 @@ load_gitignore(connector *session)
 
 		/* Complete and retain the pattern(s). */
 
-		if (directory_only) {
+		if (directory_only)
 			snprintf(target + target_offset, 4, ".*$");
-			add_ignore(session, target);
-		} else {
-			snprintf(target + target_offset, 5, "/.*$");
-			add_ignore(session, target);
+		else
+			snprintf(target + target_offset, 8, "(/.*)?$");
 
-			snprintf(target + target_offset, 2, "$");
-			add_ignore(session, target);
-		}
+		add_ignore(session, target);
 
 		if (session->verbosity > 2)
 			fprintf(stderr, "# .gitignore: %-51s ==> %s\n",
@@ -3735,6 +7692,214 @@ extract_command_line_want(connector *session, char *option)
 }
 
 
+/*
+ * merge_section_status
+ *
+ * Function that folds the wait status of a section's process into the result
+ * of the sections collected so far.
+ */
+
+static int
+merge_section_status(int result, int status)
+{
+	if ((!WIFEXITED(status)) || ((WEXITSTATUS(status) != EXIT_SUCCESS) && (WEXITSTATUS(status) != 2)))
+		return (EXIT_FAILURE);
+
+	if ((WEXITSTATUS(status) == 2) && (result == EXIT_SUCCESS))
+		return (2);
+
+	return (result);
+}
+
+
+/*
+ * run_sections
+ *
+ * Function that updates several sections at once in separate processes,
+ * displaying the output of each section in the order requested once it
+ * finishes.  Sections that use the same repository are updated one after
+ * another by a single process, so each of them finds the objects and the TLS
+ * session saved by the ones before it, while different repositories are
+ * updated side by side.  Each section's process returns -1 with the command
+ * line arguments narrowed down to its own section and carries on with the
+ * update, while the parent returns EXIT_FAILURE if any of the sections
+ * failed, 2 if any of them were repaired and EXIT_SUCCESS otherwise.
+ */
+
+static int
+run_sections(const char *configuration_file, int *argc, char ***argv, int sections)
+{
+	connector   check;
+	FILE      **output = NULL;
+	pid_t      *child = NULL, section = 0;
+	char      **target = NULL, **source = NULL, **child_argv = NULL, *list[2];
+	char        buffer[BUFFER_UNIT_SMALL];
+	size_t      length = 0;
+	int        *leader = NULL;
+	int         result = EXIT_SUCCESS, status = 0, x = 0, y = 0;
+
+	output     = (FILE **)calloc((size_t)sections, sizeof(FILE *));
+	child      = (pid_t *)calloc((size_t)sections, sizeof(pid_t));
+	target     = (char **)calloc((size_t)sections, sizeof(char *));
+	source     = (char **)calloc((size_t)sections, sizeof(char *));
+	leader     = (int *)calloc((size_t)sections, sizeof(int));
+	child_argv = (char **)calloc((size_t)(*argc - sections + 2), sizeof(char *));
+
+	if ((output == NULL) || (child == NULL) || (target == NULL) || (source == NULL)
+		|| (leader == NULL) || (child_argv == NULL))
+		err(EXIT_FAILURE, "run_sections: calloc");
+
+	/*
+	 * Sections that update the same directory cannot run side by side, and
+	 * sections that use the same repository are grouped behind the first
+	 * of them.
+	 */
+
+	for (x = 0; x < sections; x++) {
+		bzero(&check, sizeof(connector));
+
+		list[0] = (*argv)[0];
+		list[1] = (*argv)[x + 1];
+
+		load_config(&check, configuration_file, list, 2);
+		target[x] = check.path_target;
+
+		length = strlen(check.host) + strlen(check.repository_path) + 1;
+
+		if ((source[x] = (char *)malloc(length)) == NULL)
+			err(EXIT_FAILURE, "run_sections: malloc");
+
+		snprintf(source[x], length,
+			"%s%s",
+			check.host,
+			check.repository_path);
+
+		leader[x] = x;
+
+		for (y = 0; y < x; y++) {
+			if (strcmp(target[x], target[y]) == 0)
+				errc(EXIT_FAILURE, EINVAL,
+					"The [%s] and [%s] sections both update %s",
+					(*argv)[y + 1],
+					(*argv)[x + 1],
+					target[x]);
+
+			if ((leader[x] == x) && (strcmp(source[x], source[y]) == 0))
+				leader[x] = leader[y];
+		}
+	}
+
+	/* Start a process for each repository, passing along the options. */
+
+	child_argv[0] = (*argv)[0];
+
+	for (x = sections + 1; x < *argc; x++)
+		child_argv[x - sections + 1] = (*argv)[x];
+
+	for (x = 0; x < sections; x++)
+		if ((output[x] = tmpfile()) == NULL)
+			err(EXIT_FAILURE, "run_sections: tmpfile");
+
+	for (x = 0; x < sections; x++) {
+		if (leader[x] != x)
+			continue;
+
+		fflush(stdout);
+		fflush(stderr);
+
+		if ((child[x] = fork()) == -1)
+			err(EXIT_FAILURE, "run_sections: fork");
+
+		if (child[x] > 0)
+			continue;
+
+		/* Update the repository's sections in order, one at a time. */
+
+		for (y = x; y < sections; y++) {
+			if (leader[y] != x)
+				continue;
+
+			if ((section = fork()) == -1)
+				err(EXIT_FAILURE, "run_sections: fork");
+
+			/*
+			 * Line buffering keeps the lines written to stdout and
+			 * stderr whole and in order now that both go to the
+			 * same file.
+			 */
+
+			if (section == 0) {
+				dup2(fileno(output[y]), STDOUT_FILENO);
+				dup2(fileno(output[y]), STDERR_FILENO);
+				setvbuf(stdout, NULL, _IOLBF, 0);
+
+				child_argv[1] = (*argv)[y + 1];
+
+				for (x = 0; x < sections; x++) {
+					fclose(output[x]);
+					free(target[x]);
+					free(source[x]);
+				}
+
+				free(leader);
+				free(source);
+				free(target);
+				free(child);
+				free(output);
+
+				*argc = *argc - sections + 1;
+				*argv = child_argv;
+
+				return (-1);
+			}
+
+			while (waitpid(section, &status, 0) == -1)
+				if (errno != EINTR)
+					err(EXIT_FAILURE, "run_sections: waitpid");
+
+			result = merge_section_status(result, status);
+		}
+
+		exit(result);
+	}
+
+	/* Display the output of each section and collect the results. */
+
+	for (x = 0; x < sections; x++) {
+		if (child[leader[x]] > 0) {
+			while (waitpid(child[leader[x]], &status, 0) == -1)
+				if (errno != EINTR)
+					err(EXIT_FAILURE, "run_sections: waitpid");
+
+			result = merge_section_status(result, status);
+			child[leader[x]] = 0;
+		}
+
+		rewind(output[x]);
+
+		while ((length = fread(buffer, 1, sizeof(buffer), output[x])) > 0)
+			fwrite(buffer, 1, length, stdout);
+
+		fflush(stdout);
+		fclose(output[x]);
+	}
+
+	for (x = 0; x < sections; x++) {
+		free(target[x]);
+		free(source[x]);
+	}
+
+	free(child_argv);
+	free(leader);
+	free(source);
+	free(target);
+	free(child);
+	free(output);
+
+	return (result);
+}
+
+
 /*
  * usage
  *
@@ -3745,9 +7910,11 @@ static void
 usage(const char *configuration_file)
 {
 	fprintf(stderr,
-		"Usage: gitup <section> [-cklrV] [-h checksum] [-t tag] "
-		"[-u pack file] [-v verbosity] [-w checksum]\n"
-		"  Please see %s for the list of <section> options.\n\n"
+		"Usage: gitup <section> [<section> ...] [-cklrTV] [-h checksum] "
+		"[-t tag] [-u pack file] [-v verbosity] [-w checksum]\n"
+		"  Please see %s for the list of <section> options.\n"
+		"  Several sections are updated at once, side by side unless they\n"
+		"  use the same repository.\n\n"
 		"  Options:\n"
 		"    -C  Override the default configuration file.\n"
 		"    -c  Force gitup to clone the repository.\n"
@@ -3757,6 +7924,7 @@ usage(const char *configuration_file)
 		"    -k  Save a copy of the pack data to the current working directory.\n"
 		"    -l  Low memory mode -- stores temporary object data to disk.\n"
 		"    -r  Repair all missing/modified files in the local repository.\n"
+		"    -T  Write per-phase timing and resource statistics as JSON lines.\n"
 		"    -t  Fetch the commit referenced by the specified tag.\n"
 		"    -u  Path to load a copy of the pack data, skipping the download.\n"
 		"    -v  How verbose the output should be (0 = no output, 1 = the default\n"
@@ -3778,7 +7946,6 @@ usage(const char *configuration_file)
 int
 main(int argc, char **argv)
 {
-	struct object_node *object = NULL, *next_object = NULL;
 	struct file_node   *file   = NULL, *next_file   = NULL;
 
 	char     *command = NULL, *display_path = NULL, *temp = NULL;
@@ -3789,14 +7956,16 @@ main(int argc, char **argv)
 	char      gitup_revision[BUFFER_UNIT_SMALL];
 	char      gitup_revision_path[BUFFER_UNIT_SMALL];
 	char      cache_path[BUFFER_UNIT_SMALL], git_check[BUFFER_UNIT_SMALL];
+	char      hash[41], ref_delta_hash[41];
 	int       option = 0;
 	size_t    length = 0;
 	int       x = 0, base64_credentials_length = 0, skip_optind = 0;
-	uint32_t  o = 0, local_file_count = 0;
+	int       sections = 0;
+	uint32_t  o = 0, local_file_count = 0, stored_repairs = 0;
 	uint8_t   save_verbosity = 0;
 	bool      encoded = false, just_added = false;
 	bool      current_repository = false, path_target_exists = false;
-	bool      remote_data_exists = false, remote_history_exists = false;
+	bool      remote_data_exists = false;
 	bool      pack_data_exists = false;
 	bool      pruned = false;
 	DIR      *directory = NULL;
@@ -3810,7 +7979,10 @@ main(int argc, char **argv)
 	connector session = {
 		.ssl                 = NULL,
 		.ctx                 = NULL,
-		.socket_descriptor   = 0,
+		.tls_session         = NULL,
+		.tls_session_file    = NULL,
+		.reconnect           = false,
+		.socket_descriptor   = -1,
 		.source_address      = NULL,
 		.host                = NULL,
 		.host_bracketed      = NULL,
@@ -3828,6 +8000,7 @@ main(int argc, char **argv)
 		.want                = NULL,
 		.response            = NULL,
 		.response_blocks     = 0,
+		.pack                = NULL,
 		.response_size       = 0,
 		.clone               = false,
 		.repair              = false,
@@ -3839,8 +8012,16 @@ main(int argc, char **argv)
 		.path_work           = NULL,
 		.remote_data_file    = NULL,
 		.remote_history_file = NULL,
+		.history_tip         = NULL,
+		.remote_tree         = NULL,
+		.remote_trees        = 0,
+		.index_file          = NULL,
+		.index_time          = 0,
 		.ignore              = NULL,
 		.ignores             = 0,
+		.sparse_path         = NULL,
+		.sparse_paths        = 0,
+		.filter_blobs        = false,
 		.commit_history      = false,
 		.keep_pack_file      = false,
 		.use_pack_file       = false,
@@ -3848,8 +8029,39 @@ main(int argc, char **argv)
 		.display_depth       = 0,
 		.updating            = NULL,
 		.low_memory          = false,
+		.lazy_blobs          = false,
+		.atomic_writes       = false,
+		.diff_update         = false,
 		.cache               = -1,
 		.cache_length        = 0,
+		.cache_segment       = NULL,
+		.cache_segment_size  = NULL,
+		.cache_segments      = 0,
+		.cache_segment_used  = 0,
+		.jobs                = 0,
+		.scan_queue          = NULL,
+		.delta_queue         = NULL,
+		.save_queue          = NULL,
+		.delta_cache_size    = 0,
+		.delta_cache_limit   = 0,
+		.delta_cache_used    = 0,
+		.phase_start         = { 0, 0 },
+		.phase_usage         = { .ru_maxrss = 0 },
+		.stats               = false,
+		.bytes_received      = 0,
+		.bytes_sent          = 0,
+		.phase_received      = 0,
+		.phase_sent          = 0,
+		.object_store        = false,
+		.store_path          = NULL,
+		.store_lock          = -1,
+		.store_data          = NULL,
+		.store_data_size     = 0,
+		.store_index         = NULL,
+		.store_index_size    = 0,
+		.store_objects       = 0,
+		.store_file          = NULL,
+		.store_files         = 0,
 		};
 
 	configuration_file = strdup(CONFIG_FILE_PATH);
@@ -3881,6 +8093,22 @@ main(int argc, char **argv)
 			}
 		}
 
+	/* Update each section separately when more than one is requested. */
+
+	while ((sections + 1 < argc) && (argv[sections + 1][0] != '-'))
+		sections++;
+
+	if ((sections > 1) && ((x = run_sections(configuration_file, &argc, &argv, sections)) != -1))
+		exit(x);
+
+	/* Start timing the first phase. */
+
+	if (clock_gettime(CLOCK_MONOTONIC_FAST, &session.phase_start) == -1)
+		err(EXIT_FAILURE, "main: clock_gettime");
+
+	if (getrusage(RUSAGE_SELF, &session.phase_usage) == -1)
+		err(EXIT_FAILURE, "main: getrusage");
+
 	/* Load the configuration file to learn what section is being requested. */
 
 	skip_optind = load_config(&session, configuration_file, argv, argc);
@@ -3890,7 +8118,7 @@ main(int argc, char **argv)
 
 	/* Process the command line parameters. */
 
-	while ((option = getopt(argc, argv, "C:cd:h:I:klrS:t:u:v:w:")) != -1) {
+	while ((option = getopt(argc, argv, "C:cd:h:I:klrS:Tt:u:v:w:")) != -1) {
 		switch (option) {
 			case 'C':
 				if (session.verbosity)
@@ -3922,6 +8150,9 @@ main(int argc, char **argv)
 			case 'S':
 				session.source_address = strdup(optarg);
 				break;
+			case 'T':
+				session.stats = true;
+				break;
 			case 't':
 				session.tag = strdup(optarg);
 				break;
@@ -4013,6 +8244,23 @@ main(int argc, char **argv)
 		session.proxy_credentials[0] = '\0';
 	}
 
+	/* Use one job per processor unless otherwise configured. */
+
+	if (session.jobs == 0)
+		session.jobs = (uint16_t)MAX(1, MIN(sysconf(_SC_NPROCESSORS_ONLN), 256));
+
+	/* Size the delta base cache, keeping it small in low memory mode. */
+
+	if (session.delta_cache_size == 0)
+		session.delta_cache_size = (session.low_memory ? 16 : 96);
+
+	session.delta_cache_limit = (uint64_t)session.delta_cache_size * 1024 * 1024;
+
+	/* Low memory mode already keeps the objects out of memory. */
+
+	if (session.low_memory)
+		session.lazy_blobs = false;
+
 	/* If a tag and a want are specified, warn and exit. */
 
 	if ((session.tag != NULL) && (session.want != NULL))
@@ -4045,6 +8293,36 @@ main(int argc, char **argv)
 		session.path_work,
 		session.section);
 
+	/*
+	 * The TLS session is shared by every section that uses the host and
+	 * the object store by every section that uses the repository.
+	 */
+
+	length = strlen(session.path_work) + strlen(session.host) + 6;
+
+	if ((session.tls_session_file = (char *)malloc(length)) == NULL)
+		err(EXIT_FAILURE, "main: malloc");
+
+	snprintf(session.tls_session_file, length,
+		"%s/%s.tls",
+		session.path_work,
+		session.host);
+
+	length = strlen(session.path_work) + strlen(session.host) + strlen(session.repository_path) + 2;
+
+	if ((session.store_path = (char *)malloc(length)) == NULL)
+		err(EXIT_FAILURE, "main: malloc");
+
+	snprintf(session.store_path, length,
+		"%s/%s%s",
+		session.path_work,
+		session.host,
+		session.repository_path);
+
+	for (temp = session.store_path + strlen(session.path_work) + 1; *temp; temp++)
+		if (*temp == '/')
+			*temp = '_';
+
 	/* If non-alphanumerics exist in the section, encode them. */
 
 	temp   = strdup(session.remote_data_file);
@@ -4090,6 +8368,17 @@ main(int argc, char **argv)
 
 	free(temp);
 
+	/* Build the stat cache path. */
+
+	length = strlen(session.remote_data_file) + 7;
+
+	if ((session.index_file = (char *)malloc(length)) == NULL)
+		err(EXIT_FAILURE, "main: malloc");
+
+	snprintf(session.index_file, length,
+		"%s.index",
+		session.remote_data_file);
+
 	/*
 	 * If the remote files list or repository are missing, then a clone
 	 * must be performed.
@@ -4099,7 +8388,8 @@ main(int argc, char **argv)
 	pack_data_exists      = path_exists(session.pack_data_file);
 /*	pack_history_exists   = path_exists(session.pack_history_file); */
 	remote_data_exists    = path_exists(session.remote_data_file);
-	remote_history_exists = path_exists(session.remote_history_file);
+
+	report_phase(&session, "load config");
 
 	/* Setup the temporary object cache file. */
 
@@ -4141,6 +8431,24 @@ main(int argc, char **argv)
 	else
 		session.clone = true;
 
+	/* Repairs rehash every file, so only load the stat cache otherwise. */
+
+	if ((session.clone == false) && (session.repair == false))
+		load_index(&session);
+
+	if ((session.clone == false) && (session.object_store)) {
+		lock_object_store(&session, LOCK_SH);
+		load_object_store(&session);
+		lock_object_store(&session, LOCK_UN);
+	}
+
+	report_phase(&session, "load remote data");
+
+	/* Clones and repairs need to know what is actually in the local tree. */
+
+	if ((session.clone) || (session.repair))
+		session.diff_update = false;
+
 	if (path_target_exists == true) {
 		if (session.verbosity)
 			fprintf(stderr, "# Scanning local repository...\n");
@@ -4158,7 +8466,13 @@ main(int argc, char **argv)
 				"rerun gitup.",
 				git_check);
 
-		scan_local_repository(&session, session.path_target);
+		if (session.diff_update) {
+			load_local_tree(&session);
+			report_phase(&session, "load local tree");
+		} else {
+			scan_local_tree(&session);
+			report_phase(&session, "scan local tree");
+		}
 	} else {
 		session.clone = true;
 	}
@@ -4212,6 +8526,21 @@ main(int argc, char **argv)
 
 		if (session.low_memory)
 			fprintf(stderr, "# Low memory mode: Yes\n");
+
+		if (session.lazy_blobs)
+			fprintf(stderr, "# Lazy blobs: Yes\n");
+
+		if (session.atomic_writes)
+			fprintf(stderr, "# Atomic writes: Yes\n");
+
+		if (session.diff_update)
+			fprintf(stderr, "# Diff driven update: Yes\n");
+
+		for (x = 0; x < session.sparse_paths; x++)
+			fprintf(stderr, "# Sparse path: %s\n", session.sparse_path[x]);
+
+		if (session.object_store)
+			fprintf(stderr, "# Object store: Yes\n");
 	}
 
 	/* Adjust the display depth to include path_target. */
@@ -4223,19 +8552,22 @@ main(int argc, char **argv)
 			session.display_depth++;
 	}
 
-	/* Setup the session to the server. */
-
-	connect_server(&session);
-
-	if (session.proxy_host)
-		create_tunnel(&session);
+	/*
+	 * The connection to the server is opened by the first command sent,
+	 * so runs that need nothing from the server never connect.
+	 */
 
-	setup_ssl(&session);
+	load_tls_session(&session);
 
 	/* Execute the fetch, unpack, apply deltas and save. */
 
-	if ((!session.use_pack_file) || ((session.use_pack_file) && (!pack_data_exists)))
+	if ((!session.use_pack_file) || ((session.use_pack_file) && (!pack_data_exists))) {
+		open_connection(&session);
+		report_phase(&session, "connect");
 		get_commit_details(&session);
+	}
+
+	report_phase(&session, "fetch details");
 
 	if ((session.have) && (session.want) && (strncmp(session.have, session.want, 40) == 0))
 		current_repository = true;
@@ -4243,18 +8575,26 @@ main(int argc, char **argv)
 	/* Fetch the commit history. */
 
 	if (session.commit_history) {
-		load_pack(&session, session.pack_history_file, true);
+		load_history_tip(&session);
+
+		if ((session.use_pack_file) && (path_exists(session.pack_history_file))) {
+			free(session.history_tip);
+			session.history_tip = NULL;
+		}
 
-		if (!remote_history_exists)
+		if ((session.history_tip == NULL) || (strncmp(session.history_tip, session.want, 40) != 0)) {
+			load_pack(&session, session.pack_history_file, true);
+			apply_deltas(&session);
 			save_commit_history(&session);
+		}
 	}
 
 	/* When pulling, first ensure the local tree is pristine. */
 
 	if ((session.repair) || (!session.clone)) {
-		command = build_repair_command(&session);
+		command = build_repair_command(&session, &stored_repairs);
 
-		if (command == NULL) {
+		if ((command == NULL) && (stored_repairs == 0)) {
 			session.repair = false;
 		} else {
 			session.repair = true;
@@ -4262,9 +8602,15 @@ main(int argc, char **argv)
 			if (session.verbosity)
 				fprintf(stderr, "# Action: repair\n");
 
-			fetch_pack(&session, command);
-			apply_deltas(&session);
+			if (command) {
+				fetch_pack(&session, command, NULL);
+				report_phase(&session, "fetch repairs");
+				apply_deltas(&session);
+				report_phase(&session, "apply repair deltas");
+			}
+
 			save_repairs(&session);
+			report_phase(&session, "save repairs");
 		}
 	}
 
@@ -4279,7 +8625,13 @@ main(int argc, char **argv)
 				(session.clone ? "clone" : "pull"));
 
 		apply_deltas(&session);
+		report_phase(&session, "apply deltas");
+
+		if (session.sparse_paths > 0)
+			fetch_sparse_objects(&session);
+
 		save_objects(&session);
+		report_phase(&session, "save objects");
 	}
 
 	/* Save .gituprevision. */
@@ -4299,7 +8651,8 @@ main(int argc, char **argv)
 			gitup_revision,
 			(uint32_t)strlen(gitup_revision),
 			0,
-			0);
+			0,
+			session.atomic_writes);
 	}
 
 	/* Wrap it all up. */
@@ -4307,9 +8660,6 @@ main(int argc, char **argv)
 	if (session.cache != -1)
 		close(session.cache);
 
-	RB_FOREACH_SAFE(file, Tree_Local_Hash, &Local_Hash, next_file)
-		RB_REMOVE(Tree_Local_Hash, &Local_Hash, file);
-
 	RB_FOREACH_SAFE(file, Tree_Local_Path, &Local_Path, next_file) {
 		if ((file->keep == false) && ((current_repository == false) || (session.repair == true))) {
 			if (ignore_file(&session, file->path, IGNORE_SKIP_DELETE))
@@ -4338,25 +8688,15 @@ main(int argc, char **argv)
 
 			if (pruned && session.verbosity && session.display_depth == 0)
 				printf(" - %s\n", file->path);
-
 		}
-
-		RB_REMOVE(Tree_Local_Path, &Local_Path, file);
-		file_node_free(file);
 	}
 
-	RB_FOREACH_SAFE(file, Tree_Remote_Path, &Remote_Path, next_file) {
-		RB_REMOVE(Tree_Remote_Path, &Remote_Path, file);
-		file_node_free(file);
-	}
+	/* Save the stat cache. */
 
-	RB_FOREACH_SAFE(file, Tree_Trim_Path, &Trim_Path, next_file) {
-		RB_REMOVE(Tree_Trim_Path, &Trim_Path, file);
-		file_node_free(file);
-	}
+	if ((session.want) && (path_exists(session.path_target)))
+		save_index(&session);
 
-	RB_FOREACH_SAFE(object, Tree_Objects, &Objects, next_object)
-		RB_REMOVE(Tree_Objects, &Objects, object);
+	report_phase(&session, "prune and save index");
 
 	for (o = 0; o < session.objects; o++) {
 		if (session.verbosity > 2)
@@ -4366,13 +8706,19 @@ main(int argc, char **argv)
 				session.object[o]->type,
 				session.object[o]->offset_pack,
 				session.object[o]->buffer_size,
-				session.object[o]->hash,
+				legible_hash(session.object[o]->hash, hash),
 				session.object[o]->index_delta,
-				session.object[o]->ref_delta_hash);
+				(session.object[o]->ref_delta_hash ? legible_hash(session.object[o]->ref_delta_hash, ref_delta_hash) : ""));
 
-		object_node_free(session.object[o]);
+		/* Object data in low memory mode lives in the cache mapping. */
+
+		if (!session.low_memory)
+			free(session.object[o]->buffer);
 	}
 
+	for (o = 0; o < session.cache_segments; o++)
+		munmap(session.cache_segment[o], session.cache_segment_size[o]);
+
 	if ((session.verbosity) && (session.updating))
 		fprintf(stderr,
 			"#\n# Please review the following file(s) for "
@@ -4381,13 +8727,29 @@ main(int argc, char **argv)
 
 	for (x = 0; x < session.ignores; x++) {
 		regfree(session.ignore[x]->pattern);
+		free(session.ignore[x]->pattern);
+		free(session.ignore[x]->literal);
 		free(session.ignore[x]);
 	}
 
+	free_object_store(&session);
+
+	if (session.store_lock != -1)
+		close(session.store_lock);
+
 	free(configuration_file);
 	free(session.ignore);
+
+	for (x = 0; x < session.sparse_paths; x++)
+		free(session.sparse_path[x]);
+
+	free(session.sparse_path);
 	free(session.response);
 	free(session.object);
+	free(session.store_file);
+	free(session.remote_tree);
+	free(session.cache_segment);
+	free(session.cache_segment_size);
 	free(session.source_address);
 	free(session.host);
 	free(session.host_bracketed);
@@ -4407,14 +8769,30 @@ main(int argc, char **argv)
 	free(session.path_work);
 	free(session.remote_data_file);
 	free(session.remote_history_file);
+	free(session.history_tip);
+	free(session.index_file);
 	free(session.updating);
 
-	if (session.ssl) {
-		SSL_shutdown(session.ssl);
+	/* Release every tree node, path and checksum at once. */
+
+	hash_table_free(&Objects);
+	hash_table_free(&Local_Hash);
+	hash_table_free(&Local_Path_Table);
+	hash_table_free(&Remote_Path_Table);
+	hash_table_free(&Ignore_Directory);
+	arena_free();
+
+	close_connection(&session);
+	save_tls_session(&session);
+
+	if (session.tls_session)
+		SSL_SESSION_free(session.tls_session);
+
+	free(session.tls_session_file);
+	free(session.store_path);
+
+	if (session.ctx)
 		SSL_CTX_free(session.ctx);
-		close(session.socket_descriptor);
-		SSL_free(session.ssl);
-	}
 
 	if (session.repair == true)
 		fprintf(stderr,